@@ -20,10 +20,52 @@
 
 */
 #include "staj.h"
+#include "staj_pow5.h"
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <stdint.h>
+#include <float.h>
+#include <locale.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+/* the SSSE3 UTF-8 check is built anyway and chosen at run time */
+#define UTF8_DISPATCH 1
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* returned by next_char and friends at the end of the input */
+#define END_OF_INPUT -1
+
+static inline
+void* staj_malloc(const staj_allocator* a, size_t size) {
+  return a == NULL ? malloc(size) : a->alloc(a->ud, size);
+}
+
+static inline
+void* staj_realloc(const staj_allocator* a, void* ptr, size_t size) {
+  return a == NULL ? realloc(ptr, size) : a->resize(a->ud, ptr, size);
+}
+
+static inline
+void staj_free(const staj_allocator* a, void* ptr) {
+  if (a == NULL) {
+    free(ptr);
+  } else {
+    a->release(a->ud, ptr);
+  }
+}
 
 static inline
 void init_errno(staj_context* context) {
@@ -80,22 +122,157 @@ int peek_context(staj_context* context, int* c) {
 }
 
 static inline
-int get_char(staj_context* context, char* c) {
+int get_char(staj_context* context, int* c) {
   if (context->current_buffer == -1) {
     return -1;
   } else {
     if (context->buffer_lengths[context->current_buffer] == 0) {
-      *c = 0;
+      *c = END_OF_INPUT;
       return 0;
     } else {
-      *c = context->buffers[context->current_buffer][context->current_pos];
+      *c = (unsigned char) context->buffers[context->current_buffer][context->current_pos];
       return 0;
     }
   }
 }
 
+/*
+ * Windowed mode: make room for one more buffer. Buffers before the
+ * start of the current token are handed back to the source and the rest
+ * are moved to the front. If the token spans the whole window the
+ * window is grown instead.
+ */
+static
+int recycle_buffers(staj_context* context) {
+  int keep = context->start_buffer;
+  int i;
+  if (keep > context->current_buffer) {
+    keep = context->current_buffer;
+  }
+  if (keep <= 0) {
+    int n = context->max_buffers * 2;
+    int* lengths;
+    const char** buffers;
+    if (context->buffers == context->own_buffers) {
+      lengths = (int*) staj_malloc(context->allocator, n * sizeof(int));
+      buffers = (const char**) staj_malloc(context->allocator, n * sizeof(char*));
+      if (lengths == NULL || buffers == NULL) {
+        staj_free(context->allocator, lengths);
+        staj_free(context->allocator, buffers);
+        context->_errno = STAJ_ENOMEM;
+        return -1;
+      }
+      memcpy(lengths, context->own_buffer_lengths, sizeof(context->own_buffer_lengths));
+      memcpy(buffers, context->own_buffers, sizeof(context->own_buffers));
+    } else {
+      lengths = (int*) staj_realloc(context->allocator, context->buffer_lengths, n * sizeof(int));
+      if (lengths == NULL) {
+        context->_errno = STAJ_ENOMEM;
+        return -1;
+      }
+      context->buffer_lengths = lengths;
+      buffers = (const char**) staj_realloc(context->allocator, context->buffers, n * sizeof(char*));
+      if (buffers == NULL) {
+        context->_errno = STAJ_ENOMEM;
+        return -1;
+      }
+    }
+    context->buffer_lengths = lengths;
+    context->buffers = buffers;
+    context->max_buffers = n;
+    return 0;
+  }
+
+  for (i=0; i<keep; i++) {
+    if (context->buffer_lengths[i] > 0 &&
+        context->release_buffer(context->ctx,
+                                context->buffer_lengths[i],
+                                context->buffers[i]) != 0) {
+      return -1;
+    }
+  }
+  memmove(context->buffer_lengths, context->buffer_lengths + keep,
+          (context->current_buffer - keep + 1) * sizeof(int));
+  memmove(context->buffers, context->buffers + keep,
+          (context->current_buffer - keep + 1) * sizeof(char*));
+  context->current_buffer -= keep;
+  context->start_buffer -= keep;
+  context->end_buffer -= keep;
+  if (context->end_buffer < 0) {
+    context->end_buffer = 0;
+  }
+  return 0;
+}
+
+/*
+ * Windowed mode: the previous token is no longer needed once the caller
+ * moves on, so its buffers may be recycled
+ */
+static inline
+void drop_token(staj_context* context) {
+  if (context->release_buffer != NULL && context->current_buffer >= 0) {
+    context->start_buffer = context->end_buffer = context->current_buffer;
+    context->start_pos = context->end_pos = context->current_pos;
+  }
+}
+
+/*
+ * Put the next buffer of the input into the slot after the current one
+ * and make it current. A push context takes the buffer given to
+ * staj_feed. If there is no input yet the cursor stays where it is and
+ * the error is STAJ_EAGAIN. A source that fails returns STAJ_ENOMEM when
+ * it is out of memory, anything else is STAJ_EIO.
+ */
+static
+int fetch_buffer(staj_context* context) {
+  int b = context->current_buffer + 1;
+  int r;
+  if (context->next_buffer == NULL) {
+    if (!context->fed) {
+      context->_errno = STAJ_EAGAIN;
+      return -1;
+    }
+    context->fed = 0;
+    context->buffer_lengths[b] = context->fed_length;
+    context->buffers[b] = context->fed_buffer;
+  } else
+  if ((r = context->next_buffer(context->ctx,
+                                &(context->buffer_lengths[b]),
+                                &(context->buffers[b]))) != 0) {
+    if (r == STAJ_EAGAIN) {
+      context->_errno = STAJ_EAGAIN;
+      return -1;
+    }
+    context->current_buffer = b;
+    context->buffer_lengths[b] = 0;
+    context->_errno = r == STAJ_ENOMEM ? STAJ_ENOMEM : STAJ_EIO;
+    return -1;
+  }
+  context->current_buffer = b;
+  context->current_pos = -1;
+  return 0;
+}
+
+/*
+ * Push mode: STAJ_EAGAIN only interrupts the call that ran out of
+ * input, the context goes on once more input is fed. Returns 1 and
+ * clears the error if that is what happened.
+ */
 static inline
-int next_char(staj_context* context, char* c) {
+int would_block(staj_context* context) {
+  if (context->_errno == STAJ_EAGAIN) {
+    context->_errno = 0;
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Slow path of next_char: first read and buffer boundaries. Fetches
+ * the next buffer from the source.
+ */
+static
+int next_buffer_char(staj_context* context, int* c) {
   if (context->_errno != 0) {
     return -1;
   }
@@ -105,982 +282,3288 @@ int next_char(staj_context* context, char* c) {
       context->_errno = STAJ_ENOMEM;
       return -1;
     }
-    context->current_buffer ++;
-    if (context->next_buffer(
-                context->ctx,
-                &(context->buffer_lengths[context->current_buffer]),
-                &(context->buffers[context->current_buffer])) != 0) {
+    if (fetch_buffer(context) != 0) {
       return -1;
     }
-    context->current_pos = -1;
   }
 
   if (context->buffer_lengths[context->current_buffer] == 0) {
-    *c = 0;
+    *c = END_OF_INPUT;
     return 0;
   }
 
+  if (context->current_pos >= context->buffer_lengths[context->current_buffer]-1 &&
+      context->extra_buffers > 0) {
+    /* push mode: the next buffer has been read before */
+    context->extra_buffers --;
+    context->current_buffer ++;
+    context->current_pos = -1;
+  } else
   if (context->current_pos >= context->buffer_lengths[context->current_buffer]-1) {
     if (context->current_buffer >= context->max_buffers - 1) {
-      context->_errno = STAJ_ENOMEM;
-      return -1;
+      if (context->release_buffer == NULL) {
+        context->_errno = STAJ_ENOMEM;
+        return -1;
+      }
+      if (recycle_buffers(context) != 0) {
+        return -1;
+      }
     }
-    context->current_buffer ++;
-    if (context->next_buffer(
-                context->ctx,
-                &(context->buffer_lengths[context->current_buffer]),
-                &(context->buffers[context->current_buffer])) != 0) {
+    if (fetch_buffer(context) != 0) {
       return -1;
     }
-    context->current_pos = -1;
   }
 
   if (context->buffer_lengths[context->current_buffer] == 0) {
-    *c = 0;
+    *c = END_OF_INPUT;
     return 0;
   }
 
-  *c = context->buffers[context->current_buffer][++(context->current_pos)];
+  *c = (unsigned char) context->buffers[context->current_buffer][++(context->current_pos)];
   return 0;
 }
 
 static inline
-int is_whitespace(char c) {
-  return c == 0x20 || c == 0x09 || c == 0x0A || c == 0x0D;
+int next_char(staj_context* context, int* c) {
+  int b = context->current_buffer;
+  if (b >= 0 && context->current_pos < context->buffer_lengths[b] - 1) {
+    *c = (unsigned char) context->buffers[b][++(context->current_pos)];
+    return 0;
+  }
+  return next_buffer_char(context, c);
 }
 
+/*
+ * Unread part of the current buffer as a pointer range [*p, *e).
+ * Hot loops run over the range directly, hand the cursor back with
+ * set_cursor and only go through next_char at the buffer boundary.
+ * Must be called after at least one character has been read.
+ */
 static inline
-int skip_whitespace(staj_context* context, char* c) {
-  if (get_char(context, c) != 0) {
-    if (next_char(context, c) != 0) {
-      return -1;
-    }
-  }
-  while (is_whitespace(*c)) {
-    if (next_char(context, c) != 0) {
-      return -1;
-    }
+void get_range(staj_context* context, const char** p, const char** e) {
+  int n = context->buffer_lengths[context->current_buffer] - context->current_pos - 1;
+  if (n <= 0) {
+    *p = *e = NULL;
+    return;
   }
-  return 0;
+  *p = context->buffers[context->current_buffer] + context->current_pos + 1;
+  *e = *p + n;
 }
 
-int staj_has_next(staj_context* context) {
-  char c;
-  if (skip_whitespace(context, &c) != 0) {
-    return -1;
+/*
+ * Mark everything before p (a pointer from get_range) as consumed
+ */
+static inline
+void set_cursor(staj_context* context, const char* p) {
+  if (p != NULL) {
+    context->current_pos = (int) (p - context->buffers[context->current_buffer]) - 1;
   }
-  return c != 0;
 }
 
-int staj_next(staj_context* context) {
-  if (context->_errno != 0) {
-    init_errno(context);
-    return -1;
-  }
+static inline
+int is_whitespace(int c) {
+  return c == 0x20 || c == 0x09 || c == 0x0A || c == 0x0D;
+}
 
-  char c;
+/*
+ * Characters that stand for themselves inside a string literal:
+ * everything except quote, backslash, control and non-ASCII characters
+ */
+static inline
+int is_plain_string_char(int c) {
+  return c >= 0x20 && c < 0x80 && c != 0x22 && c != 0x5C;
+}
 
-  int t;
-  int in_number = 0;
-  int zero = 0;
+static inline
+int is_digit(int c) {
+  return c >= '0' && c <= '9';
+}
 
-  if (skip_whitespace(context, &c) != 0) {
-    init_errno(context);
-    return -1;
+/*
+ * Consume the run of digits that follows the cursor in the current buffer.
+ * The last digit becomes the end of the current token.
+ */
+static inline
+void skip_digits(staj_context* context) {
+  const char *p, *e, *s;
+  get_range(context, &p, &e);
+  s = p;
+  while (p < e && is_digit(*p)) {
+    p ++;
   }
-  switch (c) {
-  case 0: {
-    if (context->context != STAJ_CTX_END_DOCUMENT) {
-      set_parse_error(context, STAJ_UNEXPECTED_EOF);
-      init_errno(context);
-      return -1;
-    }
-    
-    context->token = STAJ_EOF;
-  } return 0;
-  case 0x7B: { /* begin_object */
-    if (context->context != STAJ_CTX_START_DOCUMENT &&
-        context->context != STAJ_CTX_ARRAY_ITEM &&
-        context->context != STAJ_CTX_ARRAY_ITEM_ARRAY_END &&
-        context->context != STAJ_CTX_PROPERTY_VALUE) {
-      set_parse_error(context, STAJ_UNEXPECTED_SYMBOL);
-      init_errno(context);
-      return -1;
-    }
-       
-    context->token = STAJ_BEGIN_OBJECT;
-    context->start_buffer = context->current_buffer;
-    context->start_pos = context->current_pos;
+  if (p != s) {
+    set_cursor(context, p);
     context->end_buffer = context->current_buffer;
     context->end_pos = context->current_pos;
-    context->context = STAJ_CTX_PROPERTY_NAME_OBJECT_END;
-    if (push_context(context, 1) != 0) {
-      init_errno(context);
-      return -1;
-    }
-    if (next_char(context, &c) != 0) {
-      init_errno(context);
-      return -1;
-    }
-  } return 0;
-  case 0x5B: { /* begin_array */
-    if (context->context != STAJ_CTX_START_DOCUMENT &&
-        context->context != STAJ_CTX_ARRAY_ITEM &&
-        context->context != STAJ_CTX_ARRAY_ITEM_ARRAY_END &&
-        context->context != STAJ_CTX_PROPERTY_VALUE) {
-      set_parse_error(context, STAJ_UNEXPECTED_SYMBOL);
-      init_errno(context);
-      return -1;
+  }
+}
+
+static inline
+int ctz(unsigned int m) {
+#if defined(__GNUC__)
+  return __builtin_ctz(m);
+#else
+  int n = 0;
+  while ((m & 1) == 0) {
+    m >>= 1;
+    n ++;
+  }
+  return n;
+#endif
+}
+
+/*
+ * Find the first non-whitespace character in [p, e). Returns e if
+ * the whole range is whitespace. Long runs (indentation of pretty-printed
+ * documents) are skipped 32 or 16 bytes at a time where SIMD is available.
+ */
+static inline
+const char* scan_whitespace(const char* p, const char* e) {
+#if defined(__AVX2__)
+  const __m256i sp32 = _mm256_set1_epi8(0x20);
+  const __m256i ht32 = _mm256_set1_epi8(0x09);
+  const __m256i lf32 = _mm256_set1_epi8(0x0A);
+  const __m256i cr32 = _mm256_set1_epi8(0x0D);
+  while (e - p >= 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i*) p);
+    __m256i ws = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, sp32), _mm256_cmpeq_epi8(v, ht32)),
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, lf32), _mm256_cmpeq_epi8(v, cr32)));
+    unsigned int m = ~(unsigned int) _mm256_movemask_epi8(ws);
+    if (m != 0) {
+      return p + ctz(m);
     }
-       
-    context->token = STAJ_BEGIN_ARRAY;
-    context->start_buffer = context->current_buffer;
-    context->start_pos = context->current_pos;
-    context->end_buffer = context->current_buffer;
-    context->end_pos = context->current_pos;
-    context->context = STAJ_CTX_ARRAY_ITEM_ARRAY_END;
-    if (push_context(context, 0) != 0) {
-      init_errno(context);
-      return -1;
+    p += 32;
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i sp = _mm_set1_epi8(0x20);
+  const __m128i ht = _mm_set1_epi8(0x09);
+  const __m128i lf = _mm_set1_epi8(0x0A);
+  const __m128i cr = _mm_set1_epi8(0x0D);
+  while (e - p >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*) p);
+    __m128i ws = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, ht)),
+        _mm_or_si128(_mm_cmpeq_epi8(v, lf), _mm_cmpeq_epi8(v, cr)));
+    unsigned int m = (~(unsigned int) _mm_movemask_epi8(ws)) & 0xFFFF;
+    if (m != 0) {
+      return p + ctz(m);
     }
-    if (next_char(context, &c) != 0) {
-      init_errno(context);
-      return -1;
+    p += 16;
+  }
+#endif
+  while (p < e && is_whitespace(*p)) {
+    p ++;
+  }
+  return p;
+}
+
+/*
+ * Find the first character in [p, e) that matters when skipping a
+ * value: a quote or a bracket. Returns e if there is none. The brackets
+ * are found by one compare each after folding [ into { and ] into }.
+ */
+static inline
+const char* scan_structural(const char* p, const char* e) {
+#if defined(__AVX2__)
+  const __m256i fold32 = _mm256_set1_epi8(0x20);
+  const __m256i quote32 = _mm256_set1_epi8(0x22);
+  const __m256i open32 = _mm256_set1_epi8(0x7B);
+  const __m256i close32 = _mm256_set1_epi8(0x7D);
+  while (e - p >= 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i*) p);
+    __m256i f = _mm256_or_si256(v, fold32);
+    __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(v, quote32),
+        _mm256_or_si256(_mm256_cmpeq_epi8(f, open32), _mm256_cmpeq_epi8(f, close32)));
+    unsigned int m = (unsigned int) _mm256_movemask_epi8(hit);
+    if (m != 0) {
+      return p + ctz(m);
     }
-  } return 0;
-  case 0x7D: { /* end_object */
-    if (context->context != STAJ_CTX_PROPERTY_NAME_OBJECT_END) {
-      set_parse_error(context, STAJ_UNEXPECTED_SYMBOL);
-      init_errno(context);
-      return -1;
+    p += 32;
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i fold = _mm_set1_epi8(0x20);
+  const __m128i quote = _mm_set1_epi8(0x22);
+  const __m128i open = _mm_set1_epi8(0x7B);
+  const __m128i close = _mm_set1_epi8(0x7D);
+  while (e - p >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*) p);
+    __m128i f = _mm_or_si128(v, fold);
+    __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+        _mm_or_si128(_mm_cmpeq_epi8(f, open), _mm_cmpeq_epi8(f, close)));
+    unsigned int m = (unsigned int) _mm_movemask_epi8(hit);
+    if (m != 0) {
+      return p + ctz(m);
     }
-    
-    context->token = STAJ_END_OBJECT;
-    context->start_buffer = context->current_buffer;
-    context->start_pos = context->current_pos;
-    context->end_buffer = context->current_buffer;
-    context->end_pos = context->current_pos;
-    if (pop_context(context, &t) != 0) {
-      init_errno(context);
-      return -1;
+    p += 16;
+  }
+#endif
+  while (p < e && *p != 0x22 && (*p | 0x20) != 0x7B && (*p | 0x20) != 0x7D) {
+    p ++;
+  }
+  return p;
+}
+
+/*
+ * Find the first quote or backslash in [p, e). Returns e if there is none.
+ */
+static inline
+const char* scan_string_end(const char* p, const char* e) {
+#if defined(__AVX2__)
+  const __m256i quote32 = _mm256_set1_epi8(0x22);
+  const __m256i bs32 = _mm256_set1_epi8(0x5C);
+  while (e - p >= 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i*) p);
+    __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(v, quote32), _mm256_cmpeq_epi8(v, bs32));
+    unsigned int m = (unsigned int) _mm256_movemask_epi8(hit);
+    if (m != 0) {
+      return p + ctz(m);
     }
-    if (peek_context(context, &t) != 0) {
-      init_errno(context);
-      return -1;
+    p += 32;
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i quote = _mm_set1_epi8(0x22);
+  const __m128i bs = _mm_set1_epi8(0x5C);
+  while (e - p >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*) p);
+    __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bs));
+    unsigned int m = (unsigned int) _mm_movemask_epi8(hit);
+    if (m != 0) {
+      return p + ctz(m);
     }
-    if (t == 0) {
-      if (next_char(context, &c) != 0) {
-        init_errno(context);
-        return -1;
-      }
-      if (skip_whitespace(context, &c) != 0) {
-        init_errno(context);
-        return -1;
-      }
-      if (c == 0x2C) {
-        if (next_char(context, &c) != 0) {
-          init_errno(context);
-          return -1;
-        }
-        context->context = STAJ_CTX_ARRAY_ITEM;
-      } else
-      if (c == 0x5D) {
-        context->context = STAJ_CTX_ARRAY_ITEM_ARRAY_END;
-      } else {
-        set_parse_error(context, STAJ_UNEXPECTED_SYMBOL);
-        init_errno(context);
-        return -1;
-      }  
+    p += 16;
+  }
+#endif
+  while (p < e && *p != 0x22 && *p != 0x5C) {
+    p ++;
+  }
+  return p;
+}
+
+/*
+ * UTF-8 in strings. A lead byte is followed by 1 to 3 continuation bytes
+ * (0x80-0xBF); the range of the first one is narrower after some leads,
+ * which rules out overlong forms (C0, C1, E0 80-9F, F0 80-8F),
+ * surrogates (ED A0-BF) and code points above U+10FFFF (F4 90-BF, F5-FF).
+ */
+
+/*
+ * The number of continuation bytes after lead byte c, 0 if c does not
+ * start a sequence, and the range of the first one in *lo and *hi
+ */
+static inline
+int utf8_lead(int c, int* lo, int* hi) {
+  *lo = 0x80;
+  *hi = 0xBF;
+  if (c < 0xC2 || c > 0xF4) {
+    return 0;
+  }
+  if (c <= 0xDF) {
+    return 1;
+  }
+  if (c <= 0xEF) {
+    if (c == 0xE0) {
+      *lo = 0xA0;
     } else
-    if (t == 1) {
-      if (next_char(context, &c) != 0) {
-        init_errno(context);
-        return -1;
-      }
-      if (skip_whitespace(context, &c) != 0) {
-        init_errno(context);
-        return -1;
-      }
-      if (c == 0x2C) {
-        if (next_char(context, &c) != 0) {
-          init_errno(context);
-          return -1;
-        }
-        context->context = STAJ_CTX_PROPERTY_NAME;
-      } else
-      if (c == 0x7D) {
-        context->context = STAJ_CTX_PROPERTY_NAME_OBJECT_END;
-      } else 
-      if (c == 0) {
-        context->context = STAJ_CTX_END_DOCUMENT;
-      } else {
-        set_parse_error(context, STAJ_UNEXPECTED_SYMBOL);
-        init_errno(context);
-        return -1;
-      }
-    } else {
-      context->context = STAJ_CTX_END_DOCUMENT;
-      next_char(context, &c);
+    if (c == 0xED) {
+      *hi = 0x9F;
     }
-  } return 0;
-  case 0x5D: { /* end_array */
-    if (context->context != STAJ_CTX_ARRAY_ITEM_ARRAY_END) {
-      set_parse_error(context, STAJ_UNEXPECTED_SYMBOL);
-      init_errno(context);
-      return -1;
+    return 2;
+  }
+  if (c == 0xF0) {
+    *lo = 0x90;
+  } else
+  if (c == 0xF4) {
+    *hi = 0x8F;
+  }
+  return 3;
+}
+
+/*
+ * The length of the valid sequence at p that ends before e, or 0
+ */
+static inline
+int utf8_sequence(const char* p, const char* e) {
+  int lo, hi;
+  int n = utf8_lead((unsigned char) *p, &lo, &hi);
+  int i;
+  if (n == 0 || e - p <= n) {
+    return 0;
+  }
+  for (i=1; i<=n; i++) {
+    int c = (unsigned char) p[i];
+    if (c < lo || c > hi) {
+      return 0;
     }
-    
-    context->token = STAJ_END_ARRAY;
-    context->start_buffer = context->current_buffer;
-    context->start_pos = context->current_pos;
-    context->end_buffer = context->current_buffer;
-    context->end_pos = context->current_pos;
-    if (pop_context(context, &t) != 0) {
-      init_errno(context);
-      return -1;
+    lo = 0x80;
+    hi = 0xBF;
+  }
+  return n + 1;
+}
+
+#if defined(__AVX2__) || defined(__SSSE3__) || defined(UTF8_DISPATCH)
+/*
+ * Vectorized check of UTF-8 by table lookups (Keiser and Lemire,
+ * "Validating UTF-8 In Less Than One Instruction Per Byte"). The high
+ * and low nibble of every byte and the high nibble of the byte after it
+ * each look up a set of error bits; a sequence is bad where all three
+ * have a bit in common. Whether a byte must be the second or third
+ * continuation is found from the two bytes before it.
+ */
+#define UTF8_TOO_SHORT (1<<0)
+#define UTF8_TOO_LONG (1<<1)
+#define UTF8_OVERLONG_3 (1<<2)
+#define UTF8_TOO_LARGE (1<<3)
+#define UTF8_SURROGATE (1<<4)
+#define UTF8_OVERLONG_2 (1<<5)
+#define UTF8_TOO_LARGE_1000 (1<<6)
+#define UTF8_OVERLONG_4 (1<<6)
+#define UTF8_TWO_CONTS (1<<7)
+#define UTF8_CARRY (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+#define UTF8_BYTE_1_HIGH \
+  UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, \
+  UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, \
+  UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, \
+  UTF8_TOO_SHORT | UTF8_OVERLONG_2, \
+  UTF8_TOO_SHORT, \
+  UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE, \
+  UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4
+
+#define UTF8_BYTE_1_LOW \
+  UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4, \
+  UTF8_CARRY | UTF8_OVERLONG_2, \
+  UTF8_CARRY, \
+  UTF8_CARRY, \
+  UTF8_CARRY | UTF8_TOO_LARGE, \
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE, \
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000
+
+#define UTF8_BYTE_2_HIGH \
+  UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, \
+  UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, \
+  UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4, \
+  UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE, \
+  UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE, \
+  UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE, \
+  UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT
+#endif
+
+#if defined(UTF8_DISPATCH)
+#define UTF8_TARGET __attribute__((target("ssse3")))
+#else
+#define UTF8_TARGET
+#endif
+
+#if defined(__AVX2__)
+#define UTF8_BLOCK 32
+typedef __m256i utf8_block;
+
+static inline
+utf8_block utf8_load(const char* p) {
+  return _mm256_loadu_si256((const __m256i*) p);
+}
+
+static inline
+int utf8_is_ascii(utf8_block v) {
+  return _mm256_movemask_epi8(v) == 0;
+}
+
+static inline
+int utf8_any(utf8_block v) {
+  return !_mm256_testz_si256(v, v);
+}
+
+/*
+ * The error bits of the sequences that end in block v, prev is the
+ * block before it
+ */
+static inline
+utf8_block utf8_errors(utf8_block v, utf8_block prev) {
+  const __m256i byte_1_high = _mm256_setr_epi8(UTF8_BYTE_1_HIGH, UTF8_BYTE_1_HIGH);
+  const __m256i byte_1_low = _mm256_setr_epi8(UTF8_BYTE_1_LOW, UTF8_BYTE_1_LOW);
+  const __m256i byte_2_high = _mm256_setr_epi8(UTF8_BYTE_2_HIGH, UTF8_BYTE_2_HIGH);
+  const __m256i nibble = _mm256_set1_epi8(0x0F);
+  __m256i carry = _mm256_permute2x128_si256(prev, v, 0x21);
+  __m256i prev1 = _mm256_alignr_epi8(v, carry, 15);
+  __m256i prev2 = _mm256_alignr_epi8(v, carry, 14);
+  __m256i prev3 = _mm256_alignr_epi8(v, carry, 13);
+  __m256i sc = _mm256_and_si256(
+      _mm256_and_si256(
+          _mm256_shuffle_epi8(byte_1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+          _mm256_shuffle_epi8(byte_1_low, _mm256_and_si256(prev1, nibble))),
+      _mm256_shuffle_epi8(byte_2_high, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble)));
+  __m256i must23 = _mm256_or_si256(_mm256_subs_epu8(prev2, _mm256_set1_epi8((char) (0xE0 - 0x80))),
+                                   _mm256_subs_epu8(prev3, _mm256_set1_epi8((char) (0xF0 - 0x80))));
+  return _mm256_xor_si256(_mm256_and_si256(must23, _mm256_set1_epi8((char) 0x80)), sc);
+}
+
+/*
+ * Non-zero where the block ends in the middle of a sequence
+ */
+static inline
+utf8_block utf8_incomplete(utf8_block v) {
+  const __m256i max = _mm256_setr_epi8(
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+      (char) (0xF0 - 1), (char) (0xE0 - 1), (char) (0xC0 - 1));
+  return _mm256_subs_epu8(v, max);
+}
+
+/*
+ * Non-zero where a byte ends a string literal or needs a closer look:
+ * quotes, backslashes and control characters
+ */
+static inline
+int utf8_stops(utf8_block v) {
+  const __m256i quote = _mm256_set1_epi8(0x22);
+  const __m256i bs = _mm256_set1_epi8(0x5C);
+  const __m256i ctl = _mm256_set1_epi8(0x1F);
+  return _mm256_movemask_epi8(_mm256_or_si256(
+      _mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, bs)),
+      _mm256_cmpeq_epi8(_mm256_max_epu8(v, ctl), ctl)));
+}
+
+static inline
+utf8_block utf8_or(utf8_block a, utf8_block b) {
+  return _mm256_or_si256(a, b);
+}
+
+static inline
+utf8_block utf8_zero(void) {
+  return _mm256_setzero_si256();
+}
+#elif defined(__SSSE3__) || defined(UTF8_DISPATCH)
+#define UTF8_BLOCK 16
+typedef __m128i utf8_block;
+
+static inline UTF8_TARGET
+utf8_block utf8_load(const char* p) {
+  return _mm_loadu_si128((const __m128i*) p);
+}
+
+static inline UTF8_TARGET
+int utf8_is_ascii(utf8_block v) {
+  return _mm_movemask_epi8(v) == 0;
+}
+
+static inline UTF8_TARGET
+int utf8_any(utf8_block v) {
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xFFFF;
+}
+
+static inline UTF8_TARGET
+utf8_block utf8_errors(utf8_block v, utf8_block prev) {
+  const __m128i byte_1_high = _mm_setr_epi8(UTF8_BYTE_1_HIGH);
+  const __m128i byte_1_low = _mm_setr_epi8(UTF8_BYTE_1_LOW);
+  const __m128i byte_2_high = _mm_setr_epi8(UTF8_BYTE_2_HIGH);
+  const __m128i nibble = _mm_set1_epi8(0x0F);
+  __m128i prev1 = _mm_alignr_epi8(v, prev, 15);
+  __m128i prev2 = _mm_alignr_epi8(v, prev, 14);
+  __m128i prev3 = _mm_alignr_epi8(v, prev, 13);
+  __m128i sc = _mm_and_si128(
+      _mm_and_si128(
+          _mm_shuffle_epi8(byte_1_high, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+          _mm_shuffle_epi8(byte_1_low, _mm_and_si128(prev1, nibble))),
+      _mm_shuffle_epi8(byte_2_high, _mm_and_si128(_mm_srli_epi16(v, 4), nibble)));
+  __m128i must23 = _mm_or_si128(_mm_subs_epu8(prev2, _mm_set1_epi8((char) (0xE0 - 0x80))),
+                                _mm_subs_epu8(prev3, _mm_set1_epi8((char) (0xF0 - 0x80))));
+  return _mm_xor_si128(_mm_and_si128(must23, _mm_set1_epi8((char) 0x80)), sc);
+}
+
+static inline UTF8_TARGET
+utf8_block utf8_incomplete(utf8_block v) {
+  const __m128i max = _mm_setr_epi8(
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+      (char) (0xF0 - 1), (char) (0xE0 - 1), (char) (0xC0 - 1));
+  return _mm_subs_epu8(v, max);
+}
+
+static inline UTF8_TARGET
+int utf8_stops(utf8_block v) {
+  const __m128i quote = _mm_set1_epi8(0x22);
+  const __m128i bs = _mm_set1_epi8(0x5C);
+  const __m128i ctl = _mm_set1_epi8(0x1F);
+  return _mm_movemask_epi8(_mm_or_si128(
+      _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bs)),
+      _mm_cmpeq_epi8(_mm_max_epu8(v, ctl), ctl)));
+}
+
+static inline UTF8_TARGET
+utf8_block utf8_or(utf8_block a, utf8_block b) {
+  return _mm_or_si128(a, b);
+}
+
+static inline UTF8_TARGET
+utf8_block utf8_zero(void) {
+  return _mm_setzero_si128();
+}
+#endif
+
+/*
+ * Skip the 16-byte blocks of plain string characters at p
+ */
+static inline
+const char* scan_plain_blocks(const char* p, const char* e) {
+#if defined(__SSE2__)
+  const __m128i quote = _mm_set1_epi8(0x22);
+  const __m128i bs = _mm_set1_epi8(0x5C);
+  const __m128i ctl = _mm_set1_epi8(0x1F);
+  while (e - p >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*) p);
+    __m128i stop = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bs)),
+        _mm_cmpeq_epi8(_mm_max_epu8(v, ctl), ctl));
+    if (_mm_movemask_epi8(_mm_or_si128(stop, v)) != 0) {
+      break;
     }
-    if (peek_context(context, &t) != 0) {
-      init_errno(context);
-      return -1;
+    p += 16;
+  }
+#endif
+  return p;
+}
+
+#if defined(UTF8_BLOCK)
+/*
+ * Skip the blocks of plain string characters and valid UTF-8 at p
+ */
+static inline UTF8_TARGET
+const char* scan_utf8_blocks(const char* p, const char* e) {
+  const char* s = p;
+  utf8_block prev = utf8_zero();
+  utf8_block incomplete = utf8_zero();
+  int k;
+  while (e - p >= UTF8_BLOCK) {
+    utf8_block v = utf8_load(p);
+    if (utf8_stops(v) != 0) {
+      break;
     }
-    if (t == 0) {
-      if (next_char(context, &c) != 0) {
-        init_errno(context);
-        return -1;
-      }
-      if (skip_whitespace(context, &c) != 0) {
-        init_errno(context);
-        return -1;
-      }
-      if (c == 0x2C) {
-        if (next_char(context, &c) != 0) {
-          init_errno(context);
-          return -1;
-        }
-        context->context = STAJ_CTX_ARRAY_ITEM;
-      } else
-      if (c == 0x5D) {
-        context->context = STAJ_CTX_ARRAY_ITEM_ARRAY_END;
-      } else {
-        set_parse_error(context, STAJ_UNEXPECTED_SYMBOL);
-        init_errno(context);
-        return -1;
-      }  
-    } else
-    if (t == 1) {
-      if (next_char(context, &c) != 0) {
-        init_errno(context);
-        return -1;
-      }
-      if (skip_whitespace(context, &c) != 0) {
-        init_errno(context);
-        return -1;
-      }
-      if (c == 0x2C) {
-        if (next_char(context, &c) != 0) {
-          init_errno(context);
-          return -1;
-        }
-        context->context = STAJ_CTX_PROPERTY_NAME;
-      } else
-      if (c == 0x7D) {
-        context->context = STAJ_CTX_PROPERTY_NAME_OBJECT_END;
-      } else {
-        set_parse_error(context, STAJ_UNEXPECTED_SYMBOL);
-        init_errno(context);
-        return -1;
+    if (utf8_is_ascii(v)) {
+      if (utf8_any(incomplete)) {
+        break;
       }
     } else {
-      context->context = STAJ_CTX_END_DOCUMENT;
-      if (next_char(context, &c) != 0) {
-        init_errno(context);
-        return -1;
+      if (utf8_any(utf8_errors(v, prev))) {
+        break;
       }
+      incomplete = utf8_incomplete(v);
     }
-  }  return 0;
-  case 0x22: { /* start string */
-    if (context->context != STAJ_CTX_PROPERTY_NAME &&
-        context->context != STAJ_CTX_PROPERTY_NAME_OBJECT_END &&
-        context->context != STAJ_CTX_PROPERTY_VALUE &&
-        context->context != STAJ_CTX_ARRAY_ITEM &&
-        context->context != STAJ_CTX_ARRAY_ITEM_ARRAY_END) {
-      set_parse_error(context, STAJ_UNEXPECTED_SYMBOL);
-      init_errno(context);
-      return -1;
+    prev = v;
+    p += UTF8_BLOCK;
+  }
+  /* the blocks before p are valid but for a sequence cut at p, go back
+     to its lead byte */
+  for (k=1; k<=3 && p - s >= k; k++) {
+    int c = (unsigned char) p[-k];
+    if (c >= 0xC0) {
+      p -= k;
+      break;
+    }
+    if (c < 0x80) {
+      break;
     }
+  }
+  return p;
+}
+#endif
 
-    context->start_buffer = context->current_buffer;
-    context->start_pos = context->current_pos;    
+/*
+ * Find the end of the run of plain string characters and complete UTF-8
+ * sequences at p that ends before e. With SSSE3 or AVX2 whole blocks are
+ * checked at once, otherwise only the plain ASCII blocks at p are. A
+ * build for plain x86-64 checks whether the CPU has SSSE3.
+ */
+static inline
+const char* scan_string_chars(const char* p, const char* e) {
+#if defined(UTF8_DISPATCH)
+  p = __builtin_cpu_supports("ssse3") ? scan_utf8_blocks(p, e) : scan_plain_blocks(p, e);
+#elif defined(UTF8_BLOCK)
+  p = scan_utf8_blocks(p, e);
+#else
+  p = scan_plain_blocks(p, e);
+#endif
+  while (p < e) {
+    int c = (unsigned char) *p;
+    int n;
+    if (is_plain_string_char(c)) {
+      p ++;
+    } else
+    if (c >= 0x80 && (n = utf8_sequence(p, e)) > 0) {
+      p += n;
+    } else {
+      break;
+    }
+  }
+  return p;
+}
 
-    int r;
-    while ((r = next_char(context, &c)) == 0) {
-      if (c == 0x22) { /* quote */
-        context->end_buffer = context->current_buffer;
-        context->end_pos = context->current_pos;
-        if (next_char(context, &c) != 0) {
-          init_errno(context);
-          return -1;
-        }
-        break;
-      } 
-      if (c == 0x5C) { /* escape */
-        if (next_char(context, &c) != 0) {
-          init_errno(context);
-          return -1;
-        }
-        if (c == 0x22 || c == 0x5C || c == 0x2F ||
-            c == 0x62 || c == 0x66 || c == 0x6E ||
-            c == 0x72 || c == 0x74) {
-          if (next_char(context, &c) != 0) {
-            init_errno(context);
-            return -1;
-          }
-        } else
-        if (c == 0x75) { /* \uXXXX */
-          int i;
-          for (i=0; i<4; i++) {
-            if (next_char(context, &c) != 0) {
-              init_errno(context);
-              return -1;
-            }
-            if ((c >= '0' && c <= '9') ||
-                (c >= 'a' && c <= 'f') ||
-                (c >= 'A' && c <= 'F')) {
-            } else {
-              set_parse_error(context, STAJ_INVALID_ESCAPE_SEQUENCE);
-              init_errno(context);
-              return -1;
-            }
-          }
-        } else {
-          set_parse_error(context, STAJ_INVALID_ESCAPE_SEQUENCE);
-          init_errno(context);
-          return -1;
-        }
-      } else
-      if ((c == 0x20) || 
-          (c == 0x21) || 
-          ((c >= 0x23) && (c <= 0x5B)) ||
-          ((c >= 0x5D) && (c <= 0x7F))) {
-        // continue
-      } else
-      if ((c >= 0xC0) && (c <= 0xDF)) {
-        if (next_char(context, &c) != 0) {
-          init_errno(context);
-          return -1;
-        }
-        if ((c >= 0x80) && (c <= 0xBF)) {
-        } else {
-          set_parse_error(context, STAJ_INVALID_UTF8_SEQUENCE);
-          init_errno(context);
-          return -1;
-        }
-      } else
-      if ((c >= 0xE0) && (c <= 0xEF)) {
-        int i;
-        for (i=0; i<2; i++) {
-          if (next_char(context, &c) != 0) {
-            init_errno(context);
-            return -1;
-          }
-          if ((c >= 0x80) && (c <= 0xBF)) {
-          } else {
-            set_parse_error(context, STAJ_INVALID_UTF8_SEQUENCE);
-            init_errno(context);
-            return -1;
-          }
-        }
-      } else
-      if ((c >= 0xF0) && (c <= 0xF0)) {
-        int i;
-        for (i=0; i<3; i++) {
-          if (next_char(context, &c) != 0) {
-            init_errno(context);
-            return -1;
-          }
-          if ((c >= 0x80) && (c <= 0xBF)) {
-          } else {
-            set_parse_error(context, STAJ_INVALID_UTF8_SEQUENCE);
-            init_errno(context);
-            return -1;
-          }
-        }
-      } else 
-      if (c == 0) {
-        set_parse_error(context, STAJ_UNEXPECTED_EOF);
-        init_errno(context);
-        return -1;
-      } else {
-        set_parse_error(context, STAJ_INVALID_UTF8_SEQUENCE);
-        init_errno(context);
-        return -1;
-      }
-    } // while
+/*
+ * Consume the run of plain string characters and UTF-8 sequences that
+ * follows the cursor in the current buffer
+ */
+static inline
+void skip_string_chars(staj_context* context) {
+  const char *p, *e;
+  get_range(context, &p, &e);
+  set_cursor(context, scan_string_chars(p, e));
+}
 
-    if (r != 0) {
-      init_errno(context);
+static inline
+int skip_whitespace(staj_context* context, int* c) {
+  if (get_char(context, c) != 0) {
+    if (next_char(context, c) != 0) {
       return -1;
     }
+  }
+  while (is_whitespace(*c)) {
+    /* c came from a non-empty buffer: jump over the rest of the run in it
+       and let next_char pick up the first non-whitespace character (or
+       cross into the next buffer if the run reaches the end) */
+    const char *p, *e;
+    get_range(context, &p, &e);
+    set_cursor(context, scan_whitespace(p, e));
+    if (next_char(context, c) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
 
-    if (context->context == STAJ_CTX_PROPERTY_NAME ||
-        context->context == STAJ_CTX_PROPERTY_NAME_OBJECT_END) {
-      context->token = STAJ_PROPERTY_NAME;
+/*
+ * Character classes the tokenizer dispatches on
+ */
+enum {
+  CLASS_INVALID,
+  CLASS_BEGIN_OBJECT,
+  CLASS_BEGIN_ARRAY,
+  CLASS_END_OBJECT,
+  CLASS_END_ARRAY,
+  CLASS_QUOTE,
+  CLASS_LITERAL,
+  CLASS_NUMBER,
+  CLASS_COMMA,
+  CLASS_COLON,
+  CLASS_EOF,
+  CLASS_COUNT
+};
 
-      if (skip_whitespace(context, &c) != 0) {
-        init_errno(context);
-        return -1;
-      }
-      if (c == 0x3A) {
-        if (next_char(context, &c) != 0) {
-          init_errno(context);
-          return -1;
-        }
-        context->context = STAJ_CTX_PROPERTY_VALUE;
-      } else {
-        set_parse_error(context, STAJ_UNEXPECTED_SYMBOL);
-        init_errno(context);
-        return -1;
-      }
-    } else
-    if (context->context == STAJ_CTX_PROPERTY_VALUE) {
-      context->token = STAJ_STRING;
+static const unsigned char char_classes[256] = {
+  ['{'] = CLASS_BEGIN_OBJECT, ['['] = CLASS_BEGIN_ARRAY,
+  ['}'] = CLASS_END_OBJECT, [']'] = CLASS_END_ARRAY,
+  ['"'] = CLASS_QUOTE,
+  ['t'] = CLASS_LITERAL, ['f'] = CLASS_LITERAL, ['n'] = CLASS_LITERAL,
+  ['-'] = CLASS_NUMBER,
+  ['0'] = CLASS_NUMBER, ['1'] = CLASS_NUMBER, ['2'] = CLASS_NUMBER, ['3'] = CLASS_NUMBER,
+  ['4'] = CLASS_NUMBER, ['5'] = CLASS_NUMBER, ['6'] = CLASS_NUMBER, ['7'] = CLASS_NUMBER,
+  ['8'] = CLASS_NUMBER, ['9'] = CLASS_NUMBER,
+  [','] = CLASS_COMMA, [':'] = CLASS_COLON
+};
 
-      if (skip_whitespace(context, &c) != 0) {
-        init_errno(context);
-        return -1;
-      }
-      if (c == 0x2C) { 
-        if (next_char(context, &c) != 0) {
-          init_errno(context);
-          return -1;
-        }
-        context->context = STAJ_CTX_PROPERTY_NAME;
-      } else 
-      if (c == 0x7D) {
-        context->context = STAJ_CTX_PROPERTY_NAME_OBJECT_END;
-      } else {
-        set_parse_error(context, STAJ_UNEXPECTED_SYMBOL);
-        init_errno(context);
-        return -1;
-      }
-    } else
-    if (context->context == STAJ_CTX_ARRAY_ITEM ||
-        context->context == STAJ_CTX_ARRAY_ITEM_ARRAY_END) {
-      context->token = STAJ_STRING;
+static inline
+int char_class(int c) {
+  return c == END_OF_INPUT ? CLASS_EOF : char_classes[c];
+}
 
-      if (skip_whitespace(context, &c) != 0) {
-        init_errno(context);
-        return -1;
-      }
-      if (c == 0x2C) { 
-        if (next_char(context, &c) != 0) {
-          init_errno(context);
-          return -1;
-        }
-        context->context = STAJ_CTX_ARRAY_ITEM;
-      } else 
-      if (c == 0x5D) {
-        context->context = STAJ_CTX_ARRAY_ITEM_ARRAY_END;
-      } else {
-        set_parse_error(context, STAJ_UNEXPECTED_SYMBOL);
-        init_errno(context);
-        return -1;
-      }
-    } else {
-      set_parse_error(context, STAJ_UNEXPECTED_SYMBOL);
-      init_errno(context);
-      return -1;
-    }
+/*
+ * What the first character of a token starts, by context and class
+ */
+enum {
+  ACTION_ERROR,
+  ACTION_EOF,
+  ACTION_BEGIN_OBJECT,
+  ACTION_BEGIN_ARRAY,
+  ACTION_END_OBJECT,
+  ACTION_END_ARRAY,
+  ACTION_PROPERTY_NAME,
+  ACTION_STRING,
+  ACTION_LITERAL,
+  ACTION_NUMBER
+};
 
-  } return 0;
-  case 'n':
-  case 'f':
-  case 't': {
-    char* word;
-    int wlen = 0;
-    switch (c) {
-    case 'n':
-      word = "null";
-      wlen = 4;
-      context->token = STAJ_NULL;
-      break;
-    case 'f':
-      word = "false";
-      wlen = 5;
-      context->token = STAJ_BOOLEAN;
-      break;
-    case 't':
-      word = "true";
-      wlen = 4;
-      context->token = STAJ_BOOLEAN;
-      break;
+#define VALUE_ACTIONS \
+  [CLASS_BEGIN_OBJECT] = ACTION_BEGIN_OBJECT, [CLASS_BEGIN_ARRAY] = ACTION_BEGIN_ARRAY, \
+  [CLASS_QUOTE] = ACTION_STRING, [CLASS_LITERAL] = ACTION_LITERAL, [CLASS_NUMBER] = ACTION_NUMBER
+
+static const unsigned char transitions[][CLASS_COUNT] = {
+  [STAJ_CTX_START_DOCUMENT] = {
+    [CLASS_BEGIN_OBJECT] = ACTION_BEGIN_OBJECT, [CLASS_BEGIN_ARRAY] = ACTION_BEGIN_ARRAY,
+    /* only between documents in multi-document mode */
+    [CLASS_EOF] = ACTION_EOF
+  },
+  [STAJ_CTX_END_DOCUMENT] = { [CLASS_EOF] = ACTION_EOF },
+  [STAJ_CTX_ARRAY_ITEM] = { VALUE_ACTIONS },
+  [STAJ_CTX_ARRAY_ITEM_ARRAY_END] = { VALUE_ACTIONS, [CLASS_END_ARRAY] = ACTION_END_ARRAY },
+  [STAJ_CTX_PROPERTY_NAME] = { [CLASS_QUOTE] = ACTION_PROPERTY_NAME },
+  [STAJ_CTX_PROPERTY_VALUE] = { VALUE_ACTIONS },
+  [STAJ_CTX_PROPERTY_NAME_OBJECT_END] = {
+    [CLASS_QUOTE] = ACTION_PROPERTY_NAME, [CLASS_END_OBJECT] = ACTION_END_OBJECT
+  }
+};
+
+/*
+ * The context after the separator that follows a token, by what the
+ * token is in (an array, an object, or it is a property name) and the
+ * class of the separator. STAJ_CTX_START_DOCUMENT where the separator is
+ * not allowed. Commas and colons are consumed, closing brackets are the
+ * next token.
+ */
+#define AFTER_ARRAY_ITEM 0
+#define AFTER_PROPERTY_VALUE 1
+#define AFTER_PROPERTY_NAME 2
+
+static const unsigned char separators[][CLASS_COUNT] = {
+  [AFTER_ARRAY_ITEM] = {
+    [CLASS_COMMA] = STAJ_CTX_ARRAY_ITEM, [CLASS_END_ARRAY] = STAJ_CTX_ARRAY_ITEM_ARRAY_END
+  },
+  [AFTER_PROPERTY_VALUE] = {
+    [CLASS_COMMA] = STAJ_CTX_PROPERTY_NAME, [CLASS_END_OBJECT] = STAJ_CTX_PROPERTY_NAME_OBJECT_END
+  },
+  [AFTER_PROPERTY_NAME] = { [CLASS_COLON] = STAJ_CTX_PROPERTY_VALUE }
+};
+
+/*
+ * Where a value read in a context is, the row of separators to use
+ * after it
+ */
+static const unsigned char value_separators[] = {
+  [STAJ_CTX_ARRAY_ITEM] = AFTER_ARRAY_ITEM,
+  [STAJ_CTX_ARRAY_ITEM_ARRAY_END] = AFTER_ARRAY_ITEM,
+  [STAJ_CTX_PROPERTY_VALUE] = AFTER_PROPERTY_VALUE
+};
+
+/*
+ * The parse error for a character that is not allowed where it is
+ */
+static inline
+void unexpected(staj_context* context, int cls) {
+  set_parse_error(context, cls == CLASS_EOF ? STAJ_UNEXPECTED_EOF : STAJ_UNEXPECTED_SYMBOL);
+}
+
+/*
+ * Move to the context after a separator of the given class, or set the
+ * parse error for it and return -1
+ */
+static inline
+int separator_context(staj_context* context, int after, int cls) {
+  int next = separators[after][cls];
+  if (next == STAJ_CTX_START_DOCUMENT) {
+    unexpected(context, cls);
+    return -1;
+  }
+  context->context = next;
+  return 0;
+}
+
+/*
+ * Indexed mode (staj_parse_indexed). Stage 1 runs over the whole buffer
+ * once and records the positions of the structural characters, of the
+ * quotes around strings and of the first characters of literals and
+ * numbers. Stage 2 (next_indexed) then moves from one position to the
+ * next instead of reading the input byte by byte.
+ */
+
+static inline
+int ctz64(uint64_t m) {
+#if defined(__GNUC__)
+  return __builtin_ctzll(m);
+#else
+  int n = 0;
+  while ((m & 1) == 0) {
+    m >>= 1;
+    n ++;
+  }
+  return n;
+#endif
+}
+
+static inline
+int popcount64(uint64_t m) {
+#if defined(__GNUC__)
+  return __builtin_popcountll(m);
+#else
+  int n = 0;
+  while (m != 0) {
+    m &= m - 1;
+    n ++;
+  }
+  return n;
+#endif
+}
+
+/*
+ * Bit i of the result is the xor of bits 0..i of m
+ */
+static inline
+uint64_t prefix_xor(uint64_t m) {
+  m ^= m << 1;
+  m ^= m << 2;
+  m ^= m << 4;
+  m ^= m << 8;
+  m ^= m << 16;
+  m ^= m << 32;
+  return m;
+}
+
+/*
+ * Masks of quotes, backslashes, structural characters and whitespace
+ * of a 64-byte block, bit i standing for p[i]
+ */
+static inline
+void classify_block(const char* p, uint64_t* quote, uint64_t* bs, uint64_t* op, uint64_t* ws) {
+#if defined(__AVX2__)
+  const __m256i fold = _mm256_set1_epi8(0x20);
+  const __m256i q = _mm256_set1_epi8(0x22);
+  const __m256i b = _mm256_set1_epi8(0x5C);
+  const __m256i open = _mm256_set1_epi8(0x7B);
+  const __m256i close = _mm256_set1_epi8(0x7D);
+  const __m256i colon = _mm256_set1_epi8(0x3A);
+  const __m256i comma = _mm256_set1_epi8(0x2C);
+  const __m256i sp = _mm256_set1_epi8(0x20);
+  const __m256i ht = _mm256_set1_epi8(0x09);
+  const __m256i lf = _mm256_set1_epi8(0x0A);
+  const __m256i cr = _mm256_set1_epi8(0x0D);
+  int k;
+  *quote = *bs = *op = *ws = 0;
+  for (k=0; k<2; k++) {
+    __m256i v = _mm256_loadu_si256((const __m256i*) (p + 32 * k));
+    __m256i f = _mm256_or_si256(v, fold);
+    __m256i o = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(f, open), _mm256_cmpeq_epi8(f, close)),
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, colon), _mm256_cmpeq_epi8(v, comma)));
+    __m256i w = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, sp), _mm256_cmpeq_epi8(v, ht)),
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, lf), _mm256_cmpeq_epi8(v, cr)));
+    *quote |= (uint64_t) (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, q)) << (32 * k);
+    *bs |= (uint64_t) (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, b)) << (32 * k);
+    *op |= (uint64_t) (unsigned int) _mm256_movemask_epi8(o) << (32 * k);
+    *ws |= (uint64_t) (unsigned int) _mm256_movemask_epi8(w) << (32 * k);
+  }
+#elif defined(__SSE2__)
+  const __m128i fold = _mm_set1_epi8(0x20);
+  const __m128i q = _mm_set1_epi8(0x22);
+  const __m128i b = _mm_set1_epi8(0x5C);
+  const __m128i open = _mm_set1_epi8(0x7B);
+  const __m128i close = _mm_set1_epi8(0x7D);
+  const __m128i colon = _mm_set1_epi8(0x3A);
+  const __m128i comma = _mm_set1_epi8(0x2C);
+  const __m128i sp = _mm_set1_epi8(0x20);
+  const __m128i ht = _mm_set1_epi8(0x09);
+  const __m128i lf = _mm_set1_epi8(0x0A);
+  const __m128i cr = _mm_set1_epi8(0x0D);
+  int k;
+  *quote = *bs = *op = *ws = 0;
+  for (k=0; k<4; k++) {
+    __m128i v = _mm_loadu_si128((const __m128i*) (p + 16 * k));
+    __m128i f = _mm_or_si128(v, fold);
+    __m128i o = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(f, open), _mm_cmpeq_epi8(f, close)),
+        _mm_or_si128(_mm_cmpeq_epi8(v, colon), _mm_cmpeq_epi8(v, comma)));
+    __m128i w = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, ht)),
+        _mm_or_si128(_mm_cmpeq_epi8(v, lf), _mm_cmpeq_epi8(v, cr)));
+    *quote |= (uint64_t) (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(v, q)) << (16 * k);
+    *bs |= (uint64_t) (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(v, b)) << (16 * k);
+    *op |= (uint64_t) (unsigned int) _mm_movemask_epi8(o) << (16 * k);
+    *ws |= (uint64_t) (unsigned int) _mm_movemask_epi8(w) << (16 * k);
+  }
+#else
+  int k;
+  *quote = *bs = *op = *ws = 0;
+  for (k=0; k<64; k++) {
+    int c = (unsigned char) p[k];
+    uint64_t bit = (uint64_t) 1 << k;
+    if (c == 0x22) {
+      *quote |= bit;
+    } else
+    if (c == 0x5C) {
+      *bs |= bit;
+    } else
+    if ((c | 0x20) == 0x7B || (c | 0x20) == 0x7D || c == 0x3A || c == 0x2C) {
+      *op |= bit;
+    } else
+    if (is_whitespace(c)) {
+      *ws |= bit;
     }
-    context->start_buffer = context->current_buffer;
-    context->start_pos = context->current_pos;
-    int i;
-    for (i=1; i<wlen; i++) {
-      if (next_char(context, &c) != 0) {
-        init_errno(context);
+  }
+#endif
+}
+
+/* bytes of input stage 1 indexes at once */
+#define INDEX_WINDOW 65536
+/* bytes staj_validate indexes at once, with its index on the stack */
+#define VALIDATE_WINDOW 4096
+/* room in the index past the entries of a window */
+#define INDEX_SLACK 72
+/* stage 1 state carried from one window to the next */
+#define INDEX_CARRY_ESCAPED 1
+#define INDEX_CARRY_IN_STRING 2
+#define INDEX_CARRY_SEP 4
+
+/*
+ * Stage 1: index the input after index_scanned, a window at a time,
+ * until at least k entries follow index_pos. The entries stage 2 has
+ * already passed are dropped, so the index stays small enough to be
+ * cached. A window is as long as the index has room for. Once the whole
+ * input is indexed the length of the input is appended as the last
+ * entry.
+ */
+static
+int fill_index(staj_context* context, int k) {
+  const uint64_t even = 0x5555555555555555ULL;
+  const char* buf = context->buffer_source.buf;
+  int len = context->buffer_source.len;
+  int carry = context->index_carry;
+  uint64_t prev_escaped = (carry & INDEX_CARRY_ESCAPED) != 0;
+  uint64_t prev_in_string = (carry & INDEX_CARRY_IN_STRING) ? ~(uint64_t) 0 : 0;
+  uint64_t prev_sep = (carry & INDEX_CARRY_SEP) != 0;
+  int* index = context->index;
+  int n = context->index_len - context->index_pos;
+  int i = context->index_scanned;
+  int window = (context->index_cap - INDEX_SLACK + 63) & ~63;
+  char tail[64];
+
+  memmove(index, index + context->index_pos, n * sizeof(int));
+  context->index_pos = 0;
+
+  while (n < k && i < len) {
+    int end = len - i > window ? i + window : len;
+    for (; i<end; i+=64) {
+      const char* p = buf + i;
+      uint64_t quote, bs, op, ws;
+      if (len - i < 64) {
+        memset(tail, 0x20, sizeof(tail));
+        memcpy(tail, p, len - i);
+        p = tail;
+      }
+      classify_block(p, &quote, &bs, &op, &ws);
+
+      /* a character is escaped if an odd run of backslashes precedes it */
+      bs &= ~prev_escaped;
+      uint64_t follows_escape = bs << 1 | prev_escaped;
+      uint64_t odd_starts = bs & ~even & ~follows_escape;
+      uint64_t even_runs = odd_starts + bs;
+      prev_escaped = even_runs < odd_starts;
+      quote &= ~((even ^ (even_runs << 1)) & follows_escape);
+
+      /* from an opening quote up to, but not including, the closing one */
+      uint64_t in_string = prefix_xor(quote) ^ prev_in_string;
+      prev_in_string = (uint64_t) ((int64_t) in_string >> 63);
+
+      /* literals and numbers start after a separator */
+      uint64_t sep = op | ws | quote;
+      uint64_t scalar = ~(sep | in_string) & (sep << 1 | prev_sep);
+      prev_sep = sep >> 63;
+
+      uint64_t m = (op & ~in_string) | quote | scalar;
+      int cnt = popcount64(m);
+      int* out = index + n;
+      /* four at a time, the index has room for the extra ones */
+      while (m != 0) {
+        out[0] = i + ctz64(m);
+        m &= m - 1;
+        out[1] = i + ctz64(m | (uint64_t) 1 << 63);
+        m &= m - 1;
+        out[2] = i + ctz64(m | (uint64_t) 1 << 63);
+        m &= m - 1;
+        out[3] = i + ctz64(m | (uint64_t) 1 << 63);
+        m &= m - 1;
+        out += 4;
+      }
+      n += cnt;
+    }
+  }
+  context->index_scanned = i < len ? i : len;
+  context->index_carry = (prev_escaped ? INDEX_CARRY_ESCAPED : 0) |
+                         (prev_in_string ? INDEX_CARRY_IN_STRING : 0) |
+                         (prev_sep ? INDEX_CARRY_SEP : 0);
+  if (i >= len) {
+    index[n++] = len;
+  }
+  context->index_len = n;
+  return 0;
+}
+
+/*
+ * Make sure at least k entries follow index_pos, or the end of the input
+ */
+static inline
+void index_ensure(staj_context* context, int k) {
+  if (context->index_pos + k > context->index_len &&
+      context->index_scanned < context->buffer_source.len) {
+    fill_index(context, k);
+  }
+}
+
+/*
+ * Make the whole buffer the only buffer of the context and index the
+ * first window of it with the index the context has
+ */
+static
+int start_index(staj_context* ctx) {
+  ctx->buffers[0] = ctx->buffer_source.buf;
+  ctx->buffer_lengths[0] = ctx->buffer_source.len;
+  ctx->buffer_source.rem = 0;
+  ctx->current_buffer = 0;
+  ctx->index_pos = 0;
+  ctx->index_len = 0;
+  ctx->index_scanned = 0;
+  ctx->index_carry = INDEX_CARRY_SEP;
+  return fill_index(ctx, 3);
+}
+
+/*
+ * Same with an index of a window of INDEX_WINDOW bytes, or of the whole
+ * buffer if it is shorter
+ */
+static
+int init_index(staj_context* ctx) {
+  int cap = (ctx->buffer_source.len < INDEX_WINDOW ? ctx->buffer_source.len : INDEX_WINDOW) + INDEX_SLACK;
+  if (ctx->index_cap < cap) {
+    int* index = (int*) staj_realloc(ctx->allocator, ctx->index, cap * sizeof(int));
+    if (index == NULL) {
+      ctx->_errno = STAJ_ENOMEM;
+      return -1;
+    }
+    ctx->index = index;
+    ctx->index_cap = cap;
+  }
+  return start_index(ctx);
+}
+
+/*
+ * Check the characters between the quotes of a string. Returns 0 or the
+ * parse error. The same rules as in staj_next.
+ */
+static
+int check_string(const char* p, const char* e) {
+  while ((p = scan_string_chars(p, e)) < e) {
+    int c = (unsigned char) *p++;
+    if (c != 0x5C) {
+      /* a control character or a bad UTF-8 sequence */
+      return STAJ_INVALID_UTF8_SEQUENCE;
+    }
+    if (p == e) {
+      return STAJ_INVALID_ESCAPE_SEQUENCE;
+    }
+    c = (unsigned char) *p++;
+    if (c == 0x75) { /* \uXXXX */
+      int i;
+      if (e - p < 4) {
+        return STAJ_INVALID_ESCAPE_SEQUENCE;
+      }
+      for (i=0; i<4; i++) {
+        c = (unsigned char) *p++;
+        if (!((c >= '0' && c <= '9') ||
+              (c >= 'a' && c <= 'f') ||
+              (c >= 'A' && c <= 'F'))) {
+          return STAJ_INVALID_ESCAPE_SEQUENCE;
+        }
+      }
+    } else
+    if (!(c == 0x22 || c == 0x5C || c == 0x2F ||
+          c == 0x62 || c == 0x66 || c == 0x6E ||
+          c == 0x72 || c == 0x74)) {
+      return STAJ_INVALID_ESCAPE_SEQUENCE;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Check the number in [p, e). Returns 0 and the end of the number in
+ * *end or the parse error. The same rules as in staj_next.
+ */
+static
+int check_number(const char* p, const char* e, const char** end) {
+  if (*p == '-') {
+    p ++;
+    if (p == e || !is_digit(*p)) {
+      return STAJ_UNEXPECTED_SYMBOL;
+    }
+  }
+  if (*p == '0') {
+    p ++;
+    if (p < e && is_digit(*p)) {
+      return STAJ_INVALID_NUMBER_FORMAT;
+    }
+  } else {
+    while (p < e && is_digit(*p)) {
+      p ++;
+    }
+  }
+  if (p < e && *p == 0x2E) {
+    p ++;
+    if (p == e || !is_digit(*p)) {
+      return STAJ_INVALID_NUMBER_FORMAT;
+    }
+    while (p < e && is_digit(*p)) {
+      p ++;
+    }
+  }
+  if (p < e && (*p == 0x65 || *p == 0x45)) {
+    p ++;
+    if (p < e && (*p == 0x2D || *p == 0x2B)) {
+      p ++;
+    }
+    if (p == e || !is_digit(*p)) {
+      return STAJ_INVALID_NUMBER_FORMAT;
+    }
+    while (p < e && is_digit(*p)) {
+      p ++;
+    }
+  }
+  *end = p;
+  return 0;
+}
+
+/*
+ * Check the literal or number at s, up to the next indexed position e.
+ * Returns 0 and the end of it in *end or the parse error.
+ */
+static inline
+int check_scalar(const char* s, const char* e, const char** end) {
+  const char* p = s;
+  while (p < e && !is_whitespace(*p)) {
+    p ++;
+  }
+  e = p;
+  if (*s == 't' || *s == 'f' || *s == 'n') {
+    const char* word = *s == 't' ? "true" : *s == 'f' ? "false" : "null";
+    if (e - s != (int) strlen(word) || memcmp(s, word, e - s) != 0) {
+      return STAJ_UNEXPECTED_SYMBOL;
+    }
+  } else {
+    int r = check_number(s, e, &p);
+    if (r != 0) {
+      return r;
+    }
+    if (p != e) {
+      return STAJ_UNEXPECTED_SYMBOL;
+    }
+  }
+  *end = e;
+  return 0;
+}
+
+static inline
+int index_char(staj_context* context) {
+  int p = context->index[context->index_pos];
+  if (p >= context->buffer_source.len) {
+    return END_OF_INPUT;
+  }
+  return (unsigned char) context->buffer_source.buf[p];
+}
+
+/*
+ * Stage 2: a token has been read, read the separator after it
+ */
+static inline
+int index_after_token(staj_context* context, int after) {
+  int cls = char_class(index_char(context));
+  if (separator_context(context, after, cls) != 0) {
+    init_errno(context);
+    return -1;
+  }
+  if (cls == CLASS_COMMA || cls == CLASS_COLON) {
+    context->index_pos ++;
+  }
+  return 0;
+}
+
+/*
+ * Stage 2: a closing bracket has been read, read the separator after it
+ * unless it ends the document
+ */
+static inline
+int index_after_container(staj_context* context) {
+  int t;
+  peek_context(context, &t);
+  if (t == -1) {
+    context->context = STAJ_CTX_END_DOCUMENT;
+    return 0;
+  }
+  return index_after_token(context, t ? AFTER_PROPERTY_VALUE : AFTER_ARRAY_ITEM);
+}
+
+/*
+ * Stage 2: staj_next in indexed mode
+ */
+static
+int next_indexed(staj_context* context) {
+  const char* buf = context->buffer_source.buf;
+  int p;
+  int c;
+  int t;
+  int r;
+  int cls;
+  int action;
+
+  index_ensure(context, 3);
+  p = context->index[context->index_pos];
+  c = index_char(context);
+  cls = char_class(c);
+  action = transitions[context->context][cls];
+
+  switch (action) {
+  case ACTION_EOF:
+    if (context->context == STAJ_CTX_START_DOCUMENT &&
+        !((context->flags & STAJ_MULTI_DOCUMENT) && context->token == STAJ_END_DOCUMENT)) {
+      set_parse_error(context, STAJ_UNEXPECTED_EOF);
+      init_errno(context);
+      return -1;
+    }
+    context->token = STAJ_EOF;
+    return 0;
+  case ACTION_BEGIN_OBJECT:
+  case ACTION_BEGIN_ARRAY:
+    context->start_pos = context->end_pos = p;
+    context->index_pos ++;
+    if (action == ACTION_BEGIN_OBJECT) {
+      context->token = STAJ_BEGIN_OBJECT;
+      context->context = STAJ_CTX_PROPERTY_NAME_OBJECT_END;
+    } else {
+      context->token = STAJ_BEGIN_ARRAY;
+      context->context = STAJ_CTX_ARRAY_ITEM_ARRAY_END;
+    }
+    if (push_context(context, action == ACTION_BEGIN_OBJECT) != 0) {
+      init_errno(context);
+      return -1;
+    }
+    return 0;
+  case ACTION_END_OBJECT:
+  case ACTION_END_ARRAY:
+    context->token = action == ACTION_END_OBJECT ? STAJ_END_OBJECT : STAJ_END_ARRAY;
+    context->start_pos = context->end_pos = p;
+    context->index_pos ++;
+    if (pop_context(context, &t) != 0) {
+      init_errno(context);
+      return -1;
+    }
+    return index_after_container(context);
+  case ACTION_PROPERTY_NAME:
+  case ACTION_STRING: {
+    int q = context->index[context->index_pos + 1];
+    if ((r = check_string(buf + p + 1, buf + q)) != 0) {
+      set_parse_error(context, r);
+      init_errno(context);
+      return -1;
+    }
+    if (q >= context->buffer_source.len) {
+      set_parse_error(context, STAJ_UNEXPECTED_EOF);
+      init_errno(context);
+      return -1;
+    }
+    context->start_pos = p;
+    context->end_pos = q;
+    context->index_pos += 2;
+    if (action == ACTION_PROPERTY_NAME) {
+      context->token = STAJ_PROPERTY_NAME;
+      return index_after_token(context, AFTER_PROPERTY_NAME);
+    }
+    context->token = STAJ_STRING;
+    return index_after_token(context, value_separators[context->context]);
+  }
+  case ACTION_LITERAL:
+  case ACTION_NUMBER: {
+    const char* e;
+    if ((r = check_scalar(buf + p, buf + context->index[context->index_pos + 1], &e)) != 0) {
+      set_parse_error(context, r);
+      init_errno(context);
+      return -1;
+    }
+    if (action == ACTION_LITERAL) {
+      context->token = c == 'n' ? STAJ_NULL : STAJ_BOOLEAN;
+    } else {
+      context->token = STAJ_NUMBER;
+    }
+    context->start_pos = p;
+    context->end_pos = (int) (e - buf) - 1;
+    context->index_pos ++;
+    return index_after_token(context, value_separators[context->context]);
+  }
+  default:
+    unexpected(context, cls);
+    init_errno(context);
+    return -1;
+  }
+}
+
+/*
+ * Stage 2 of staj_validate: the same checks as next_indexed, but no
+ * tokens, the loop only stops at the end of the document or at an
+ * error. *pos is the position of the token or separator the error is
+ * found at.
+ */
+static
+int validate_indexed(staj_context* context, int* pos) {
+  const char* buf = context->buffer_source.buf;
+  int len = context->buffer_source.len;
+  int* index;
+  int after;
+  int p;
+  int t;
+  int r;
+  int cls;
+  int action;
+  const char* e;
+
+  for (;;) {
+    index_ensure(context, 3);
+    index = context->index + context->index_pos;
+    p = index[0];
+    cls = char_class(p < len ? (unsigned char) buf[p] : END_OF_INPUT);
+    action = transitions[context->context][cls];
+
+    switch (action) {
+    case ACTION_BEGIN_OBJECT:
+    case ACTION_BEGIN_ARRAY:
+      if (push_context(context, action == ACTION_BEGIN_OBJECT) != 0) {
+        *pos = p;
         return -1;
       }
-      if (c != word[i]) {
-        set_parse_error(context, STAJ_UNEXPECTED_SYMBOL);
-        init_errno(context);
+      context->context = action == ACTION_BEGIN_OBJECT ?
+        STAJ_CTX_PROPERTY_NAME_OBJECT_END : STAJ_CTX_ARRAY_ITEM_ARRAY_END;
+      context->index_pos ++;
+      continue;
+    case ACTION_END_OBJECT:
+    case ACTION_END_ARRAY:
+      pop_context(context, &t);
+      peek_context(context, &t);
+      context->index_pos ++;
+      if (t == -1) {
+        context->context = STAJ_CTX_END_DOCUMENT;
+        continue;
+      }
+      after = t ? AFTER_PROPERTY_VALUE : AFTER_ARRAY_ITEM;
+      break;
+    case ACTION_PROPERTY_NAME:
+    case ACTION_STRING:
+      if ((r = check_string(buf + p + 1, buf + index[1])) != 0) {
+        set_parse_error(context, r);
+        *pos = p;
+        return -1;
+      }
+      if (index[1] >= len) {
+        set_parse_error(context, STAJ_UNEXPECTED_EOF);
+        *pos = p;
+        return -1;
+      }
+      context->index_pos += 2;
+      after = action == ACTION_PROPERTY_NAME ?
+        AFTER_PROPERTY_NAME : value_separators[context->context];
+      break;
+    case ACTION_LITERAL:
+    case ACTION_NUMBER:
+      if ((r = check_scalar(buf + p, buf + index[1], &e)) != 0) {
+        set_parse_error(context, r);
+        *pos = p;
         return -1;
       }
+      context->index_pos ++;
+      after = value_separators[context->context];
+      break;
+    case ACTION_EOF:
+      if (context->context == STAJ_CTX_END_DOCUMENT) {
+        return 0;
+      }
+      /* fall through */
+    default:
+      unexpected(context, cls);
+      *pos = p;
+      return -1;
     }
-    context->end_buffer = context->current_buffer;
-    context->end_pos = context->current_pos;
-    if (next_char(context, &c) != 0) {
-      init_errno(context);
+
+    /* the separator after the token */
+    p = context->index[context->index_pos];
+    cls = char_class(p < len ? (unsigned char) buf[p] : END_OF_INPUT);
+    if (separator_context(context, after, cls) != 0) {
+      *pos = p;
       return -1;
     }
+    if (cls == CLASS_COMMA || cls == CLASS_COLON) {
+      context->index_pos ++;
+    }
+  }
+}
+
+/* how far staj_read_string has read the current string token */
+#define STRING_UNREAD 0
+/* from the token in the buffers */
+#define STRING_SPAN 1
+/* STAJ_LAZY_STRINGS: from the input at the cursor */
+#define STRING_INPUT 2
+#define STRING_DONE 3
+
+int staj_has_next(staj_context* context) {
+  int c;
+  if (context->string_state == STRING_INPUT) {
+    return 1;
+  }
+  drop_token(context);
+  if ((context->flags & STAJ_MULTI_DOCUMENT) &&
+      context->context == STAJ_CTX_END_DOCUMENT) {
+    return 1;
+  }
+  if (context->index != NULL) {
+    index_ensure(context, 1);
+    return index_char(context) != END_OF_INPUT;
+  }
+  if (skip_whitespace(context, &c) != 0) {
+    init_errno(context);
+    would_block(context);
+    return -1;
+  }
+  return c != END_OF_INPUT;
+}
+
+/*
+ * Read the string that starts at the cursor, up to the character after
+ * its closing quote
+ */
+static
+int read_string(staj_context* context) {
+  int c;
+  int r;
+  context->start_buffer = context->current_buffer;
+  context->start_pos = context->current_pos;
+  for (;;) {
+    skip_string_chars(context);
+    if ((r = next_char(context, &c)) != 0) {
+      return r;
+    }
+    if (c == 0x22) { /* quote */
+      context->end_buffer = context->current_buffer;
+      context->end_pos = context->current_pos;
+      return next_char(context, &c);
+    }
+    if (c == 0x5C) { /* escape */
+      if (next_char(context, &c) != 0) {
+        return -1;
+      }
+      if (c == 0x22 || c == 0x5C || c == 0x2F ||
+          c == 0x62 || c == 0x66 || c == 0x6E ||
+          c == 0x72 || c == 0x74) {
+        /* the escaped character is the current one, the loop goes on
+           after it */
+      } else
+      if (c == 0x75) { /* \uXXXX */
+        int i;
+        for (i=0; i<4; i++) {
+          if (next_char(context, &c) != 0) {
+            return -1;
+          }
+          if ((c >= '0' && c <= '9') ||
+              (c >= 'a' && c <= 'f') ||
+              (c >= 'A' && c <= 'F')) {
+          } else {
+            set_parse_error(context, STAJ_INVALID_ESCAPE_SEQUENCE);
+            return -1;
+          }
+        }
+      } else {
+        set_parse_error(context, STAJ_INVALID_ESCAPE_SEQUENCE);
+        return -1;
+      }
+    } else
+    if ((c == 0x20) ||
+        (c == 0x21) ||
+        ((c >= 0x23) && (c <= 0x5B)) ||
+        ((c >= 0x5D) && (c <= 0x7F))) {
+      // continue
+    } else
+    if (c >= 0x80) {
+      /* a sequence cut by the end of a buffer, or an invalid one */
+      int lo, hi;
+      int n = utf8_lead(c, &lo, &hi);
+      if (n == 0) {
+        set_parse_error(context, STAJ_INVALID_UTF8_SEQUENCE);
+        return -1;
+      }
+      while (n-- > 0) {
+        if (next_char(context, &c) != 0) {
+          return -1;
+        }
+        if (c < lo || c > hi) {
+          set_parse_error(context, STAJ_INVALID_UTF8_SEQUENCE);
+          return -1;
+        }
+        lo = 0x80;
+        hi = 0xBF;
+      }
+    } else
+    if (c == END_OF_INPUT) {
+      set_parse_error(context, STAJ_UNEXPECTED_EOF);
+      return -1;
+    } else {
+      set_parse_error(context, STAJ_INVALID_UTF8_SEQUENCE);
+      return -1;
+    }
+  }
+}
+
+/*
+ * Read the literal (true, false or null) that starts with c at the
+ * cursor, up to the character after it
+ */
+static
+int read_literal(staj_context* context, int c) {
+  const char* word;
+  int wlen;
+  const char *p, *e;
+  switch (c) {
+  case 'n':
+    word = "null";
+    wlen = 4;
+    context->token = STAJ_NULL;
+    break;
+  case 'f':
+    word = "false";
+    wlen = 5;
+    context->token = STAJ_BOOLEAN;
+    break;
+  default:
+    word = "true";
+    wlen = 4;
+    context->token = STAJ_BOOLEAN;
+    break;
+  }
+  context->start_buffer = context->current_buffer;
+  context->start_pos = context->current_pos;
+  get_range(context, &p, &e);
+  if (e - p >= wlen - 1) {
+    if (memcmp(p, word + 1, wlen - 1) != 0) {
+      set_parse_error(context, STAJ_UNEXPECTED_SYMBOL);
+      return -1;
+    }
+    set_cursor(context, p + wlen - 1);
+  } else {
+    int i;
+    for (i=1; i<wlen; i++) {
+      if (next_char(context, &c) != 0) {
+        return -1;
+      }
+      if (c != word[i]) {
+        set_parse_error(context, STAJ_UNEXPECTED_SYMBOL);
+        return -1;
+      }
+    }
+  }
+  context->end_buffer = context->current_buffer;
+  context->end_pos = context->current_pos;
+  return next_char(context, &c);
+}
+
+/*
+ * Read the digits that follow the cursor, the last one is the end of
+ * the token so far; c is set to the character after them
+ */
+static inline
+int read_digits(staj_context* context, int* c) {
+  int r;
+  for (;;) {
+    skip_digits(context);
+    if ((r = next_char(context, c)) != 0) {
+      return r;
+    }
+    if (*c >= '0' && *c <= '9') {
+      context->end_buffer = context->current_buffer;
+      context->end_pos = context->current_pos;
+    } else {
+      return 0;
+    }
+  }
+}
+
+/*
+ * Read the fraction and exponent of a number, c is the character after
+ * its integer part, up to the character after them
+ */
+static
+int read_fraction(staj_context* context, int c) {
+  if (c == 0x2E) {
+    if (next_char(context, &c) != 0) {
+      return -1;
+    }
+    if (!(c >= '0' && c <= '9')) {
+      set_parse_error(context, STAJ_INVALID_NUMBER_FORMAT);
+      return -1;
+    }
+    context->end_buffer = context->current_buffer;
+    context->end_pos = context->current_pos;
+    if (read_digits(context, &c) != 0) {
+      return -1;
+    }
+  }
+  if (c == 0x65 || c == 0x45) {
+    if (next_char(context, &c) != 0) {
+      return -1;
+    }
+    if (c == 0x2D || c == 0x2B) {
+      if (next_char(context, &c) != 0) {
+        return -1;
+      }
+    }
+    if (!(c >= '0' && c <= '9')) {
+      set_parse_error(context, STAJ_INVALID_NUMBER_FORMAT);
+      return -1;
+    }
+    context->end_buffer = context->current_buffer;
+    context->end_pos = context->current_pos;
+    if (read_digits(context, &c) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * A token has been read and the cursor is past it: read the separator
+ * after it
+ */
+static inline
+int read_separator(staj_context* context, int after) {
+  int c;
+  int cls;
+  if (skip_whitespace(context, &c) != 0) {
+    return -1;
+  }
+  cls = char_class(c);
+  if (separator_context(context, after, cls) != 0) {
+    return -1;
+  }
+  if (cls == CLASS_COMMA || cls == CLASS_COLON) {
+    return next_char(context, &c);
+  }
+  return 0;
+}
+
+/*
+ * A closing bracket has been read: read the separator after it unless it
+ * ends the document
+ */
+static inline
+int read_after_container(staj_context* context) {
+  int t;
+  peek_context(context, &t);
+  if (t == -1) {
+    context->context = STAJ_CTX_END_DOCUMENT;
+    return 0;
+  }
+  return read_separator(context, t ? AFTER_PROPERTY_VALUE : AFTER_ARRAY_ITEM);
+}
+
+/*
+ * Read the next token, see staj_next
+ */
+static inline
+int next_token(staj_context* context) {
+  int c;
+  int t;
+  int r;
+  int cls;
+  int action;
+
+  drop_token(context);
+  if ((context->flags & STAJ_MULTI_DOCUMENT) &&
+      context->context == STAJ_CTX_END_DOCUMENT) {
+    /* report the boundary, the next document starts with the next call */
+    context->token = STAJ_END_DOCUMENT;
+    context->context = STAJ_CTX_START_DOCUMENT;
+    return 0;
+  }
+  if (context->index != NULL) {
+    return next_indexed(context);
+  }
+  if (skip_whitespace(context, &c) != 0) {
+    init_errno(context);
+    return -1;
+  }
+  cls = char_class(c);
+  action = transitions[context->context][cls];
+  switch (action) {
+  case ACTION_EOF:
+    if (context->context == STAJ_CTX_START_DOCUMENT &&
+        !((context->flags & STAJ_MULTI_DOCUMENT) && context->token == STAJ_END_DOCUMENT)) {
+      set_parse_error(context, STAJ_UNEXPECTED_EOF);
+      init_errno(context);
+      return -1;
+    }
+    context->token = STAJ_EOF;
+    return 0;
+  case ACTION_BEGIN_OBJECT:
+  case ACTION_BEGIN_ARRAY:
+    context->start_buffer = context->current_buffer;
+    context->start_pos = context->current_pos;
+    context->end_buffer = context->current_buffer;
+    context->end_pos = context->current_pos;
+    if (action == ACTION_BEGIN_OBJECT) {
+      context->token = STAJ_BEGIN_OBJECT;
+      context->context = STAJ_CTX_PROPERTY_NAME_OBJECT_END;
+    } else {
+      context->token = STAJ_BEGIN_ARRAY;
+      context->context = STAJ_CTX_ARRAY_ITEM_ARRAY_END;
+    }
+    if (push_context(context, action == ACTION_BEGIN_OBJECT) != 0 ||
+        next_char(context, &c) != 0) {
+      init_errno(context);
+      return -1;
+    }
+    return 0;
+  case ACTION_END_OBJECT:
+  case ACTION_END_ARRAY:
+    context->token = action == ACTION_END_OBJECT ? STAJ_END_OBJECT : STAJ_END_ARRAY;
+    context->start_buffer = context->current_buffer;
+    context->start_pos = context->current_pos;
+    context->end_buffer = context->current_buffer;
+    context->end_pos = context->current_pos;
+    if (pop_context(context, &t) != 0 ||
+        next_char(context, &c) != 0) {
+      init_errno(context);
+      return -1;
+    }
+    r = read_after_container(context);
+    break;
+  case ACTION_PROPERTY_NAME:
+    r = read_string(context);
+    if (r == 0) {
+      context->token = STAJ_PROPERTY_NAME;
+      r = read_separator(context, AFTER_PROPERTY_NAME);
+    }
+    break;
+  case ACTION_STRING:
+    if (context->flags & STAJ_LAZY_STRINGS) {
+      /* only the opening quote, staj_read_string reads the rest */
+      context->token = STAJ_STRING;
+      context->start_buffer = context->end_buffer = context->current_buffer;
+      context->start_pos = context->end_pos = context->current_pos;
+      context->string_state = STRING_INPUT;
+      return 0;
+    }
+    r = read_string(context);
+    if (r == 0) {
+      context->token = STAJ_STRING;
+      r = read_separator(context, value_separators[context->context]);
+    }
+    break;
+  case ACTION_LITERAL:
+    r = read_literal(context, c);
+    if (r == 0) {
+      r = read_separator(context, value_separators[context->context]);
+    }
+    break;
+  case ACTION_NUMBER:
+    context->token = STAJ_NUMBER;
+    context->start_buffer = context->current_buffer;
+    context->start_pos = context->current_pos;
+    if (c == '-') {
+      if (next_char(context, &c) != 0) {
+        init_errno(context);
+        return -1;
+      }
+      if (!(c >= '0' && c <= '9')) {
+        set_parse_error(context, STAJ_UNEXPECTED_SYMBOL);
+        init_errno(context);
+        return -1;
+      }
+    }
+    context->end_buffer = context->current_buffer;
+    context->end_pos = context->current_pos;
+    if (c == '0') {
+      if (next_char(context, &c) != 0) {
+        init_errno(context);
+        return -1;
+      }
+      /* no digits after a leading zero */
+      if (c >= '0' && c <= '9') {
+        set_parse_error(context, STAJ_INVALID_NUMBER_FORMAT);
+        init_errno(context);
+        return -1;
+      }
+    } else {
+      for (;;) {
+        skip_digits(context);
+        if (next_char(context, &c) != 0) {
+          init_errno(context);
+          return -1;
+        }
+        if (!(c >= '0' && c <= '9')) {
+          break;
+        }
+        context->end_buffer = context->current_buffer;
+        context->end_pos = context->current_pos;
+      }
+    }
+    if (c == 0x2E || c == 0x65 || c == 0x45) {
+      r = read_fraction(context, c);
+    } else {
+      r = 0;
+    }
+    if (r == 0) {
+      r = read_separator(context, value_separators[context->context]);
+    }
+    break;
+  default:
+    unexpected(context, cls);
+    r = -1;
+    break;
+  }
+  if (r != 0) {
+    init_errno(context);
+    return -1;
+  }
+  return 0;
+}
+
+int staj_next(staj_context* context) {
+  staj_context_type type;
+  staj_token_type token;
+  int b;
+  int pos;
+  int sp;
+
+  if (context->_errno != 0) {
+    init_errno(context);
+    return -1;
+  }
+  if (context->string_state == STRING_INPUT) {
+    /* the part of a lazy string staj_read_string has not read */
+    type = context->context;
+    if (read_string(context) != 0 ||
+        read_separator(context, value_separators[context->context]) != 0) {
+      init_errno(context);
+      if (would_block(context)) {
+        context->extra_buffers += context->current_buffer - context->start_buffer;
+        context->current_buffer = context->start_buffer;
+        context->current_pos = context->start_pos;
+        context->context = type;
+      }
+      return -1;
+    }
+  }
+  context->string_state = STRING_UNREAD;
+  context->string_pending_len = 0;
+  context->skip_depth = 0;
+
+  b = context->current_buffer;
+  pos = context->current_pos;
+  type = context->context;
+  token = context->token;
+  sp = context->curr_context_stack_ptr;
+  if (next_token(context) == 0) {
+    return 0;
+  }
+  if (would_block(context)) {
+    /* the input ran out inside the token: go back and read it again once
+       more input is fed. In windowed mode the buffers before the token
+       may have been handed back, but the start of the token is kept.
+       Before the first buffer the start is in the first one. */
+    if (b < 0 ? context->current_buffer >= 0 : context->release_buffer != NULL) {
+      b = context->start_buffer;
+      pos = context->start_pos;
+    }
+    context->extra_buffers += context->current_buffer - b;
+    context->current_buffer = b;
+    context->current_pos = pos;
+    context->context = type;
+    context->token = token;
+    context->curr_context_stack_ptr = sp;
+    context->end_buffer = context->start_buffer;
+    context->end_pos = context->start_pos;
+    context->string_state = STRING_DONE;
+  }
+  return -1;
+}
+
+/*
+ * skip_scan ran out of input in push mode: keep its state for the next
+ * call
+ */
+static inline
+int skip_suspend(staj_context* context, int depth, int in_string) {
+  if (context->_errno == STAJ_EAGAIN) {
+    context->skip_depth = depth;
+    context->skip_string = in_string;
+  }
+  return -1;
+}
+
+/*
+ * staj_skip_value: move the cursor to the closing bracket of the
+ * current object or array by looking at quotes, escapes and brackets
+ * only
+ */
+static
+int skip_scan(staj_context* context) {
+  int c;
+  int depth = 1;
+  int in_string = 0;
+  const char *p, *e;
+
+  if (context->skip_depth > 0) {
+    /* resumed after STAJ_EAGAIN: the character at the cursor has been
+       looked at, a blank stands for it. in_string 2 is the character
+       after a backslash. */
+    depth = context->skip_depth;
+    in_string = context->skip_string;
+    context->skip_depth = 0;
+    c = 0x20;
+    if (in_string == 2) {
+      in_string = 1;
+      if (next_char(context, &c) != 0) {
+        return skip_suspend(context, depth, 2);
+      }
+      if (c != END_OF_INPUT) {
+        c = 0x20;
+      }
+    }
+  } else
+  if (get_char(context, &c) != 0) {
+    if (next_char(context, &c) != 0) {
+      return -1;
+    }
+  }
+  for (;;) {
+    if (c == END_OF_INPUT) {
+      set_parse_error(context, STAJ_UNEXPECTED_EOF);
+      return -1;
+    }
+    if (in_string) {
+      if (c == 0x22) {
+        in_string = 0;
+      } else
+      if (c == 0x5C) { /* the escaped character can't end the string */
+        if (next_char(context, &c) != 0) {
+          return skip_suspend(context, depth, 2);
+        }
+        if (c == END_OF_INPUT) {
+          continue;
+        }
+      }
+    } else
+    if (c == 0x22) {
+      in_string = 1;
+    } else
+    if (c == 0x7B || c == 0x5B) {
+      depth ++;
+    } else
+    if (c == 0x7D || c == 0x5D) {
+      if (--depth == 0) {
+        return 0;
+      }
+    }
+    /* windowed mode: the skipped content is not kept */
+    drop_token(context);
+    get_range(context, &p, &e);
+    set_cursor(context, in_string ? scan_string_end(p, e) : scan_structural(p, e));
+    if (next_char(context, &c) != 0) {
+      return skip_suspend(context, depth, in_string);
+    }
+  }
+}
+
+/*
+ * staj_skip_value in indexed mode: walk the index, strings are two
+ * entries and have no brackets inside
+ */
+static
+int skip_indexed(staj_context* context) {
+  int depth = 1;
+  int c;
+  for (;;) {
+    index_ensure(context, 2);
+    c = index_char(context);
+    if (c == END_OF_INPUT) {
+      set_parse_error(context, STAJ_UNEXPECTED_EOF);
+      return -1;
+    }
+    if (c == 0x22) {
+      context->index_pos ++;
+      if (index_char(context) == END_OF_INPUT) {
+        set_parse_error(context, STAJ_UNEXPECTED_EOF);
+        return -1;
+      }
+    } else
+    if (c == 0x7B || c == 0x5B) {
+      depth ++;
+    } else
+    if (c == 0x7D || c == 0x5D) {
+      if (--depth == 0) {
+        return 0;
+      }
+    }
+    context->index_pos ++;
+  }
+}
+
+/*
+ * staj_skip_value
+ *
+ * Skip the value at the cursor. If the current token is a property
+ * name its value is read first. If the value is an object or an array
+ * the input is scanned for the matching closing bracket, only quotes,
+ * escapes and brackets are looked at, and the closing bracket is read
+ * as the current token (STAJ_END_OBJECT or STAJ_END_ARRAY). The skipped
+ * content is not validated. Scalar values are already consumed, for
+ * them nothing is done. In push mode a scan cut by STAJ_EAGAIN goes on
+ * where it stopped with the next call.
+ */
+int staj_skip_value(staj_context* context) {
+  int t;
+
+  if (context->_errno != 0) {
+    init_errno(context);
+    return -1;
+  }
+  if (context->token == STAJ_PROPERTY_NAME &&
+      context->context == STAJ_CTX_PROPERTY_VALUE) {
+    if (staj_next(context) != 0) {
+      return -1;
+    }
+  }
+  if (!(context->token == STAJ_BEGIN_OBJECT &&
+        context->context == STAJ_CTX_PROPERTY_NAME_OBJECT_END) &&
+      !(context->token == STAJ_BEGIN_ARRAY &&
+        context->context == STAJ_CTX_ARRAY_ITEM_ARRAY_END)) {
+    return 0;
+  }
+
+  if ((context->index != NULL ? skip_indexed(context) : skip_scan(context)) != 0) {
+    init_errno(context);
+    would_block(context);
+    return -1;
+  }
+
+  /* let staj_next read the closing bracket, it checks that the bracket
+     matches and restores the context of the enclosing value */
+  if (peek_context(context, &t) != 0) {
+    init_errno(context);
+    return -1;
+  }
+  context->context = t == 1 ? STAJ_CTX_PROPERTY_NAME_OBJECT_END : STAJ_CTX_ARRAY_ITEM_ARRAY_END;
+  return staj_next(context);
+}
+
+/*
+ * staj_get_token
+ *
+ * Get current token
+ *
+ * context - StAJ context
+ *
+ * returns token type
+ * in case of error return -1 and sets errno to:
+ * STAJ_ENOTOKEN - need to call next() at least once
+ * STAJ_ENOMEM - not enough memory allocated during initialization
+ * STAJ_EPARSE - parse error
+ */
+int staj_get_token(staj_context* context) {
+  return context->token;
+}
+
+int staj_get_length(staj_context* context) {
+  int i;
+  int l;
+  if (context->start_buffer == context->end_buffer) {
+    l = context->end_pos - context->start_pos + 1;
+  } else {
+    l = context->buffer_lengths[context->start_buffer] - context->start_pos;  
+    for (i=context->start_buffer+1; i<context->end_buffer; i++) {
+      l += context->buffer_lengths[i];
+    }
+    l += context->end_pos + 1;
+  }
+  return l;
+}
+
+static inline
+int min(int a, int b) {
+  return (a < b ? a : b);
+}
+
+int staj_get_text(staj_context* context, char* buffer, int max) {
+  int l;
+  if (context->start_buffer == context->end_buffer) {
+    l = context->end_pos - context->start_pos + 1;
+    memcpy(buffer, context->buffers[context->start_buffer] + context->start_pos, min(l, max));
+  } else {
+    l = 0;
+    int t = context->buffer_lengths[context->start_buffer] - context->start_pos;
+    memcpy(buffer+l, 
+            context->buffers[context->start_buffer]+context->start_pos, 
+            min(max-l, t));
+    l += t;
+    int i;
+    for (i=context->start_buffer+1; i<context->end_buffer; i++) {
+      t = context->buffer_lengths[i];
+      memcpy(buffer+l,
+              context->buffers[i],
+              min(max-l, t));
+      l += t;
+    }
+    t = context->end_pos + 1;
+    memcpy(buffer+l,
+            context->buffers[context->end_buffer],
+            min(max-l, t));
+    l += t;
+  }
+
+  if (l < max) {
+    buffer[l] = 0;
+  }
+
+  return l;
+}
+
+/*
+ * Part of the current token that lies in buffer b,
+ * start_buffer <= b <= end_buffer. Returns its length.
+ */
+static inline
+int token_segment(staj_context* context, int b, const char** p) {
+  int s = (b == context->start_buffer) ? context->start_pos : 0;
+  int e = (b == context->end_buffer) ? context->end_pos + 1 : context->buffer_lengths[b];
+  *p = context->buffers[b] + s;
+  return e - s;
+}
+
+/*
+ * staj_get_view
+ *
+ * Get the literal representation of the token without copying it
+ *
+ * context - StAJ context
+ * ptr - receives the pointer to the token in the input buffer
+ * len - receives the length of the token
+ *
+ * The pointer stays valid as long as the input buffer does (in windowed
+ * mode until the next call to staj_has_next or staj_next).
+ *
+ * returns 0 if the token is contiguous in the input
+ * otherwise returns -1 and sets errno to STAJ_EINVAL, use
+ * staj_get_intervals to get its parts
+ */
+int staj_get_view(staj_context* context, const char** ptr, int* len) {
+  if (context->start_buffer != context->end_buffer) {
+    errno = STAJ_EINVAL;
+    return -1;
+  }
+  *len = token_segment(context, context->start_buffer, ptr);
+  return 0;
+}
+
+/*
+ * staj_get_intervals
+ *
+ * Get the parts of the literal representation of the token as they lie
+ * in the input buffers, without copying them
+ *
+ * context - StAJ context
+ * intervals - receives up to max parts. The start field of every part is
+ *   the offset of the part within its buffer.
+ * max - size of intervals
+ *
+ * returns the number of parts the token consists of. If it is greater
+ * than max, only the first max parts are stored.
+ */
+int staj_get_intervals(staj_context* context, staj_interval* intervals, int max) {
+  int n = 0;
+  int b;
+  for (b=context->start_buffer; b<=context->end_buffer; b++) {
+    const char* p;
+    int l = token_segment(context, b, &p);
+    if (l <= 0) {
+      continue;
+    }
+    if (n < max) {
+      intervals[n].buffer = context->buffers[b];
+      intervals[n].start = (int) (p - context->buffers[b]);
+      intervals[n].length = l;
+    }
+    n ++;
+  }
+  return n;
+}
+
+static
+int __staj_parse_buffer_next_chunk(void* ctx, int* len, const char** buf) {
+  staj_buffer_source* c = (staj_buffer_source*) ctx;
+  if (c->rem > 0) {
+    *buf = c->buf + (c->len - c->rem);
+    *len = c->rem;
+    c->rem -= c->rem;
+  } else {
+    *len = 0;
+  }
+  return 0;
+}
+
+int staj_parse_buffer(const char* buffer, staj_context** _ctx) {
+  return staj_parse_buffer_len(buffer, strlen(buffer), _ctx);
+}
+
+/*
+ * staj_parse_buffer_len
+ *
+ * Create a context over length bytes at buffer. The buffer does not have
+ * to be null-terminated, the input ends after length bytes.
+ */
+int staj_parse_buffer_len(const char* buffer, int length, staj_context** _ctx) {
+  staj_context* ctx = (staj_context*) malloc(sizeof(staj_context));
+  if (ctx == NULL) {
+    errno = STAJ_ENOMEM;
+    return -1;
+  }
+  staj_init_buffer(ctx, buffer, length, NULL);
+  *_ctx = ctx;
+  return 0;
+}
+
+/*
+ * staj_parse_stream
+ *
+ * Create a context over an arbitrary source of buffers
+ *
+ * next_buffer - returns the next buffer of the input, see staj_context
+ * release_buffer - if not NULL, enables windowed mode, see staj_context
+ * source - passed to the callbacks as is
+ * max_buffers - number of buffer slots. In windowed mode this is the
+ *   initial size of the window, it grows if a single token needs more
+ */
+int staj_parse_stream(int (*next_buffer)(void*, int*, const char**),
+                      int (*release_buffer)(void*, int, const char*),
+                      void* source, int max_buffers, staj_context** _ctx) {
+  staj_context* ctx = (staj_context*) malloc(sizeof(staj_context));
+  if (ctx == NULL) {
+    errno = STAJ_ENOMEM;
+    return -1;
+  }
+  if (staj_init_stream(ctx, next_buffer, release_buffer, source, max_buffers, NULL) != 0) {
+    free(ctx);
+    return -1;
+  }
+  *_ctx = ctx;
+  return 0;
+}
+
+/*
+ * staj_parse_push
+ *
+ * Create a context that is given its input with staj_feed rather than
+ * asking a source for it, e.g. as the data arrives on a non-blocking
+ * socket. When the input fed so far runs out, staj_next and the other
+ * functions that read the input return -1 with errno set to STAJ_EAGAIN
+ * and leave the context as it was before the call; the call is repeated
+ * after the next staj_feed. A token cut by the end of the input is read
+ * again from its start then, so its first part is still taken from the
+ * buffer slots. All the state is in the context.
+ *
+ * release_buffer - if not NULL, enables windowed mode: the buffers given
+ *   to staj_feed are handed back through it once they are consumed.
+ *   Otherwise every buffer takes a slot and must stay valid while the
+ *   context is used.
+ * source - passed to release_buffer as is
+ * max_buffers - number of buffer slots, see staj_parse_stream
+ *
+ * A context in caller-owned storage is made with staj_init_stream and
+ * next_buffer NULL.
+ */
+int staj_parse_push(int (*release_buffer)(void*, int, const char*),
+                    void* source, int max_buffers, staj_context** _ctx) {
+  return staj_parse_stream(NULL, release_buffer, source, max_buffers, _ctx);
+}
+
+/*
+ * staj_feed
+ *
+ * Give the next buffer of the input to a push context. The context takes
+ * it when the input before it runs out, only one buffer may wait to be
+ * taken. length 0 ends the input.
+ *
+ * returns 0, or -1 and sets errno to STAJ_EINVAL if the context is not a
+ * push context or still has a buffer to take
+ */
+int staj_feed(staj_context* ctx, const char* buffer, int length) {
+  if (ctx->next_buffer != NULL || ctx->fed || length < 0) {
+    errno = STAJ_EINVAL;
+    return -1;
+  }
+  ctx->fed = 1;
+  ctx->fed_buffer = buffer;
+  ctx->fed_length = length;
+  return 0;
+}
+
+/*
+ * staj_init_buffer
+ *
+ * Initialize a context in caller-owned storage over length bytes at
+ * buffer. Allocates nothing.
+ *
+ * allocator - used for the allocations the context may need later
+ *   (e.g. number conversions), NULL for malloc/realloc/free
+ *
+ * The context is cleaned up with staj_deinit_context.
+ */
+int staj_init_buffer(staj_context* ctx, const char* buffer, int length,
+                     const staj_allocator* allocator) {
+  memset(ctx, 0, sizeof(staj_context));
+  ctx->allocator = allocator;
+  ctx->buffer_source.buf = buffer;
+  ctx->buffer_source.len = length;
+  ctx->buffer_source.rem = length;
+  ctx->next_buffer = &__staj_parse_buffer_next_chunk;
+  ctx->ctx = &ctx->buffer_source;
+  ctx->max_buffers = 2;
+  ctx->buffer_lengths = ctx->own_buffer_lengths;
+  ctx->buffers = ctx->own_buffers;
+  ctx->current_buffer = -1;
+  ctx->curr_context_stack_ptr = -1;
+  return 0;
+}
+
+/*
+ * staj_init_stream
+ *
+ * Initialize a context in caller-owned storage over an arbitrary source
+ * of buffers, see staj_parse_stream. Buffer slots beyond the two built
+ * into the context are obtained from the allocator (NULL for
+ * malloc/realloc/free).
+ *
+ * The context is cleaned up with staj_deinit_context.
+ */
+int staj_init_stream(staj_context* ctx,
+                     int (*next_buffer)(void*, int*, const char**),
+                     int (*release_buffer)(void*, int, const char*),
+                     void* source, int max_buffers,
+                     const staj_allocator* allocator) {
+  memset(ctx, 0, sizeof(staj_context));
+  ctx->allocator = allocator;
+  ctx->next_buffer = next_buffer;
+  ctx->release_buffer = release_buffer;
+  ctx->ctx = source;
+  if (max_buffers <= 2) {
+    ctx->max_buffers = 2;
+    ctx->buffer_lengths = ctx->own_buffer_lengths;
+    ctx->buffers = ctx->own_buffers;
+  } else {
+    ctx->max_buffers = max_buffers;
+    ctx->buffer_lengths = (int*) staj_malloc(allocator, max_buffers * sizeof(int));
+    ctx->buffers = (const char**) staj_malloc(allocator, max_buffers * sizeof(char*));
+    if (ctx->buffer_lengths == NULL || ctx->buffers == NULL) {
+      staj_free(allocator, ctx->buffer_lengths);
+      staj_free(allocator, ctx->buffers);
+      errno = STAJ_ENOMEM;
+      return -1;
+    }
+  }
+  ctx->current_buffer = -1;
+  ctx->curr_context_stack_ptr = -1;
+  return 0;
+}
+
+struct __staj_parse_fd_ctx {
+  int fd;
+  int chunk_size;
+  char** chunks;
+  int nchunks;
+  int max_chunks;
+};
+
+static
+int __staj_parse_fd_release_chunk(void* ctx, int len, const char* buf) {
+  struct __staj_parse_fd_ctx* c = (struct __staj_parse_fd_ctx*) ctx;
+  if (c->nchunks >= c->max_chunks) {
+    int n = c->max_chunks * 2;
+    char** chunks = (char**) realloc(c->chunks, n * sizeof(char*));
+    if (chunks == NULL) {
+      free((char*) buf);
+      return -1;
+    }
+    c->chunks = chunks;
+    c->max_chunks = n;
+  }
+  c->chunks[c->nchunks++] = (char*) buf;
+  return 0;
+}
+
+static
+int __staj_parse_fd_next_chunk(void* ctx, int* len, const char** buf) {
+  struct __staj_parse_fd_ctx* c = (struct __staj_parse_fd_ctx*) ctx;
+  char* chunk;
+  ssize_t n;
+  if (c->nchunks > 0) {
+    chunk = c->chunks[--c->nchunks];
+  } else {
+    void* p;
+    if (posix_memalign(&p, 4096, c->chunk_size) != 0) {
+      return STAJ_ENOMEM;
+    }
+    chunk = (char*) p;
+  }
+  /* return as soon as anything arrives, so that parsing can start before
+     the rest of the input is available */
+  do {
+    n = read(c->fd, chunk, c->chunk_size);
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0) {
+    __staj_parse_fd_release_chunk(ctx, 0, chunk);
+    *len = 0;
+    return n < 0 ? -1 : 0;
+  }
+  *buf = chunk;
+  *len = (int) n;
+  return 0;
+}
+
+static
+void __staj_parse_fd_release(void* ctx) {
+  struct __staj_parse_fd_ctx* c = (struct __staj_parse_fd_ctx*) ctx;
+  int i;
+  for (i=0; i<c->nchunks; i++) {
+    free(c->chunks[i]);
+  }
+  free(c->chunks);
+  free(c);
+}
+
+/*
+ * staj_parse_fd
+ *
+ * Create a context that reads the input from a file descriptor
+ *
+ * The input is read in chunks of chunk_size bytes (STAJ_DEFAULT_CHUNK_SIZE
+ * if chunk_size <= 0) into page-aligned buffers. The context works in
+ * windowed mode and reuses the chunks, so memory use depends on the
+ * longest token rather than on the size of the input. The file
+ * descriptor is not closed when the context is released.
+ */
+int staj_parse_fd(int fd, int chunk_size, staj_context** _ctx) {
+  struct __staj_parse_fd_ctx* __ctx = (struct __staj_parse_fd_ctx*) calloc(1, sizeof(struct __staj_parse_fd_ctx));
+  if (__ctx == NULL) {
+    errno = STAJ_ENOMEM;
+    return -1;
+  }
+  __ctx->fd = fd;
+  __ctx->chunk_size = chunk_size > 0 ? chunk_size : STAJ_DEFAULT_CHUNK_SIZE;
+  __ctx->max_chunks = 4;
+  __ctx->chunks = (char**) calloc(__ctx->max_chunks, sizeof(char*));
+  if (__ctx->chunks == NULL ||
+      staj_parse_stream(&__staj_parse_fd_next_chunk, &__staj_parse_fd_release_chunk,
+                        __ctx, 4, _ctx) != 0) {
+    free(__ctx->chunks);
+    free(__ctx);
+    errno = STAJ_ENOMEM;
+    return -1;
+  }
+  (*_ctx)->release_source = &__staj_parse_fd_release;
+  return 0;
+}
+
+/* size of the slices a mapping is handed out in when pages are released
+   behind the cursor */
+#define MMAP_SLICE_SIZE (4 << 20)
+
+struct __staj_parse_file_ctx {
+  char* map;
+  size_t size;
+  size_t offset;
+  size_t slice;
+};
+
+static
+int __staj_parse_file_next_chunk(void* ctx, int* len, const char** buf) {
+  struct __staj_parse_file_ctx* c = (struct __staj_parse_file_ctx*) ctx;
+  if (c->offset < c->size) {
+    size_t l = c->size - c->offset;
+    if (l > c->slice) {
+      l = c->slice;
+    }
+    *buf = c->map + c->offset;
+    *len = (int) l;
+    c->offset += l;
+  } else {
+    *len = 0;
+  }
+  return 0;
+}
+
+static
+int __staj_parse_file_release_chunk(void* ctx, int len, const char* buf) {
+#ifdef MADV_DONTNEED
+  /* slices start on page boundaries, the pages stay in the page cache */
+  madvise((void*) buf, len, MADV_DONTNEED);
+#endif
+  return 0;
+}
+
+static
+void __staj_parse_file_release(void* ctx) {
+  struct __staj_parse_file_ctx* c = (struct __staj_parse_file_ctx*) ctx;
+  if (c->map != NULL) {
+    munmap(c->map, c->size);
+  }
+  free(c);
+}
+
+/*
+ * staj_parse_file
+ *
+ * Create a context over a memory-mapped file
+ *
+ * The file is mapped read-only and shared, so contexts over the same file
+ * share the page cache pages and nothing is copied. Files smaller than
+ * 2 GB are presented to the tokenizer as a single buffer.
+ *
+ * flags - STAJ_MMAP_RELEASE: release the pages behind the cursor as the
+ *   parsing goes on (windowed mode) to keep the resident set small
+ *
+ * In case of error returns -1, errno is set by the failing system call
+ */
+int staj_parse_file(const char* path, int flags, staj_context** _ctx) {
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return -1;
+  }
+  struct __staj_parse_file_ctx* __ctx = (struct __staj_parse_file_ctx*) calloc(1, sizeof(struct __staj_parse_file_ctx));
+  if (__ctx == NULL) {
+    close(fd);
+    errno = STAJ_ENOMEM;
+    return -1;
+  }
+  __ctx->size = (size_t) st.st_size;
+  if (__ctx->size > 0) {
+    void* map = mmap(NULL, __ctx->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+      close(fd);
+      free(__ctx);
+      return -1;
+    }
+    __ctx->map = (char*) map;
+#ifdef MADV_SEQUENTIAL
+    madvise(map, __ctx->size, MADV_SEQUENTIAL);
+#endif
+  }
+  close(fd);
+
+  int max_buffers;
+  if (flags & STAJ_MMAP_RELEASE) {
+    __ctx->slice = MMAP_SLICE_SIZE;
+    max_buffers = 4;
+  } else {
+    /* largest multiple of the page size that fits in an int */
+    __ctx->slice = (size_t) INT_MAX & ~((size_t) sysconf(_SC_PAGESIZE) - 1);
+    max_buffers = (int) (__ctx->size / __ctx->slice) + 2;
+  }
+  if (staj_parse_stream(&__staj_parse_file_next_chunk,
+                        (flags & STAJ_MMAP_RELEASE) ? &__staj_parse_file_release_chunk : NULL,
+                        __ctx, max_buffers, _ctx) != 0) {
+    __staj_parse_file_release(__ctx);
+    return -1;
+  }
+  (*_ctx)->release_source = &__staj_parse_file_release;
+  return 0;
+}
+
+/*
+ * Hand the buffers held in windowed mode back to the source and release
+ * the source itself
+ */
+static
+void release_input(staj_context* ctx) {
+  if (ctx->release_buffer != NULL) {
+    int i;
+    for (i=0; i<=ctx->current_buffer + ctx->extra_buffers; i++) {
+      if (ctx->buffer_lengths[i] > 0) {
+        ctx->release_buffer(ctx->ctx, ctx->buffer_lengths[i], ctx->buffers[i]);
+      }
+    }
+    if (ctx->fed && ctx->fed_length > 0) {
+      ctx->release_buffer(ctx->ctx, ctx->fed_length, ctx->fed_buffer);
+    }
+  }
+  if (ctx->release_source != NULL) {
+    ctx->release_source(ctx->ctx);
+  }
+}
+
+/*
+ * staj_reset_buffer
+ *
+ * Re-target a context at length bytes at buffer, e.g. to parse the next
+ * message with the same context. Only the tokenizer state is reset, the
+ * buffer slots and the allocator are kept, so nothing is allocated.
+ * Whatever source the context had before is released. A context in
+ * indexed mode stays in it and reuses its index if it is large enough.
+ */
+int staj_reset_buffer(staj_context* ctx, const char* buffer, int length) {
+  if (ctx->next_buffer != &__staj_parse_buffer_next_chunk) {
+    release_input(ctx);
+    ctx->release_buffer = NULL;
+    ctx->release_source = NULL;
+    ctx->next_buffer = &__staj_parse_buffer_next_chunk;
+    ctx->ctx = &ctx->buffer_source;
+  }
+  ctx->buffer_source.buf = buffer;
+  ctx->buffer_source.len = length;
+  ctx->buffer_source.rem = length;
+  ctx->context = STAJ_CTX_START_DOCUMENT;
+  ctx->current_buffer = -1;
+  ctx->current_pos = 0;
+  ctx->token = STAJ_BEGIN_OBJECT;
+  ctx->start_buffer = ctx->end_buffer = 0;
+  ctx->start_pos = ctx->end_pos = 0;
+  ctx->curr_context_stack_ptr = -1;
+  ctx->_errno = 0;
+  ctx->parse_error = 0;
+  ctx->string_state = STRING_UNREAD;
+  ctx->string_pending_len = 0;
+  ctx->fed = 0;
+  ctx->extra_buffers = 0;
+  ctx->skip_depth = 0;
+  if (ctx->index != NULL && init_index(ctx) != 0) {
+    init_errno(ctx);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * staj_init_indexed
+ *
+ * Initialize a context in caller-owned storage over length bytes at
+ * buffer in indexed mode, see staj_parse_indexed
+ *
+ * allocator - used for the index, NULL for malloc/realloc/free
+ *
+ * The context is cleaned up with staj_deinit_context.
+ */
+int staj_init_indexed(staj_context* ctx, const char* buffer, int length,
+                      const staj_allocator* allocator) {
+  staj_init_buffer(ctx, buffer, length, allocator);
+  if (init_index(ctx) != 0) {
+    init_errno(ctx);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * staj_parse_indexed
+ *
+ * Create a context over length bytes at buffer in indexed mode: the
+ * positions of the tokens are found in a vectorized pass over the buffer
+ * and staj_next moves from one to the next. Tokens and errors are the
+ * same as with staj_parse_buffer_len. The buffer is indexed a window at
+ * a time, so the index takes constant memory.
+ */
+int staj_parse_indexed(const char* buffer, int length, staj_context** _ctx) {
+  staj_context* ctx = (staj_context*) malloc(sizeof(staj_context));
+  if (ctx == NULL) {
+    errno = STAJ_ENOMEM;
+    return -1;
+  }
+  if (staj_init_indexed(ctx, buffer, length, NULL) != 0) {
+    staj_deinit_context(ctx);
+    free(ctx);
+    return -1;
+  }
+  *_ctx = ctx;
+  return 0;
+}
+
+/*
+ * staj_validate
+ *
+ * Check that length bytes at buffer are one well-formed JSON document,
+ * with the same grammar and string checks as staj_next but without
+ * producing tokens. The buffer is read through the same vectorized
+ * index as staj_parse_indexed.
+ *
+ * error_pos - if not NULL, set to the offset of the token or separator
+ *             at which the document is found to be malformed
+ *
+ * The index is a small window on the stack, so nothing is allocated.
+ *
+ * Returns 0 for a valid document. Otherwise returns -1 and sets errno
+ * to STAJ_EPARSE, or STAJ_ENOMEM if the document is nested too deeply.
+ */
+int staj_validate(const char* buffer, int length, int* error_pos) {
+  int index[VALIDATE_WINDOW + INDEX_SLACK];
+  staj_context ctx;
+  int pos = 0;
+  int r;
+  staj_init_buffer(&ctx, buffer, length, NULL);
+  ctx.index = index;
+  ctx.index_cap = sizeof(index) / sizeof(index[0]);
+  start_index(&ctx);
+  r = validate_indexed(&ctx, &pos);
+  ctx.index = NULL;
+  staj_deinit_context(&ctx);
+  if (r != 0) {
+    if (error_pos != NULL) {
+      *error_pos = pos;
+    }
+    init_errno(&ctx);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * staj_set_flags
+ *
+ * Set the parsing mode flags of a context. With STAJ_MULTI_DOCUMENT the
+ * context goes on after the end of a document: staj_next returns a
+ * STAJ_END_DOCUMENT token and then the tokens of the next document, so
+ * newline-delimited or concatenated JSON is read with one context.
+ * With STAJ_LAZY_STRINGS staj_next stops at the opening quote of a
+ * string value and the value is read with staj_read_string, see there.
+ */
+int staj_set_flags(staj_context* ctx, int flags) {
+  ctx->flags = flags;
+  return 0;
+}
+
+/*
+ * staj_deinit_context
+ *
+ * Release everything a context initialized in caller-owned storage holds,
+ * but not the storage itself
+ */
+int staj_deinit_context(staj_context* ctx) {
+  release_input(ctx);
+  if (ctx->index != NULL) {
+    staj_free(ctx->allocator, ctx->index);
+  }
+  if (ctx->buffers != ctx->own_buffers) {
+    staj_free(ctx->allocator, ctx->buffer_lengths);
+    staj_free(ctx->allocator, ctx->buffers);
+  }
+  return 0;
+}
+
+int staj_release_context(staj_context* ctx) {
+  staj_deinit_context(ctx);
+  free(ctx);
+  return 0;
+}
+
+int staj_get_parse_error(staj_context* ctx) {
+  return ctx->parse_error;
+}
+
+/*
+ * staj_tostr and staj_read_string read the token straight from its parts
+ * in the input buffers, one part after another. A lazy string is read
+ * from the input at the cursor instead (input is set).
+ */
+typedef struct {
+  staj_context* ctx;
+  int input;
+  int b;
+  int pos;
+  const char* p;
+  const char* e;
+} token_reader;
+
+/*
+ * Point the reader at position pos of buffer b of the current token
+ */
+static inline
+void token_reader_seek(token_reader* r, staj_context* ctx, int b, int pos) {
+  int n;
+  r->ctx = ctx;
+  r->input = 0;
+  r->b = b;
+  n = token_segment(ctx, b, &r->p);
+  r->e = r->p + n;
+  r->p = ctx->buffers[b] + pos;
+}
+
+/*
+ * Make the reader point at a non-empty part. Returns 0 at the end of the
+ * token.
+ */
+static inline
+int token_reader_more(token_reader* r) {
+  int n;
+  while (r->p >= r->e) {
+    if (r->b >= r->ctx->end_buffer) {
+      return 0;
+    }
+    r->b ++;
+    n = token_segment(r->ctx, r->b, &r->p);
+    r->e = r->p + n;
+  }
+  return 1;
+}
 
-    
-    if (context->context == STAJ_CTX_PROPERTY_VALUE) {
-      if (skip_whitespace(context, &c) != 0) {
-        init_errno(context);
-        return -1;
-      }
-      if (c == 0x2C) { 
-        if (next_char(context, &c) != 0) {
-          init_errno(context);
-          return -1;
-        }
-        context->context = STAJ_CTX_PROPERTY_NAME;
-      } else 
-      if (c == 0x7D) {
-        context->context = STAJ_CTX_PROPERTY_NAME_OBJECT_END;
-      } else {
-        set_parse_error(context, STAJ_UNEXPECTED_SYMBOL);
-        init_errno(context);
-        return -1;
-      }
+static inline
+int token_reader_char(token_reader* r) {
+  int c;
+  if (r->input) {
+    return next_char(r->ctx, &c) != 0 ? END_OF_INPUT : c;
+  }
+  if (!token_reader_more(r)) {
+    return END_OF_INPUT;
+  }
+  return (unsigned char) *r->p++;
+}
+
+/*
+ * Remember the position of the reader in m. A lazy string keeps the
+ * buffer relative to the token start, which windowed mode may move.
+ */
+static inline
+void token_reader_mark(token_reader* r, token_reader* m) {
+  *m = *r;
+  if (r->input) {
+    m->b = r->ctx->current_buffer - r->ctx->start_buffer;
+    m->pos = r->ctx->current_pos;
+  }
+}
+
+/*
+ * Go back to the position in m. Buffers fetched since are read again
+ * from the buffer slots.
+ */
+static inline
+void token_reader_reset(token_reader* r, token_reader* m) {
+  staj_context* ctx = r->ctx;
+  int b;
+  if (!r->input) {
+    *r = *m;
+    return;
+  }
+  b = ctx->start_buffer + m->b;
+  ctx->extra_buffers += ctx->current_buffer - b;
+  ctx->current_buffer = b;
+  ctx->current_pos = m->pos;
+}
+
+/*
+ * Read the four hex digits of a \u escape. Returns the code unit or -1.
+ */
+static inline
+int token_reader_hex4(token_reader* r) {
+  int u = 0;
+  int i;
+  for (i=0; i<4; i++) {
+    int c = token_reader_char(r);
+    if (c >= '0' && c <= '9') {
+      c -= '0';
     } else
-    if (context->context == STAJ_CTX_ARRAY_ITEM ||
-        context->context == STAJ_CTX_ARRAY_ITEM_ARRAY_END) {
-      if (skip_whitespace(context, &c) != 0) {
-        init_errno(context);
-        return -1;
-      }
-      if (c == 0x2C) { 
-        if (next_char(context, &c) != 0) {
-          init_errno(context);
-          return -1;
-        }
-        context->context = STAJ_CTX_ARRAY_ITEM;
-      } else 
-      if (c == 0x5D) {
-        context->context = STAJ_CTX_ARRAY_ITEM_ARRAY_END;
-      } else {
-        set_parse_error(context, STAJ_UNEXPECTED_SYMBOL);
-        init_errno(context);
-        return -1;
-      }
+    if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+      c = (c | 0x20) - 'a' + 10;
     } else {
-      set_parse_error(context, STAJ_UNEXPECTED_SYMBOL);
-      init_errno(context);
       return -1;
     }
+    u = u << 4 | c;
+  }
+  return u;
+}
 
-  } return 0;
-  case '-': {
-    if (context->context == STAJ_CTX_ARRAY_ITEM ||
-        context->context == STAJ_CTX_ARRAY_ITEM_ARRAY_END ||
-        context->context == STAJ_CTX_PROPERTY_VALUE) {
-    } else {
-      set_parse_error(context, STAJ_UNEXPECTED_SYMBOL);
-      init_errno(context);
-      return -1;
-    }
-    context->token = STAJ_NUMBER;
-    context->start_buffer = context->current_buffer;
-    context->start_pos = context->current_pos;
-    if (next_char(context, &c) != 0) {
-      init_errno(context);
-      return -1;
+/*
+ * Copy the characters at p up to the first quote or backslash, or up to
+ * e, to dst which has room for n of them. Whole blocks are stored before
+ * they are searched, the bytes after the quote or backslash are
+ * overwritten later. Returns the number of characters copied.
+ */
+static inline
+int copy_string_run(char* dst, int n, const char* p, const char* e) {
+  const char* s = p;
+  if (e - p > n) {
+    e = p + n;
+  }
+#if defined(__AVX2__)
+  const __m256i quote32 = _mm256_set1_epi8(0x22);
+  const __m256i bs32 = _mm256_set1_epi8(0x5C);
+  while (e - p >= 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i*) p);
+    unsigned int m;
+    _mm256_storeu_si256((__m256i*) (dst + (p - s)), v);
+    m = (unsigned int) _mm256_movemask_epi8(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, quote32), _mm256_cmpeq_epi8(v, bs32)));
+    if (m != 0) {
+      return (int) (p - s) + ctz(m);
     }
-    if (c >= '0' && c <= '9') {
-      in_number = 1;
-    } else {
-      set_parse_error(context, STAJ_UNEXPECTED_SYMBOL);
-      init_errno(context);
-      return -1;
+    p += 32;
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i quote = _mm_set1_epi8(0x22);
+  const __m128i bs = _mm_set1_epi8(0x5C);
+  while (e - p >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*) p);
+    unsigned int m;
+    _mm_storeu_si128((__m128i*) (dst + (p - s)), v);
+    m = (unsigned int) _mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bs)));
+    if (m != 0) {
+      return (int) (p - s) + ctz(m);
     }
-    // no break
+    p += 16;
   }
-  case '0': {
-    if (!in_number) {
-      if (context->context == STAJ_CTX_ARRAY_ITEM ||
-          context->context == STAJ_CTX_ARRAY_ITEM_ARRAY_END ||
-          context->context == STAJ_CTX_PROPERTY_VALUE) {
-      } else {
-        set_parse_error(context, STAJ_UNEXPECTED_SYMBOL);
-        init_errno(context);
-        return -1;
-      }
-      context->token = STAJ_NUMBER;
-      context->start_buffer = context->current_buffer;
-      context->start_pos = context->current_pos;
-      in_number = 1;
+#endif
+  while (p < e && *p != 0x22 && *p != 0x5C) {
+    dst[p - s] = *p;
+    p ++;
+  }
+  return (int) (p - s);
+}
+
+/*
+ * Decode the escape after a backslash into out. Returns the number of
+ * bytes or -1 for a malformed escape.
+ */
+static inline
+int decode_escape(token_reader* r, char* out) {
+  int c = token_reader_char(r);
+  int u;
+  switch (c) {
+  case 0x22:
+  case 0x5C:
+  case 0x2F:
+    out[0] = (char) c;
+    return 1;
+  case 0x62:
+    out[0] = 0x08;
+    return 1;
+  case 0x66:
+    out[0] = 0x0C;
+    return 1;
+  case 0x6E:
+    out[0] = 0x0A;
+    return 1;
+  case 0x72:
+    out[0] = 0x0D;
+    return 1;
+  case 0x74:
+    out[0] = 0x09;
+    return 1;
+  case 0x75:
+    break;
+  default:
+    return -1;
+  }
+  if ((u = token_reader_hex4(r)) < 0) {
+    return -1;
+  }
+  if (u < 0x80) {
+    out[0] = (char) u;
+    return 1;
+  }
+  if (u < 0x800) {
+    out[0] = (char) (0xC0 | (u >> 6));
+    out[1] = (char) (0x80 | (u & 0x3F));
+    return 2;
+  }
+  /* a high surrogate followed by an escaped low one is one character */
+  if (u >= 0xD800 && u < 0xDC00) {
+    token_reader m;
+    int lo;
+    token_reader_mark(r, &m);
+    if (token_reader_char(r) == 0x5C && token_reader_char(r) == 0x75 &&
+        (lo = token_reader_hex4(r)) >= 0xDC00 && lo <= 0xDFFF) {
+      u = 0x10000 + ((u - 0xD800) << 10) + (lo - 0xDC00);
+      out[0] = (char) (0xF0 | (u >> 18));
+      out[1] = (char) (0x80 | ((u >> 12) & 0x3F));
+      out[2] = (char) (0x80 | ((u >> 6) & 0x3F));
+      out[3] = (char) (0x80 | (u & 0x3F));
+      return 4;
     }
-    if (c == '0') {
-      context->end_buffer = context->current_buffer;
-      context->end_pos = context->current_pos;
-      zero = 1;
-      if (next_char(context, &c) != 0) {
-        init_errno(context);
-        return -1;
-      }
+    if (r->input && r->ctx->_errno != 0) {
+      return -1;
     }
-    // no break
-  }
-  case '1':
-  case '2':
-  case '3':
-  case '4':
-  case '5':
-  case '6':
-  case '7':
-  case '8':
-  case '9': {
-    if (!in_number) {
-      if (context->context == STAJ_CTX_ARRAY_ITEM ||
-          context->context == STAJ_CTX_ARRAY_ITEM_ARRAY_END ||
-          context->context == STAJ_CTX_PROPERTY_VALUE) {
-      } else {
-        set_parse_error(context, STAJ_UNEXPECTED_SYMBOL);
-        init_errno(context);
-        return -1;
-      }
-      context->token = STAJ_NUMBER;
-      context->start_buffer = context->current_buffer;
-      context->start_pos = context->current_pos;
-      in_number = 1;
+    token_reader_reset(r, &m);
+  }
+  /* other code units, also a lone half of a pair, take 3 bytes */
+  out[0] = (char) (0xE0 | (u >> 12));
+  out[1] = (char) (0x80 | ((u >> 6) & 0x3F));
+  out[2] = (char) (0x80 | (u & 0x3F));
+  return 3;
+}
+
+/*
+ * Decode the token from the reader into buf, up to max bytes. The bytes
+ * of a character that does not fit go to the pending bytes of the
+ * context if spill is set, otherwise the result ends before it. Returns
+ * the number of bytes stored or -1 for a malformed escape.
+ */
+static
+int decode_token(token_reader* tr, char* buf, int max, int spill) {
+  staj_context* ctx = tr->ctx;
+  char out[4];
+  int r = 0;
+  int n;
+  while (r < max && token_reader_more(tr)) {
+    n = copy_string_run(buf + r, max - r, tr->p, tr->e);
+    r += n;
+    tr->p += n;
+    if (tr->p == tr->e || r == max) {
+      continue;
     }
-    context->end_buffer = context->current_buffer;
-    context->end_pos = context->current_pos;
-    int r;
-    while ((r = next_char(context, &c)) == 0) {
-      if (c >= '0' && c <= '9') {
-        if (zero) {
-          set_parse_error(context, STAJ_INVALID_NUMBER_FORMAT);
-          init_errno(context);
-          return -1;
-        } else {
-          context->end_buffer = context->current_buffer;
-          context->end_pos = context->current_pos;
-        }
-      } else {
-        break;
-      }
+    if (*tr->p++ == 0x22) {
+      /* the quotes around the string */
+      continue;
     }
-    if (r != 0) {
-      init_errno(context);
+    if ((n = decode_escape(tr, out)) < 0) {
       return -1;
     }
-    if (c == 0x2E) {
-      while ((r = next_char(context, &c)) == 0) {
-        if (c >= '0' && c <= '9') {
-          context->end_buffer = context->current_buffer;
-          context->end_pos = context->current_pos;
-        } else {
-          break;
-        }
-      }
-      if (r != 0) {
-        init_errno(context);
-        return -1;
-      }
-    }
-    if (c == 0x65 || c == 0x45) {
-      if (next_char(context, &c) != 0) {
-        init_errno(context);
-        return -1;
-      }
-      if (c == 0x2D || c == 0x2B) {
-        if (next_char(context, &c) != 0) {
-          init_errno(context);
-          return -1;
-        }
-      }
-      if (c >= '0' && c <= '9') {
-        while ((r = next_char(context, &c)) == 0) {
-          if (c >= '0' && c <= '9') {
-            context->end_buffer = context->current_buffer;
-            context->end_pos = context->current_pos;
-          } else {
-            break;
-          }
-        }
-        if (r != 0) {
-          init_errno(context);
-          return -1;
-        }
-      } else {
-        set_parse_error(context, STAJ_INVALID_NUMBER_FORMAT);
-        init_errno(context);
-        return -1;
-      }
-    }
-
-    if (context->context == STAJ_CTX_PROPERTY_VALUE) {
-      if (skip_whitespace(context, &c) != 0) {
-        init_errno(context);
-        return -1;
-      }
-      if (c == 0x2C) { 
-        if (next_char(context, &c) != 0) {
-          init_errno(context);
-          return -1;
-        }
-        context->context = STAJ_CTX_PROPERTY_NAME;
-      } else 
-      if (c == 0x7D) {
-        context->context = STAJ_CTX_PROPERTY_NAME_OBJECT_END;
-      } else {
-        set_parse_error(context, STAJ_UNEXPECTED_SYMBOL);
-        init_errno(context);
-        return -1;
-      }
-    } else
-    if (context->context == STAJ_CTX_ARRAY_ITEM ||
-        context->context == STAJ_CTX_ARRAY_ITEM_ARRAY_END) {
-      if (skip_whitespace(context, &c) != 0) {
-        init_errno(context);
-        return -1;
-      }
-      if (c == 0x2C) { 
-        if (next_char(context, &c) != 0) {
-          init_errno(context);
-          return -1;
-        }
-        context->context = STAJ_CTX_ARRAY_ITEM;
-      } else 
-      if (c == 0x5D) {
-        context->context = STAJ_CTX_ARRAY_ITEM_ARRAY_END;
-      } else {
-        set_parse_error(context, STAJ_UNEXPECTED_SYMBOL);
-        init_errno(context);
-        return -1;
+    if (r + n > max) {
+      if (spill) {
+        memcpy(buf + r, out, max - r);
+        ctx->string_pending_len = n - (max - r);
+        memcpy(ctx->string_pending, out + (max - r), ctx->string_pending_len);
+        r = max;
       }
-    } else {
-      set_parse_error(context, STAJ_UNEXPECTED_SYMBOL);
-      init_errno(context);
-      return -1;
+      break;
     }
-
-    } return 0;
-  default: {
-    set_parse_error(context, STAJ_UNEXPECTED_SYMBOL);
-    init_errno(context);
-  } return -1;
+    memcpy(buf + r, out, n);
+    r += n;
   }
+  return r;
 }
+
 /*
- * staj_get_token
+ * staj_tostr
  *
- * Get current token
+ * Decode the string or property name token into buf in one pass over
+ * the token in the input buffers: runs without escapes are copied a
+ * vector at a time and escapes are decoded as they come. A surrogate
+ * pair becomes one 4-byte sequence, a lone half of a pair the 3 bytes
+ * of the code unit.
  *
- * context - StAJ context
+ * Stores at most max bytes; a string that does not fit is cut before the
+ * first character that does not. The result is terminated with 0 if
+ * there is room for it.
  *
- * returns token type
- * in case of error return -1 and sets errno to:
- * STAJ_ENOTOKEN - need to call next() at least once
- * STAJ_ENOMEM - not enough memory allocated during initialization
- * STAJ_EPARSE - parse error
+ * returns the length of the result, or -1 with errno set to STAJ_EINVAL
+ * for a malformed escape. The context is not affected.
  */
-int staj_get_token(staj_context* context) {
-  return context->token;
-}
-
-int staj_get_length(staj_context* context) {
+int staj_tostr(staj_context* ctx, char* buf, int max) {
+  token_reader tr;
+  int r;
   int i;
-  int l;
-  if (context->start_buffer == context->end_buffer) {
-    l = context->end_pos - context->start_pos + 1;
-  } else {
-    l = context->buffer_lengths[context->start_buffer] - context->start_pos;  
-    for (i=context->start_buffer+1; i<context->end_buffer; i++) {
-      l += context->buffer_lengths[i];
-    }
-    l += context->end_pos + 1;
-  }
-  return l;
-}
-
-static inline
-int min(int a, int b) {
-  return (a < b ? a : b);
-}
-
-int staj_get_text(staj_context* context, char* buffer, int max) {
-  int l;
-  if (context->start_buffer == context->end_buffer) {
-    l = context->end_pos - context->start_pos + 1;
-    strncpy(buffer, context->buffers[context->start_buffer] + context->start_pos, min(l, max));
-  } else {
-    l = 0;
-    int t = context->buffer_lengths[context->start_buffer] - context->start_pos;
-    strncpy(buffer+l, 
-            context->buffers[context->start_buffer]+context->start_pos, 
-            min(max-l, t));
-    l += t;
-    int i;
-    for (i=context->start_buffer+1; i<context->end_buffer; i++) {
-      t = context->buffer_lengths[i];
-      strncpy(buffer+l,
-              context->buffers[i],
-              min(max-l, t));
-      l += t;
+  int lo, hi;
+  token_reader_seek(&tr, ctx, ctx->start_buffer, ctx->start_pos);
+  if ((r = decode_token(&tr, buf, max, 0)) < 0) {
+    errno = STAJ_EINVAL;
+    return -1;
+  }
+  if (r == max && r > 0) {
+    /* runs are copied by bytes: end before a sequence cut at max */
+    for (i=r-1; i>0 && i>r-4 && (buf[i] & 0xC0) == 0x80; i--) {
+    }
+    if (i + utf8_lead((unsigned char) buf[i], &lo, &hi) + 1 > r) {
+      r = i;
     }
-    t = context->end_pos + 1;
-    strncpy(buffer+l,
-            context->buffers[context->end_buffer],
-            min(max-l, t));
-    l += t;
   }
 
-  if (l < max) {
-    buffer[l] = 0;
+  if (r < max) {
+    buf[r] = 0;
   }
 
-  return l;
+  return r;
 }
 
-struct __staj_parse_buffer_ctx {
-  char* buf;
-  int len;
-  int rem;
-};
-
+/*
+ * staj_read_string in lazy mode: decode the character at the cursor into
+ * out with the same checks as read_string. Returns the number of bytes,
+ * 0 for the closing quote or -1.
+ */
 static
-int __staj_parse_buffer_next_chunk(void* ctx, int* len, char** buf) {
-  struct __staj_parse_buffer_ctx* c = (struct __staj_parse_buffer_ctx*) ctx;
-  if (c->rem > 0) {
-    *buf = c->buf + (c->len - c->rem);
-    *len = c->rem;
-    c->rem -= c->rem;
-  } else {
-    *len = 0;
+int read_input_char(staj_context* ctx, char* out) {
+  token_reader tr = { ctx, 1 };
+  int n;
+  int c;
+  int lo, hi;
+  int i;
+  if (next_char(ctx, &c) != 0) {
+    return -1;
   }
-  return 0;
-}
-
-int staj_parse_buffer(char* buffer, staj_context** _ctx) {
-  int l = strlen(buffer);
-  staj_context* ctx = (staj_context*) calloc(1, sizeof(staj_context));
-  ctx->next_buffer = &__staj_parse_buffer_next_chunk;
-  struct __staj_parse_buffer_ctx* __ctx = (struct __staj_parse_buffer_ctx*) calloc(1, sizeof(struct __staj_parse_buffer_ctx));
-  ctx->ctx = __ctx;
-  __ctx->buf = buffer;
-  __ctx->len = l;
-  __ctx->rem = l;
-  ctx->max_buffers = 2;
-  ctx->buffer_lengths = (int*) calloc(ctx->max_buffers, sizeof(int));
-  ctx->buffers = (char**) calloc(ctx->max_buffers, sizeof(char*));
-  ctx->current_buffer = -1;
-  ctx->curr_context_stack_ptr = -1;
-  *_ctx = ctx;
-  return 0;
-}
-
-int staj_release_context(staj_context* ctx) {
-  free(ctx->buffer_lengths);
-  free(ctx->buffers);
-  free(ctx->ctx);
-  free(ctx);
-  return 0;
-}
-
-int staj_get_parse_error(staj_context* ctx) {
-  return ctx->parse_error;
+  if (c == 0x22) {
+    return 0;
+  }
+  if (c == 0x5C) {
+    if ((n = decode_escape(&tr, out)) < 0) {
+      if (ctx->_errno == 0) {
+        set_parse_error(ctx, STAJ_INVALID_ESCAPE_SEQUENCE);
+      }
+      return -1;
+    }
+    return n;
+  }
+  if (is_plain_string_char(c)) {
+    out[0] = (char) c;
+    return 1;
+  }
+  if (c >= 0x80 && (n = utf8_lead(c, &lo, &hi)) > 0) {
+    /* a sequence cut by the end of a buffer or by the end of buf */
+    out[0] = (char) c;
+    for (i=1; i<=n; i++) {
+      if (next_char(ctx, &c) != 0) {
+        return -1;
+      }
+      if (c < lo || c > hi) {
+        set_parse_error(ctx, STAJ_INVALID_UTF8_SEQUENCE);
+        return -1;
+      }
+      out[i] = (char) c;
+      lo = 0x80;
+      hi = 0xBF;
+    }
+    return n + 1;
+  }
+  set_parse_error(ctx, c == END_OF_INPUT ? STAJ_UNEXPECTED_EOF : STAJ_INVALID_UTF8_SEQUENCE);
+  return -1;
 }
 
-int staj_tostr(staj_context* ctx, char* buf, int max) {
-  int l = staj_get_text(ctx, buf, max);
-  int i = 0;
+/*
+ * staj_read_string in lazy mode: decode the string at the cursor into
+ * buf until buf is full or the closing quote is read, and then the
+ * separator after it
+ */
+static
+int read_input_piece(staj_context* ctx, char* buf, int max) {
+  char out[4];
+  const char *p, *e, *q;
   int r = 0;
-  while (i<l && buf[i] != 0) {
-    char c = buf[i++];
-    if (c == 0x22) {
-    } else
-    if (c == 0x5C) {
-      if (i >= l) {
-        ctx->_errno = STAJ_INVALID_ESCAPE_SEQUENCE;
-        init_errno(ctx);
-        return -1;
+  int n;
+  int c;
+  while (r < max) {
+    get_range(ctx, &p, &e);
+    if (p != NULL) {
+      q = scan_string_chars(p, e - p > max - r ? p + (max - r) : e);
+      memcpy(buf + r, p, q - p);
+      r += (int) (q - p);
+      set_cursor(ctx, q);
+      if (r == max) {
+        break;
       }
-      c = buf[i++];
-      if (c == 0x22 || c == 0x5C || c == 0x2F) {
-        buf[r++] = c;
-      } else
-      if (c == 0x62) {
-        buf[r++] = 0x08;
-      } else
-      if (c == 0x66) {
-        buf[r++] = 0x0C;
-      } else
-      if (c == 0x6E) {
-        buf[r++] = 0x0A;
-      } else
-      if (c == 0x72) {
-        buf[r++] = 0x0D;
-      } else
-      if (c == 0x74) {
-        buf[r++] = 0x09;
-      } else
-      if (c == 0x75) {
-        char xbuf[5];
-        if (l - i < 4) {
-          ctx->_errno = STAJ_INVALID_ESCAPE_SEQUENCE;
-          init_errno(ctx);
-          return -1;
-        } else {
-          xbuf[0] = buf[i++];
-          xbuf[1] = buf[i++];
-          xbuf[2] = buf[i++];
-          xbuf[3] = buf[i++];
-          xbuf[4] = 0;
-          char* eptr;
-          long int n = strtol(xbuf, &eptr, 16);
-          if (*eptr != 0) {
-            ctx->_errno = STAJ_INVALID_ESCAPE_SEQUENCE;
-            init_errno(ctx);
-            return -1;
-          }
-          if (n >= 0 && n <= 0x7F) {
-            buf[r++] = (char) n;
-          } else
-          if (n >= 0x80 && n <= 0x07FF) {
-            buf[r++] = (char) (0xC0 | (n >> 6));
-            buf[r++] = (char) (0x80 | (n & 0x3F));
-          } else
-          if (n >= 0x0800 && n <= 0xFFFF) {
-            buf[r++] = (char) (0xE0 | (n >> 12));
-            buf[r++] = (char) (0x80 | ((n >> 6) & 0x3F));
-            buf[r++] = (char) (0x80 | (n & 0x3F));
-          } else {
-            ctx->_errno = STAJ_INVALID_ESCAPE_SEQUENCE;
-            init_errno(ctx);
-            return -1;
-          }
+    }
+    /* nothing before the cursor is needed any more, windowed mode may
+       hand it back */
+    ctx->start_buffer = ctx->end_buffer = ctx->current_buffer;
+    ctx->start_pos = ctx->end_pos = ctx->current_pos;
+    if ((n = read_input_char(ctx, out)) == 0) {
+      if (next_char(ctx, &c) == 0 &&
+          read_separator(ctx, value_separators[ctx->context]) == 0) {
+        ctx->string_state = STRING_DONE;
+        break;
+      }
+      n = -1;
+    }
+    if (n < 0) {
+      if (ctx->_errno == STAJ_EAGAIN) {
+        /* push mode: the character is read again when more input is
+           fed */
+        ctx->extra_buffers += ctx->current_buffer - ctx->start_buffer;
+        ctx->current_buffer = ctx->start_buffer;
+        ctx->current_pos = ctx->start_pos;
+        if (r > 0) {
+          ctx->_errno = 0;
+          return r;
         }
-      } else {
-        ctx->_errno = STAJ_INVALID_ESCAPE_SEQUENCE;
-        init_errno(ctx);
-        return -1;
       }
-    } else {
-      // it is safe since every byte in non-ASCII UTF-8 has higher bit set
-      buf[r++] = c;
+      return -1;
+    }
+    if (r + n > max) {
+      memcpy(buf + r, out, max - r);
+      ctx->string_pending_len = n - (max - r);
+      memcpy(ctx->string_pending, out + (max - r), ctx->string_pending_len);
+      r = max;
+      break;
     }
+    memcpy(buf + r, out, n);
+    r += n;
   }
+  return r;
+}
 
-  if (r < max) {
-    buf[r] = 0;
+/*
+ * staj_read_string
+ *
+ * Decode the next piece of the current string or property name token
+ * into buf, so that a value of any size is read with a buffer of a fixed
+ * size. The pieces are what staj_tostr stores, cut at any byte (also in
+ * the middle of a UTF-8 sequence) and not terminated with 0.
+ *
+ * In STAJ_LAZY_STRINGS mode (staj_set_flags) a string value is read
+ * from the input as the pieces are asked for and checked on the way, so
+ * in windowed mode the buffers it spans are handed back one after
+ * another and the value never has to fit in the buffer slots. If the
+ * caller moves on before the end of the value, staj_next reads the rest.
+ * Until then the token is only the opening quote. Indexed contexts have
+ * the whole input at hand and ignore the flag. In push mode a piece ends
+ * where the input fed so far does, and if there is nothing to return
+ * the result is -1 with STAJ_EAGAIN.
+ *
+ * returns the number of bytes stored, 0 after the end of the value,
+ * or -1 and sets errno: STAJ_EINVAL for another token or max <= 0,
+ * STAJ_EPARSE for a malformed lazy string
+ */
+int staj_read_string(staj_context* ctx, char* buf, int max) {
+  token_reader tr;
+  int r;
+  int n;
+  if (ctx->_errno != 0) {
+    init_errno(ctx);
+    return -1;
   }
+  if ((ctx->token != STAJ_STRING && ctx->token != STAJ_PROPERTY_NAME) || max <= 0) {
+    errno = STAJ_EINVAL;
+    return -1;
+  }
+  if (ctx->string_state == STRING_UNREAD) {
+    ctx->string_state = STRING_SPAN;
+    ctx->string_buffer = ctx->start_buffer;
+    ctx->string_pos = ctx->start_pos;
+  }
+
+  /* what did not fit last time */
+  r = min(ctx->string_pending_len, max);
+  memcpy(buf, ctx->string_pending, r);
+  ctx->string_pending_len -= r;
+  memmove(ctx->string_pending, ctx->string_pending + r, ctx->string_pending_len);
 
+  if (ctx->string_state == STRING_SPAN) {
+    token_reader_seek(&tr, ctx, ctx->string_buffer, ctx->string_pos);
+    if ((n = decode_token(&tr, buf + r, max - r, 1)) < 0) {
+      errno = STAJ_EINVAL;
+      return -1;
+    }
+    ctx->string_buffer = tr.b;
+    ctx->string_pos = (int) (tr.p - ctx->buffers[tr.b]);
+    r += n;
+  } else
+  if (ctx->string_state == STRING_INPUT) {
+    if ((n = read_input_piece(ctx, buf + r, max - r)) < 0) {
+      init_errno(ctx);
+      if (!would_block(ctx) || r == 0) {
+        return -1;
+      }
+      n = 0;
+    }
+    r += n;
+  }
   return r;
 }
 
@@ -1099,107 +3582,503 @@ int staj_toi(staj_context* ctx, int* v) {
 }
 
 int staj_tol(staj_context* ctx, long int* v) {
-  int l = staj_get_length(ctx);
-  char* buf = (char*) calloc(l+1, sizeof(char));
-  int r = staj_get_text(ctx, buf, l+1);
-  if (r < 0) {
-    free(buf);
+  long long int ll;
+  if (staj_toll(ctx, &ll) != 0) {
     return -1;
   }
-  if (r == 0) {
+  if (ll > LONG_MAX || ll < LONG_MIN) {
     ctx->_errno = STAJ_EINVAL;
     init_errno(ctx);
-    free(buf);
     return -1;
   }
-  char* eptr;
-  *v = strtol(buf, &eptr, 10);
-  if (*eptr != 0) {
+  *v = (long int) ll;
+  return 0;
+}
+
+/*
+ * The digits are accumulated straight from the token in the input
+ * buffers, no copy is made. Values that do not fit into long long int
+ * and tokens that are not integers result in STAJ_EINVAL.
+ */
+int staj_toll(staj_context* ctx, long long int* v) {
+  unsigned long long int n = 0;
+  unsigned long long int limit = LLONG_MAX;
+  int neg = 0;
+  int digits = 0;
+  int b;
+  for (b=ctx->start_buffer; b<=ctx->end_buffer; b++) {
+    const char* p;
+    int l = token_segment(ctx, b, &p);
+    const char* e = p + l;
+    if (l > 0 && digits == 0 && !neg && *p == '-') {
+      neg = 1;
+      limit = (unsigned long long int) LLONG_MAX + 1;
+      p ++;
+    }
+    for (; p<e; p++) {
+      unsigned int d = (unsigned int) (*p - '0');
+      if (d > 9 || n > (limit - d) / 10) {
+        ctx->_errno = STAJ_EINVAL;
+        init_errno(ctx);
+        return -1;
+      }
+      n = n * 10 + d;
+      digits ++;
+    }
+  }
+  if (digits == 0) {
     ctx->_errno = STAJ_EINVAL;
     init_errno(ctx);
-    free(buf);
     return -1;
   }
-  free(buf);
+  /* -(n-1)-1 does not overflow for n = LLONG_MAX+1 */
+  *v = neg ? (n == 0 ? 0 : -(long long int) (n - 1) - 1) : (long long int) n;
   return 0;
 }
 
-int staj_tof(staj_context* ctx, float* v) {
-  int l = staj_get_length(ctx);
-  char* buf = (char*) calloc(l+1, sizeof(char));
-  int r = staj_get_text(ctx, buf, l+1);
-  if (r < 0) {
-    free(buf);
+/*
+ * Floating point conversions
+ *
+ * The token is parsed into a decimal mantissa of at most 19 significant
+ * digits and a power of ten, then converted to the nearest binary value
+ * with the Eisel-Lemire algorithm (as in fast_float): the mantissa is
+ * multiplied by a 128-bit approximation of the power of five and the
+ * product is rounded to the target precision. Small values take the exact
+ * Clinger fast path. Only tokens with more than 19 significant digits whose
+ * rounding the truncated mantissa cannot decide go to strtod.
+ */
+
+typedef struct {
+  uint64_t mantissa;
+  int64_t exponent;
+  int negative;
+  int truncated; /* more than 19 significant digits */
+} decimal_number;
+
+typedef struct {
+  int mantissa_bits;
+  int minimum_exponent;
+  int infinite_power;
+  int smallest_power_of_ten;
+  int largest_power_of_ten;
+  int min_exponent_round_to_even;
+  int max_exponent_round_to_even;
+} binary_format;
+
+static const binary_format binary64 = { 52, -1023, 0x7FF, -342, 308, -4, 23 };
+static const binary_format binary32 = { 23, -127, 0xFF, -64, 38, -17, 10 };
+
+static inline
+int clz64(uint64_t v) {
+#if defined(__GNUC__)
+  return __builtin_clzll(v);
+#else
+  int n = 0;
+  while ((v & 0x8000000000000000ULL) == 0) {
+    v <<= 1;
+    n ++;
+  }
+  return n;
+#endif
+}
+
+static inline
+void mul_128(uint64_t a, uint64_t b, uint64_t* hi, uint64_t* lo) {
+#if defined(__SIZEOF_INT128__)
+  unsigned __int128 r = (unsigned __int128) a * b;
+  *hi = (uint64_t) (r >> 64);
+  *lo = (uint64_t) r;
+#else
+  uint64_t a_lo = (uint32_t) a, a_hi = a >> 32;
+  uint64_t b_lo = (uint32_t) b, b_hi = b >> 32;
+  uint64_t p0 = a_lo * b_lo;
+  uint64_t p1 = a_lo * b_hi;
+  uint64_t p2 = a_hi * b_lo;
+  uint64_t p3 = a_hi * b_hi;
+  uint64_t mid = (p0 >> 32) + (uint32_t) p1 + (uint32_t) p2;
+  *lo = (mid << 32) | (uint32_t) p0;
+  *hi = p3 + (p1 >> 32) + (p2 >> 32) + (mid >> 32);
+#endif
+}
+
+/*
+ * Parse a JSON number in [p, e). Returns -1 if it is not one.
+ */
+static
+int parse_decimal(const char* p, const char* e, decimal_number* d) {
+  const uint64_t min_19_digits = 1000000000000000000ULL;
+  const char *int_start, *int_end, *frac_start = NULL, *frac_end = NULL;
+  int64_t exp_number = 0;
+  int64_t digits;
+  uint64_t i = 0;
+
+  d->negative = (p < e && *p == '-');
+  if (d->negative) {
+    p ++;
+  }
+  int_start = p;
+  while (p < e && is_digit((unsigned char) *p)) {
+    i = i * 10 + (uint64_t) (*p - '0');
+    p ++;
+  }
+  int_end = p;
+  if (int_end == int_start) {
     return -1;
   }
-  if (r == 0) {
-    ctx->_errno = STAJ_EINVAL;
+  digits = int_end - int_start;
+  d->exponent = 0;
+  if (p < e && *p == '.') {
+    p ++;
+    frac_start = p;
+    while (p < e && is_digit((unsigned char) *p)) {
+      i = i * 10 + (uint64_t) (*p - '0');
+      p ++;
+    }
+    frac_end = p;
+    if (frac_end == frac_start) {
+      return -1;
+    }
+    d->exponent = frac_start - frac_end;
+    digits += frac_end - frac_start;
+  }
+  if (p < e && (*p == 'e' || *p == 'E')) {
+    int neg_exp = 0;
+    p ++;
+    if (p < e && (*p == '-' || *p == '+')) {
+      neg_exp = (*p == '-');
+      p ++;
+    }
+    if (p == e || !is_digit((unsigned char) *p)) {
+      return -1;
+    }
+    while (p < e && is_digit((unsigned char) *p)) {
+      if (exp_number < 0x10000000) {
+        exp_number = exp_number * 10 + (*p - '0');
+      }
+      p ++;
+    }
+    if (neg_exp) {
+      exp_number = -exp_number;
+    }
+    d->exponent += exp_number;
+  }
+  if (p != e) {
+    return -1;
+  }
+
+  d->truncated = 0;
+  if (digits > 19) {
+    /* leading zeros are not significant */
+    const char* s = int_start;
+    while (s < e && (*s == '0' || *s == '.')) {
+      if (*s == '0') {
+        digits --;
+      }
+      s ++;
+    }
+    if (digits > 19) {
+      d->truncated = 1;
+      i = 0;
+      p = int_start;
+      while (i < min_19_digits && p != int_end) {
+        i = i * 10 + (uint64_t) (*p - '0');
+        p ++;
+      }
+      if (i >= min_19_digits) {
+        d->exponent = (int_end - p) + exp_number;
+      } else {
+        p = frac_start;
+        while (i < min_19_digits && p != frac_end) {
+          i = i * 10 + (uint64_t) (*p - '0');
+          p ++;
+        }
+        d->exponent = (frac_start - p) + exp_number;
+      }
+    }
+  }
+  d->mantissa = i;
+  return 0;
+}
+
+/*
+ * Eisel-Lemire: w * 10^q rounded to the nearest value of the format.
+ * Stores the biased binary exponent and the explicit mantissa bits.
+ */
+static
+void compute_float(const binary_format* f, int64_t q, uint64_t w,
+                   int* power2, uint64_t* mantissa) {
+  uint64_t hi, lo;
+  if (w == 0 || q < f->smallest_power_of_ten) {
+    *power2 = 0;
+    *mantissa = 0;
+    return;
+  }
+  if (q > f->largest_power_of_ten) {
+    *power2 = f->infinite_power;
+    *mantissa = 0;
+    return;
+  }
+  int lz = clz64(w);
+  w <<= lz;
+
+  const unsigned long long int* pow5 = pow5_128[q - POW5_MIN];
+  mul_128(w, pow5[0], &hi, &lo);
+  uint64_t precision_mask = 0xFFFFFFFFFFFFFFFFULL >> (f->mantissa_bits + 3);
+  if ((hi & precision_mask) == precision_mask) {
+    /* the lower part of the power may carry into the bits we keep */
+    uint64_t hi2, lo2;
+    mul_128(w, pow5[1], &hi2, &lo2);
+    lo += hi2;
+    if (hi2 > lo) {
+      hi ++;
+    }
+  }
+
+  int upperbit = (int) (hi >> 63);
+  int shift = upperbit + 64 - f->mantissa_bits - 3;
+  uint64_t m = hi >> shift;
+  /* floor(q * log2(10)) + 63 */
+  int p2 = (int) (((152170 + 65536) * q) >> 16) + 63 + upperbit - lz - f->minimum_exponent;
+  if (p2 <= 0) {
+    /* subnormal */
+    if (-p2 + 1 >= 64) {
+      *power2 = 0;
+      *mantissa = 0;
+      return;
+    }
+    m >>= -p2 + 1;
+    m += (m & 1);
+    m >>= 1;
+    *power2 = (m < ((uint64_t) 1 << f->mantissa_bits)) ? 0 : 1;
+    *mantissa = m & ~((uint64_t) 1 << f->mantissa_bits);
+    return;
+  }
+  if (lo <= 1 && q >= f->min_exponent_round_to_even &&
+      q <= f->max_exponent_round_to_even && (m & 3) == 1) {
+    /* exactly halfway between two values: round to even */
+    if ((m << shift) == hi) {
+      m &= ~(uint64_t) 1;
+    }
+  }
+  m += (m & 1);
+  m >>= 1;
+  if (m >= ((uint64_t) 2 << f->mantissa_bits)) {
+    m = (uint64_t) 1 << f->mantissa_bits;
+    p2 ++;
+  }
+  m &= ~((uint64_t) 1 << f->mantissa_bits);
+  if (p2 >= f->infinite_power) {
+    p2 = f->infinite_power;
+    m = 0;
+  }
+  *power2 = p2;
+  *mantissa = m;
+}
+
+/*
+ * Convert a decimal number to the format. Returns -1 if the result can
+ * only be decided by looking at all the digits.
+ */
+static
+int decimal_to_binary(const binary_format* f, const decimal_number* d,
+                      int* power2, uint64_t* mantissa) {
+  compute_float(f, d->exponent, d->mantissa, power2, mantissa);
+  if (d->truncated) {
+    /* the value lies between mantissa and mantissa+1 */
+    int p2;
+    uint64_t m;
+    compute_float(f, d->exponent, d->mantissa + 1, &p2, &m);
+    if (p2 != *power2 || m != *mantissa) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static const double exact_powers_of_ten[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static const float exact_powers_of_ten_f[] = {
+  1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f
+};
+
+/*
+ * Contiguous text of a number token: a pointer into the input if the
+ * token lies in one buffer, otherwise a copy in buf
+ */
+static
+int number_span(staj_context* ctx, char* buf, int size, const char** p) {
+  int l;
+  if (ctx->start_buffer == ctx->end_buffer) {
+    return token_segment(ctx, ctx->start_buffer, p);
+  }
+  l = staj_get_length(ctx);
+  if (l > size) {
+    return -1;
+  }
+  staj_get_text(ctx, buf, size);
+  *p = buf;
+  return l;
+}
+
+/*
+ * Copy the number token into a null-terminated string strtod and friends
+ * accept in the current locale. Returns buf if it is large enough,
+ * otherwise an allocated copy.
+ */
+static
+char* number_text(staj_context* ctx, char* buf, int size) {
+  const char* dp = localeconv()->decimal_point;
+  int dpl = strlen(dp);
+  int l = staj_get_length(ctx);
+  char* t = buf;
+  if (l + dpl + 1 > size) {
+    t = (char*) staj_malloc(ctx->allocator, l + dpl + 1);
+    if (t == NULL) {
+      return NULL;
+    }
+  }
+  staj_get_text(ctx, t, l);
+  t[l] = 0;
+  char* point = memchr(t, '.', l);
+  if (point != NULL && (dpl != 1 || *dp != '.')) {
+    memmove(point + dpl, point + 1, l - (point - t));
+    memcpy(point, dp, dpl);
+  }
+  return t;
+}
+
+int staj_tof(staj_context* ctx, float* v) {
+  char buf[64];
+  const char* p;
+  decimal_number d;
+  int power2;
+  uint64_t mantissa;
+  int l = number_span(ctx, buf, sizeof(buf), &p);
+  if (l >= 0) {
+    if (parse_decimal(p, p + l, &d) != 0) {
+      ctx->_errno = STAJ_EINVAL;
+      init_errno(ctx);
+      return -1;
+    }
+#if FLT_EVAL_METHOD == 0
+    if (!d.truncated && d.exponent >= -10 && d.exponent <= 10 &&
+        d.mantissa <= ((uint64_t) 1 << 24)) {
+      float f = (float) d.mantissa;
+      if (d.exponent < 0) {
+        f = f / exact_powers_of_ten_f[-d.exponent];
+      } else {
+        f = f * exact_powers_of_ten_f[d.exponent];
+      }
+      *v = d.negative ? -f : f;
+      return 0;
+    }
+#endif
+    if (decimal_to_binary(&binary32, &d, &power2, &mantissa) == 0) {
+      uint32_t bits = (uint32_t) mantissa | ((uint32_t) power2 << 23) |
+        (d.negative ? 0x80000000U : 0);
+      memcpy(v, &bits, sizeof(bits));
+      return 0;
+    }
+  }
+
+  /* more digits than the fast path can decide on */
+  char* t = number_text(ctx, buf, sizeof(buf));
+  if (t == NULL) {
+    ctx->_errno = STAJ_ENOMEM;
     init_errno(ctx);
-    free(buf);
     return -1;
   }
   char* eptr;
-  *v = strtof(buf, &eptr);
-  if (*eptr != 0) {
+  *v = strtof(t, &eptr);
+  int r = *eptr != 0;
+  if (t != buf) {
+    staj_free(ctx->allocator, t);
+  }
+  if (r) {
     ctx->_errno = STAJ_EINVAL;
     init_errno(ctx);
-    free(buf);
     return -1;
   }
-  free(buf);
   return 0;
 }
 
-
 int staj_tod(staj_context* ctx, double* v) {
-  int l = staj_get_length(ctx);
-  char* buf = (char*) calloc(l+1, sizeof(char));
-  int r = staj_get_text(ctx, buf, l+1);
-  if (r < 0) {
-    free(buf);
-    return -1;
+  char buf[64];
+  const char* p;
+  decimal_number d;
+  int power2;
+  uint64_t mantissa;
+  int l = number_span(ctx, buf, sizeof(buf), &p);
+  if (l >= 0) {
+    if (parse_decimal(p, p + l, &d) != 0) {
+      ctx->_errno = STAJ_EINVAL;
+      init_errno(ctx);
+      return -1;
+    }
+#if FLT_EVAL_METHOD == 0
+    if (!d.truncated && d.exponent >= -22 && d.exponent <= 22 &&
+        d.mantissa <= ((uint64_t) 1 << 53)) {
+      double f = (double) d.mantissa;
+      if (d.exponent < 0) {
+        f = f / exact_powers_of_ten[-d.exponent];
+      } else {
+        f = f * exact_powers_of_ten[d.exponent];
+      }
+      *v = d.negative ? -f : f;
+      return 0;
+    }
+#endif
+    if (decimal_to_binary(&binary64, &d, &power2, &mantissa) == 0) {
+      uint64_t bits = mantissa | ((uint64_t) power2 << 52) |
+        (d.negative ? 0x8000000000000000ULL : 0);
+      memcpy(v, &bits, sizeof(bits));
+      return 0;
+    }
   }
-  if (r == 0) {
-    ctx->_errno = STAJ_EINVAL;
+
+  /* more digits than the fast path can decide on */
+  char* t = number_text(ctx, buf, sizeof(buf));
+  if (t == NULL) {
+    ctx->_errno = STAJ_ENOMEM;
     init_errno(ctx);
-    free(buf);
     return -1;
   }
   char* eptr;
-  *v = strtod(buf, &eptr);
-  if (*eptr != 0) {
+  *v = strtod(t, &eptr);
+  int r = *eptr != 0;
+  if (t != buf) {
+    staj_free(ctx->allocator, t);
+  }
+  if (r) {
     ctx->_errno = STAJ_EINVAL;
     init_errno(ctx);
-    free(buf);
     return -1;
   }
-  free(buf);
   return 0;
 }
 
 int staj_told(staj_context* ctx, long double* v) {
-  int l = staj_get_length(ctx);
-  char* buf = (char*) calloc(l+1, sizeof(char));
-  int r = staj_get_text(ctx, buf, l+1);
-  if (r < 0) {
-    free(buf);
-    return -1;
-  }
-  if (r == 0) {
-    ctx->_errno = STAJ_EINVAL;
+  char buf[64];
+  char* t = number_text(ctx, buf, sizeof(buf));
+  if (t == NULL) {
+    ctx->_errno = STAJ_ENOMEM;
     init_errno(ctx);
-    free(buf);
     return -1;
   }
   char* eptr;
-  *v = strtold(buf, &eptr);
-  if (*eptr != 0) {
+  *v = strtold(t, &eptr);
+  int r = (t[0] == 0 || *eptr != 0);
+  if (t != buf) {
+    staj_free(ctx->allocator, t);
+  }
+  if (r) {
     ctx->_errno = STAJ_EINVAL;
     init_errno(ctx);
-    free(buf);
     return -1;
   }
-  free(buf);
   return 0;
 }
 
@@ -24,8 +24,28 @@
 #define __STAJ_C_H 1
 
 #include "staj_errors.h"
+#include <stddef.h>
 
 #define STAJ_MAX_CONTEXT_STACK 1024
+#define STAJ_DEFAULT_CHUNK_SIZE 65536
+
+/* staj_parse_file flags */
+#define STAJ_MMAP_RELEASE 1
+
+/* staj_parse_fd_async flags */
+#define STAJ_ASYNC_THREAD 1
+#define STAJ_DEFAULT_READ_AHEAD 4
+
+/* staj_set_flags flags */
+#define STAJ_MULTI_DOCUMENT 1
+#define STAJ_LAZY_STRINGS 2
+
+/* staj_paths_compile limits */
+#define STAJ_MAX_PATHS 64
+#define STAJ_MAX_PATH_DEPTH 64
+
+/* staj_parallel_file flags */
+#define STAJ_PARALLEL_ARRAY 1
 
 typedef enum {
   STAJ_BEGIN_OBJECT,
@@ -37,7 +57,8 @@ typedef enum {
   STAJ_NULL,
   STAJ_END_OBJECT,
   STAJ_END_ARRAY,
-  STAJ_EOF
+  STAJ_EOF,
+  STAJ_END_DOCUMENT
 } staj_token_type;
 
 typedef enum {
@@ -51,28 +72,69 @@ typedef enum {
 } staj_context_type;
 
 typedef struct {
-  char* buffer;
+  const char* buffer;
   int start;
   int length;
 } staj_interval;
 
+/*
+ * Memory allocation functions used by a context. ud is passed to the
+ * functions as is.
+ */
+typedef struct {
+  void* (*alloc)(void* ud, size_t size);
+  void* (*resize)(void* ud, void* ptr, size_t size);
+  void (*release)(void* ud, void* ptr);
+  void* ud;
+} staj_allocator;
+
+/*
+ * State of the in-memory buffer source
+ */
+typedef struct {
+  const char* buf;
+  int len;
+  int rem;
+} staj_buffer_source;
+
 typedef struct {
   /*
    * Get next buffer that contains the remainder of the input stream.
    * If result is 0 then buffer was returned successfully. Non-zero
    * result indicates error.
    *
-   * *len=0 indicates EOF
+   * *len=0 indicates EOF. The buffer is not required to be
+   * null-terminated and may contain any bytes. STAJ_EAGAIN means that
+   * no input is available yet (a non-blocking source): the call that
+   * needed it fails with STAJ_EAGAIN and may be repeated later.
+   * STAJ_ENOMEM is reported as such, any other error as STAJ_EIO.
+   *
+   * NULL for a push context, see staj_parse_push.
    *
    * ctx is passed to the function. This is opaque to StAJ but may
    * help to establish the right context to next_buffer
    */
-  int (*next_buffer)(void* ctx, int* len, char** buf);
+  int (*next_buffer)(void* ctx, int* len, const char** buf);
+  /*
+   * Optional. If set, the context works in windowed mode: it only keeps
+   * the buffers spanned by the current token and hands every other
+   * buffer back through this function once it has been consumed. The
+   * buffer slots are reused, so max_buffers only has to cover the
+   * longest token rather than the whole stream. The text of a token
+   * is valid until the next call to staj_has_next or staj_next.
+   *
+   * Non-zero result indicates error.
+   */
+  int (*release_buffer)(void* ctx, int len, const char* buf);
+  /*
+   * Optional. Frees ctx when the context is released.
+   */
+  void (*release_source)(void* ctx);
   void* ctx;
   staj_context_type context;
   int max_buffers;
   int* buffer_lengths;
-  char** buffers;
+  const char** buffers;
   int current_buffer;
   int current_pos;
   staj_token_type token;
@@ -84,25 +146,129 @@ typedef struct {
   unsigned int context_stack[STAJ_MAX_CONTEXT_STACK];
   int curr_context_stack_ptr;
   int parse_error;
+  /*
+   * STAJ_MULTI_DOCUMENT etc., see staj_set_flags
+   */
+  int flags;
+  /*
+   * staj_read_string: how far the current string token has been read
+   * (buffer and position in it), and the bytes of a character that did
+   * not fit in the last piece
+   */
+  int string_state;
+  int string_buffer;
+  int string_pos;
+  int string_pending_len;
+  char string_pending[4];
+  /*
+   * Push mode: the buffer handed to staj_feed and not yet taken, and the
+   * number of buffers after the current one that are already in the
+   * slots because a cut token is read again
+   */
+  int fed;
+  const char* fed_buffer;
+  int fed_length;
+  int extra_buffers;
+  /*
+   * staj_skip_value: depth and string state of a scan interrupted by
+   * STAJ_EAGAIN, 0 if none
+   */
+  int skip_depth;
+  int skip_string;
+  /*
+   * Allocator for everything the context allocates internally,
+   * NULL for malloc/realloc/free
+   */
+  const staj_allocator* allocator;
+  /*
+   * Built-in storage, so that a context over a single buffer needs
+   * no allocations
+   */
+  const char* own_buffers[2];
+  int own_buffer_lengths[2];
+  staj_buffer_source buffer_source;
+  /*
+   * Indexed mode: positions of the tokens in a window of the buffer,
+   * followed by the length of the buffer once it is indexed to the end.
+   * NULL in other modes.
+   */
+  int* index;
+  int index_cap;
+  int index_pos;
+  int index_len;
+  int index_scanned;
+  int index_carry;
 } staj_context;
 
+/*
+ * Compiled set of path expressions, see staj_paths_compile
+ */
+typedef struct staj_paths staj_paths;
+
+/*
+ * Compiled set of property names, see staj_keyset_compile
+ */
+typedef struct staj_keyset staj_keyset;
+
 int staj_has_next(staj_context*);
 int staj_next(staj_context*);
+int staj_skip_value(staj_context*);
 int staj_get_token(staj_context*);
 int staj_get_length(staj_context*);
 int staj_get_text(staj_context*, char*, int);
+int staj_get_view(staj_context*, const char**, int*);
+int staj_get_intervals(staj_context*, staj_interval*, int);
 int staj_get_parse_error(staj_context*);
 
 int staj_tostr(staj_context*, char*, int);
+int staj_read_string(staj_context*, char*, int);
 int staj_toi(staj_context*, int*);
 int staj_tol(staj_context*, long int*);
-// int staj_toll(staj_context*, long long int*);
+int staj_toll(staj_context*, long long int*);
 int staj_tof(staj_context*, float*);
 int staj_tod(staj_context*, double*);
 int staj_told(staj_context*, long double*);
 int staj_tob(staj_context*, int*);
 
-int staj_parse_buffer(char*, staj_context**);
+int staj_parse_buffer(const char*, staj_context**);
+int staj_parse_buffer_len(const char*, int, staj_context**);
+int staj_parse_stream(int (*)(void*, int*, const char**), int (*)(void*, int, const char*),
+                      void*, int, staj_context**);
+int staj_parse_push(int (*)(void*, int, const char*), void*, int, staj_context**);
+int staj_feed(staj_context*, const char*, int);
+int staj_parse_fd(int, int, staj_context**);
+int staj_parse_fd_async(int, int, int, int, staj_context**);
+int staj_parse_file(const char*, int, staj_context**);
+int staj_parse_indexed(const char*, int, staj_context**);
 int staj_release_context(staj_context*);
 
+int staj_init_buffer(staj_context*, const char*, int, const staj_allocator*);
+int staj_init_stream(staj_context*, int (*)(void*, int*, const char**),
+                     int (*)(void*, int, const char*), void*, int,
+                     const staj_allocator*);
+int staj_init_indexed(staj_context*, const char*, int, const staj_allocator*);
+int staj_deinit_context(staj_context*);
+int staj_reset_buffer(staj_context*, const char*, int);
+int staj_set_flags(staj_context*, int);
+
+int staj_validate(const char*, int, int*);
+
+int staj_keyset_compile(const char**, int, staj_keyset**);
+int staj_match_key(staj_context*, const staj_keyset*);
+int staj_keyset_release(staj_keyset*);
+
+int staj_paths_compile(const char**, int, staj_paths**);
+int staj_paths_run(const staj_paths*, staj_context*, int (*)(void*, int, staj_context*), void*);
+int staj_paths_release(staj_paths*);
+
+int staj_parallel_ndjson(const char*, size_t, int,
+                         int (*)(void*, int, size_t, staj_context*, void**),
+                         int (*)(void*, size_t, void*), void*);
+int staj_parallel_array(const char*, size_t, int,
+                        int (*)(void*, int, size_t, staj_context*, void**),
+                        int (*)(void*, size_t, void*), void*);
+int staj_parallel_file(const char*, int, int,
+                       int (*)(void*, int, size_t, staj_context*, void**),
+                       int (*)(void*, size_t, void*), void*);
+
 #endif
@@ -0,0 +1,576 @@
+/*
+
+   Copyright 2013 (c) Alexander Lukichev
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+   ===
+
+   Asynchronous input: a source that keeps several reads of a file
+   descriptor in flight, so that the next chunks are loaded while the
+   current one is parsed. The reads go through io_uring where it is
+   available and through a reader thread otherwise.
+
+*/
+#include "staj.h"
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+/*
+ * A read of one chunk of the input
+ */
+typedef struct {
+  char* buf;
+  off_t offset;
+  ssize_t result;
+  int done;
+  struct iovec iov;
+} async_read;
+
+#ifdef HAVE_IO_URING
+/*
+ * The submission and completion rings shared with the kernel
+ */
+typedef struct {
+  int fd;
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  struct io_uring_sqe* sqes;
+  struct io_uring_cqe* cqes;
+  void* sq_map;
+  size_t sq_map_size;
+  void* cq_map;
+  size_t cq_map_size;
+  size_t sqes_size;
+  /* reads queued that the kernel has not taken yet, the last ones */
+  unsigned queued;
+} async_ring;
+#endif
+
+typedef struct {
+  int fd;
+  int chunk_size;
+  int depth;
+  /*
+   * The reads ahead of the parser in the order of the input, count of
+   * them from head
+   */
+  async_read* reads;
+  int head;
+  int count;
+  /*
+   * Nothing is read after the reads in the ring: the end of the input
+   * or an error
+   */
+  int last;
+  /*
+   * Chunks handed back by the context, to be read into again
+   */
+  char** pool;
+  int npool;
+  int max_pool;
+  pthread_mutex_t lock;
+  /*
+   * Reader thread
+   */
+  int threaded;
+  int stop;
+  pthread_t thread;
+  pthread_cond_t ready;
+  pthread_cond_t space;
+#ifdef HAVE_IO_URING
+  async_ring ring;
+  off_t offset;
+  int inflight;
+#endif
+} async_source;
+
+static
+char* chunk_get(async_source* s) {
+  char* chunk = NULL;
+  void* p;
+  pthread_mutex_lock(&s->lock);
+  if (s->npool > 0) {
+    chunk = s->pool[--s->npool];
+  }
+  pthread_mutex_unlock(&s->lock);
+  if (chunk == NULL && posix_memalign(&p, 4096, s->chunk_size) == 0) {
+    chunk = (char*) p;
+  }
+  return chunk;
+}
+
+static
+void chunk_put(async_source* s, char* chunk) {
+  pthread_mutex_lock(&s->lock);
+  if (s->npool >= s->max_pool) {
+    int n = s->max_pool * 2;
+    char** pool = (char**) realloc(s->pool, n * sizeof(char*));
+    if (pool == NULL) {
+      pthread_mutex_unlock(&s->lock);
+      free(chunk);
+      return;
+    }
+    s->pool = pool;
+    s->max_pool = n;
+  }
+  s->pool[s->npool++] = chunk;
+  pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * Hand a finished read to the context
+ */
+static
+int deliver(async_source* s, async_read* r, int* len, const char** buf) {
+  if (r->result <= 0) {
+    if (r->buf != NULL) {
+      chunk_put(s, r->buf);
+    }
+    *len = 0;
+    if (r->result < 0) {
+      /* no chunk could be allocated for the read */
+      return r->buf == NULL ? STAJ_ENOMEM : -1;
+    }
+    return 0;
+  }
+  *buf = r->buf;
+  *len = (int) r->result;
+  return 0;
+}
+
+/*
+ * Read the next chunk in the reader thread. Cancellation is only enabled
+ * while it waits in read.
+ */
+static
+ssize_t thread_read(async_source* s, char* chunk) {
+  ssize_t n;
+  pthread_cleanup_push(free, chunk);
+  pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+  do {
+    n = read(s->fd, chunk, s->chunk_size);
+  } while (n < 0 && errno == EINTR);
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+  pthread_cleanup_pop(0);
+  return n;
+}
+
+/*
+ * Reader thread: reads the input one chunk after another as long as
+ * there is room in the ring
+ */
+static
+void* thread_reader(void* arg) {
+  async_source* s = (async_source*) arg;
+  async_read* r;
+  char* chunk;
+  ssize_t n;
+  int stop;
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+  for (;;) {
+    pthread_mutex_lock(&s->lock);
+    while (!s->stop && s->count == s->depth) {
+      pthread_cond_wait(&s->space, &s->lock);
+    }
+    stop = s->stop;
+    pthread_mutex_unlock(&s->lock);
+    if (stop) {
+      break;
+    }
+    n = -1;
+    if ((chunk = chunk_get(s)) != NULL) {
+      n = thread_read(s, chunk);
+    }
+    pthread_mutex_lock(&s->lock);
+    r = &s->reads[(s->head + s->count) % s->depth];
+    r->buf = chunk;
+    r->result = n;
+    r->done = 1;
+    s->count ++;
+    pthread_cond_signal(&s->ready);
+    pthread_mutex_unlock(&s->lock);
+    if (n <= 0) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+static
+int thread_next(async_source* s, int* len, const char** buf) {
+  async_read r;
+  pthread_mutex_lock(&s->lock);
+  while (s->count == 0 && !s->last) {
+    pthread_cond_wait(&s->ready, &s->lock);
+  }
+  if (s->count == 0) {
+    pthread_mutex_unlock(&s->lock);
+    *len = 0;
+    return 0;
+  }
+  r = s->reads[s->head];
+  s->head = (s->head + 1) % s->depth;
+  s->count --;
+  if (r.result <= 0) {
+    s->last = 1;
+  }
+  pthread_cond_signal(&s->space);
+  pthread_mutex_unlock(&s->lock);
+  return deliver(s, &r, len, buf);
+}
+
+#ifdef HAVE_IO_URING
+
+static
+int ring_setup(async_ring* ring, unsigned entries) {
+  struct io_uring_params p;
+  char* sq;
+  char* cq;
+  memset(&p, 0, sizeof(p));
+  ring->fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+  if (ring->fd < 0) {
+    return -1;
+  }
+  ring->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    /* both rings in one mapping */
+    if (ring->cq_map_size > ring->sq_map_size) {
+      ring->sq_map_size = ring->cq_map_size;
+    }
+    ring->cq_map_size = 0;
+  }
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQ_RING);
+  ring->cq_map = ring->cq_map_size == 0 ? ring->sq_map :
+                 mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_CQ_RING);
+  ring->sqes = (struct io_uring_sqe*) mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    if (ring->sq_map != MAP_FAILED) {
+      munmap(ring->sq_map, ring->sq_map_size);
+    }
+    if (ring->cq_map_size != 0 && ring->cq_map != MAP_FAILED) {
+      munmap(ring->cq_map, ring->cq_map_size);
+    }
+    if (ring->sqes != MAP_FAILED) {
+      munmap(ring->sqes, ring->sqes_size);
+    }
+    close(ring->fd);
+    return -1;
+  }
+  sq = (char*) ring->sq_map;
+  cq = (char*) ring->cq_map;
+  ring->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+  ring->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned*) (sq + p.sq_off.array);
+  ring->cq_head = (unsigned*) (cq + p.cq_off.head);
+  ring->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+  ring->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+  return 0;
+}
+
+static
+void ring_release(async_ring* ring) {
+  munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_map_size != 0) {
+    munmap(ring->cq_map, ring->cq_map_size);
+  }
+  munmap(ring->sq_map, ring->sq_map_size);
+  close(ring->fd);
+}
+
+/*
+ * Submit the queued reads and wait for min_complete reads. The kernel
+ * may take only some of them, the rest are submitted next time. Returns
+ * the number taken or -1.
+ */
+static
+int ring_enter(async_ring* ring, unsigned min_complete) {
+  long r;
+  do {
+    r = syscall(__NR_io_uring_enter, ring->fd, ring->queued, min_complete,
+                min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  } while (r < 0 && errno == EINTR);
+  if (r < 0) {
+    return -1;
+  }
+  ring->queued -= (unsigned) r;
+  return (int) r;
+}
+
+/*
+ * Queue the read of s->reads[i]
+ */
+static
+void ring_read(async_source* s, int i) {
+  async_ring* ring = &s->ring;
+  async_read* r = &s->reads[i];
+  unsigned tail = *ring->sq_tail;
+  unsigned idx = tail & *ring->sq_mask;
+  struct io_uring_sqe* sqe = &ring->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READV;
+  sqe->fd = s->fd;
+  sqe->addr = (unsigned long) &r->iov;
+  sqe->len = 1;
+  sqe->off = (unsigned long long) r->offset;
+  sqe->user_data = (unsigned long long) i;
+  ring->sq_array[idx] = idx;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->queued ++;
+}
+
+/*
+ * Take the finished reads off the completion ring
+ */
+static
+void ring_reap(async_source* s) {
+  async_ring* ring = &s->ring;
+  unsigned head = *ring->cq_head;
+  unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  struct io_uring_cqe* cqe;
+  while (head != tail) {
+    cqe = &ring->cqes[head & *ring->cq_mask];
+    s->reads[cqe->user_data].result = cqe->res;
+    s->reads[cqe->user_data].done = 1;
+    s->inflight --;
+    head ++;
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * Wait for the reads in flight and drop the reads ahead. The reads the
+ * kernel has not taken are taken off the submission ring; no other
+ * thread reads it.
+ */
+static
+int ring_drain(async_source* s) {
+  async_ring* ring = &s->ring;
+  int r = 0;
+  if (ring->queued > 0) {
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail - ring->queued, __ATOMIC_RELEASE);
+    s->inflight -= (int) ring->queued;
+    ring->queued = 0;
+  }
+  while (s->inflight > 0) {
+    if (ring_enter(ring, 1) < 0) {
+      r = -1;
+      break;
+    }
+    ring_reap(s);
+  }
+  while (s->count > 0) {
+    chunk_put(s, s->reads[s->head].buf);
+    s->head = (s->head + 1) % s->depth;
+    s->count --;
+  }
+  return r;
+}
+
+static
+int ring_next(async_source* s, int* len, const char** buf) {
+  async_read* r;
+  int i;
+  /* keep depth reads in flight */
+  while (!s->last && s->count < s->depth) {
+    i = (s->head + s->count) % s->depth;
+    r = &s->reads[i];
+    if ((r->buf = chunk_get(s)) == NULL) {
+      break;
+    }
+    r->iov.iov_base = r->buf;
+    r->iov.iov_len = s->chunk_size;
+    r->offset = s->offset;
+    r->done = 0;
+    s->offset += s->chunk_size;
+    ring_read(s, i);
+    s->count ++;
+    s->inflight ++;
+  }
+  if (s->ring.queued > 0 && ring_enter(&s->ring, 0) < 0 && s->inflight == (int) s->ring.queued) {
+    return -1;
+  }
+  if (s->count == 0) {
+    /* no chunk could be allocated for a read */
+    *len = 0;
+    return s->last ? 0 : STAJ_ENOMEM;
+  }
+  /* the reads are taken in order, so the first one is in flight if any
+     read is; otherwise it is submitted first */
+  r = &s->reads[s->head];
+  while (!r->done) {
+    if (ring_enter(&s->ring, s->inflight > (int) s->ring.queued) < 0 ||
+        s->inflight == (int) s->ring.queued) {
+      return -1;
+    }
+    ring_reap(s);
+  }
+  s->head = (s->head + 1) % s->depth;
+  s->count --;
+  if (r->result < s->chunk_size) {
+    /* the end of the input or an error; or a file that was shorter when
+       the reads after this one were submitted, then they are read again */
+    if (ring_drain(s) != 0) {
+      r->result = -1;
+    }
+    if (r->result <= 0) {
+      s->last = 1;
+    } else {
+      s->offset = r->offset + r->result;
+    }
+  }
+  return deliver(s, r, len, buf);
+}
+
+#endif
+
+static
+int async_next_chunk(void* ctx, int* len, const char** buf) {
+  async_source* s = (async_source*) ctx;
+#ifdef HAVE_IO_URING
+  if (!s->threaded) {
+    return ring_next(s, len, buf);
+  }
+#endif
+  return thread_next(s, len, buf);
+}
+
+static
+int async_release_chunk(void* ctx, int len, const char* buf) {
+  chunk_put((async_source*) ctx, (char*) buf);
+  return 0;
+}
+
+static
+void async_release(void* ctx) {
+  async_source* s = (async_source*) ctx;
+  int i;
+  if (s->threaded) {
+    pthread_mutex_lock(&s->lock);
+    s->stop = 1;
+    pthread_cond_broadcast(&s->space);
+    pthread_mutex_unlock(&s->lock);
+    /* the reader may wait for input that never comes */
+    pthread_cancel(s->thread);
+    pthread_join(s->thread, NULL);
+    for (i=0; i<s->count; i++) {
+      free(s->reads[(s->head + i) % s->depth].buf);
+    }
+    pthread_cond_destroy(&s->ready);
+    pthread_cond_destroy(&s->space);
+  } else {
+#ifdef HAVE_IO_URING
+    ring_drain(s);
+    ring_release(&s->ring);
+#endif
+  }
+  for (i=0; i<s->npool; i++) {
+    free(s->pool[i]);
+  }
+  free(s->pool);
+  free(s->reads);
+  pthread_mutex_destroy(&s->lock);
+  free(s);
+}
+
+/*
+ * staj_parse_fd_async
+ *
+ * Create a context that reads the input from a file descriptor ahead of
+ * the parser: read_ahead reads of chunk_size bytes are kept in flight
+ * (STAJ_DEFAULT_READ_AHEAD and STAJ_DEFAULT_CHUNK_SIZE if <= 0), so the
+ * next chunks load while the current one is parsed.
+ *
+ * A file the descriptor can seek in is read with io_uring where the
+ * kernel has it, at offsets from the current one on. Otherwise, or with
+ * STAJ_ASYNC_THREAD in flags, a reader thread reads the chunks one after
+ * another. Where the file offset is left is not specified.
+ *
+ * The context works in windowed mode and the chunks are reused, see
+ * staj_parse_fd. Releasing the context waits for the reads in flight.
+ * The file descriptor is not closed.
+ */
+int staj_parse_fd_async(int fd, int chunk_size, int read_ahead, int flags, staj_context** _ctx) {
+  async_source* s = (async_source*) calloc(1, sizeof(async_source));
+  if (s == NULL) {
+    errno = STAJ_ENOMEM;
+    return -1;
+  }
+  s->fd = fd;
+  s->chunk_size = chunk_size > 0 ? chunk_size : STAJ_DEFAULT_CHUNK_SIZE;
+  s->depth = read_ahead > 0 ? read_ahead : STAJ_DEFAULT_READ_AHEAD;
+  s->max_pool = s->depth + 4;
+  s->reads = (async_read*) calloc(s->depth, sizeof(async_read));
+  s->pool = (char**) calloc(s->max_pool, sizeof(char*));
+  if (s->reads == NULL || s->pool == NULL) {
+    free(s->reads);
+    free(s->pool);
+    free(s);
+    errno = STAJ_ENOMEM;
+    return -1;
+  }
+  pthread_mutex_init(&s->lock, NULL);
+#ifdef HAVE_IO_URING
+  if (!(flags & STAJ_ASYNC_THREAD) &&
+      (s->offset = lseek(fd, 0, SEEK_CUR)) >= 0 &&
+      ring_setup(&s->ring, s->depth) == 0) {
+    s->threaded = 0;
+  } else
+#endif
+  {
+    s->threaded = 1;
+    pthread_cond_init(&s->ready, NULL);
+    pthread_cond_init(&s->space, NULL);
+    if (pthread_create(&s->thread, NULL, &thread_reader, s) != 0) {
+      pthread_cond_destroy(&s->ready);
+      pthread_cond_destroy(&s->space);
+      pthread_mutex_destroy(&s->lock);
+      free(s->reads);
+      free(s->pool);
+      free(s);
+      errno = STAJ_ENOMEM;
+      return -1;
+    }
+  }
+  if (staj_parse_stream(&async_next_chunk, &async_release_chunk, s, 4, _ctx) != 0) {
+    async_release(s);
+    errno = STAJ_ENOMEM;
+    return -1;
+  }
+  (*_ctx)->release_source = &async_release;
+  return 0;
+}
@@ -33,5 +33,7 @@
 #define STAJ_ENOMEM			-2
 #define STAJ_ESTACK			-3
 #define STAJ_EINVAL			-4
+#define STAJ_EIO			-5
+#define STAJ_EAGAIN			-6
 
 #endif
@@ -0,0 +1,755 @@
+/*
+
+   Copyright 2013 (c) Alexander Lukichev
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+   ===
+
+   Parallel drivers: the input is cut into chunks at record boundaries
+   and every worker thread parses its chunks with a context of its own
+
+*/
+#include "staj.h"
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Chunks of about this many bytes are handed to the workers
+ */
+#define PARALLEL_CHUNK_SIZE (1 << 20)
+
+/*
+ * In ordered mode the workers may run this many chunks per thread ahead
+ * of the chunk being emitted
+ */
+#define PARALLEL_CHUNKS_AHEAD 4
+
+typedef int (*record_map)(void*, int, size_t, staj_context*, void**);
+typedef int (*record_emit)(void*, size_t, void*);
+
+typedef struct parallel_job parallel_job;
+
+typedef struct {
+  parallel_job* job;
+  int worker;
+} parallel_worker;
+
+/*
+ * Records of a chunk parsed in ordered mode and waiting to be emitted
+ */
+typedef struct {
+  size_t* offsets;
+  void** results;
+  int count;
+  int cap;
+  int done;
+} parallel_slot;
+
+struct parallel_job {
+  const char* buffer;
+  size_t* bounds;
+  size_t nchunks;
+  int (*parse)(parallel_job*, int, staj_context*, size_t, parallel_slot*);
+  record_map map;
+  record_emit emit;
+  void* ud;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  size_t next_chunk;
+  size_t next_emit;
+  int emitting;
+  /* first non-zero result of a callback, -1 on error */
+  int stop;
+  int _errno;
+  parallel_slot* slots;
+  size_t nslots;
+
+  /* top-level array: where the elements end, the state at the start of every chunk */
+  size_t end;
+  char* in_string;
+  long* depth;
+  long* deltas;
+
+  int threads;
+  pthread_t* tids;
+  parallel_worker* workers;
+};
+
+/*
+ * Record the first reason to stop, the workers give up at the next
+ * record
+ */
+static
+void stop_job(parallel_job* job, int r, int _errno) {
+  pthread_mutex_lock(&job->lock);
+  if (job->stop == 0) {
+    job->_errno = _errno;
+    __atomic_store_n(&job->stop, r, __ATOMIC_RELAXED);
+  }
+  pthread_cond_broadcast(&job->cond);
+  pthread_mutex_unlock(&job->lock);
+}
+
+static
+int slot_add(parallel_slot* slot, size_t offset, void* result) {
+  if (slot->count == slot->cap) {
+    int cap = slot->cap ? 2 * slot->cap : 256;
+    size_t* offsets = (size_t*) realloc(slot->offsets, cap * sizeof(size_t));
+    if (offsets == NULL) {
+      return -1;
+    }
+    slot->offsets = offsets;
+    void** results = (void**) realloc(slot->results, cap * sizeof(void*));
+    if (results == NULL) {
+      return -1;
+    }
+    slot->results = results;
+    slot->cap = cap;
+  }
+  slot->offsets[slot->count] = offset;
+  slot->results[slot->count] = result;
+  slot->count++;
+  return 0;
+}
+
+/*
+ * Called with the lock held once a chunk is done: unless another worker
+ * is at it, emit the chunks that are done in order. The lock is released
+ * while the callback runs.
+ */
+static
+void emit_chunks(parallel_job* job) {
+  if (job->emitting) {
+    return;
+  }
+  job->emitting = 1;
+  while (job->stop == 0 && job->next_emit < job->nchunks) {
+    parallel_slot* slot = &job->slots[job->next_emit % job->nslots];
+    int i;
+    int r = 0;
+    if (!slot->done) {
+      break;
+    }
+    pthread_mutex_unlock(&job->lock);
+    for (i=0; i<slot->count && r == 0; i++) {
+      r = job->emit(job->ud, slot->offsets[i], slot->results[i]);
+    }
+    pthread_mutex_lock(&job->lock);
+    if (r != 0 && job->stop == 0) {
+      __atomic_store_n(&job->stop, r, __ATOMIC_RELAXED);
+    }
+    slot->count = 0;
+    slot->done = 0;
+    job->next_emit++;
+    pthread_cond_broadcast(&job->cond);
+  }
+  job->emitting = 0;
+}
+
+/*
+ * Parse the records of a chunk, one per line; blank lines are skipped and
+ * what the callback leaves of a line is read to its end
+ */
+static
+int parse_lines(parallel_job* job, int worker, staj_context* ctx, size_t chunk,
+                parallel_slot* slot) {
+  const char* p = job->buffer + job->bounds[chunk];
+  const char* e = job->buffer + job->bounds[chunk + 1];
+  while (p < e) {
+    const char* nl = (const char*) memchr(p, '\n', e - p);
+    const char* q = p;
+    void* result = NULL;
+    int r;
+    if (nl == NULL) {
+      nl = e;
+    }
+    while (q < nl && (*q == ' ' || *q == '\t' || *q == '\r')) {
+      q++;
+    }
+    if (q == nl) {
+      p = nl + 1;
+      continue;
+    }
+    /* set under the lock by another worker */
+    if (__atomic_load_n(&job->stop, __ATOMIC_RELAXED) != 0) {
+      return 0;
+    }
+    if (nl - p > INT_MAX) {
+      stop_job(job, -1, STAJ_EINVAL);
+      return -1;
+    }
+    if (staj_reset_buffer(ctx, p, (int) (nl - p)) != 0) {
+      stop_job(job, -1, ctx->_errno);
+      return -1;
+    }
+    r = job->map(job->ud, worker, p - job->buffer, ctx, &result);
+    if (r != 0) {
+      stop_job(job, r, 0);
+      return -1;
+    }
+    /* the rest of the line must be the end of the record */
+    while (ctx->context != STAJ_CTX_END_DOCUMENT || staj_has_next(ctx)) {
+      if (staj_next(ctx) != 0) {
+        stop_job(job, -1, ctx->_errno);
+        return -1;
+      }
+    }
+    if (slot != NULL && slot_add(slot, p - job->buffer, result) != 0) {
+      stop_job(job, -1, STAJ_ENOMEM);
+      return -1;
+    }
+    p = nl + 1;
+  }
+  return 0;
+}
+
+static
+void* run_worker(void* arg) {
+  parallel_worker* w = (parallel_worker*) arg;
+  parallel_job* job = w->job;
+  staj_context ctx;
+  if (staj_init_indexed(&ctx, "", 0, NULL) != 0) {
+    stop_job(job, -1, ctx._errno);
+    staj_deinit_context(&ctx);
+    return NULL;
+  }
+  pthread_mutex_lock(&job->lock);
+  while (job->stop == 0 && job->next_chunk < job->nchunks) {
+    size_t chunk = job->next_chunk;
+    parallel_slot* slot = NULL;
+    if (job->emit != NULL) {
+      if (chunk >= job->next_emit + job->nslots) {
+        pthread_cond_wait(&job->cond, &job->lock);
+        continue;
+      }
+      slot = &job->slots[chunk % job->nslots];
+    }
+    job->next_chunk++;
+    pthread_mutex_unlock(&job->lock);
+    int r = job->parse(job, w->worker, &ctx, chunk, slot);
+    pthread_mutex_lock(&job->lock);
+    if (r == 0 && slot != NULL) {
+      slot->done = 1;
+      emit_chunks(job);
+    }
+  }
+  pthread_mutex_unlock(&job->lock);
+  staj_deinit_context(&ctx);
+  return NULL;
+}
+
+/*
+ * Set up a job over nchunks chunks and its pool of threads
+ */
+static
+int init_job(parallel_job* job, const char* buffer, size_t nchunks, int threads,
+             record_map map, record_emit emit, void* ud) {
+  int n;
+  if (map == NULL) {
+    errno = STAJ_EINVAL;
+    return -1;
+  }
+  if (threads <= 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 0 ? (int) cpus : 1;
+  }
+  if ((size_t) threads > nchunks) {
+    threads = nchunks > 0 ? (int) nchunks : 1;
+  }
+  memset(job, 0, sizeof(parallel_job));
+  job->buffer = buffer;
+  job->nchunks = nchunks;
+  job->map = map;
+  job->emit = emit;
+  job->ud = ud;
+  job->threads = threads;
+  job->bounds = (size_t*) malloc((nchunks + 1) * sizeof(size_t));
+  job->nslots = (size_t) threads * PARALLEL_CHUNKS_AHEAD;
+  job->slots = (parallel_slot*) calloc(job->nslots, sizeof(parallel_slot));
+  job->workers = (parallel_worker*) malloc(threads * sizeof(parallel_worker));
+  job->tids = (pthread_t*) malloc(threads * sizeof(pthread_t));
+  if (job->bounds == NULL || job->slots == NULL || job->workers == NULL || job->tids == NULL) {
+    free(job->bounds);
+    free(job->slots);
+    free(job->workers);
+    free(job->tids);
+    errno = STAJ_ENOMEM;
+    return -1;
+  }
+  for (n=0; n<threads; n++) {
+    job->workers[n].job = job;
+    job->workers[n].worker = n;
+  }
+  pthread_mutex_init(&job->lock, NULL);
+  pthread_cond_init(&job->cond, NULL);
+  return 0;
+}
+
+/*
+ * Run fn on every worker of the pool and wait for them. The calling
+ * thread is worker 0, the job goes on with fewer threads if some fail to
+ * start.
+ */
+static
+void run_pool(parallel_job* job, void* (*fn)(void*)) {
+  int n;
+  job->next_chunk = 0;
+  for (n=1; n<job->threads; n++) {
+    if (pthread_create(&job->tids[n], NULL, fn, &job->workers[n]) != 0) {
+      break;
+    }
+  }
+  fn(&job->workers[0]);
+  while (--n > 0) {
+    pthread_join(job->tids[n], NULL);
+  }
+}
+
+static
+int finish_job(parallel_job* job) {
+  size_t i;
+  pthread_mutex_destroy(&job->lock);
+  pthread_cond_destroy(&job->cond);
+  for (i=0; i<job->nslots; i++) {
+    free(job->slots[i].offsets);
+    free(job->slots[i].results);
+  }
+  free(job->bounds);
+  free(job->slots);
+  free(job->workers);
+  free(job->tids);
+  free(job->in_string);
+  free(job->depth);
+  free(job->deltas);
+  if (job->stop == -1 && job->_errno != 0) {
+    errno = job->_errno;
+  }
+  return job->stop;
+}
+
+/*
+ * staj_parallel_ndjson
+ *
+ * Parse newline-delimited JSON in parallel: the buffer is cut into chunks
+ * at line boundaries and the chunks are parsed by a pool of threads, each
+ * with a context of its own. Blank lines are skipped.
+ *
+ * buffer, length - the input
+ * threads - number of threads including the calling one, the number of
+ *   online CPUs if <= 0
+ * map - called on a worker thread for every record with ud, the number of
+ *   the worker (0 to threads - 1), the offset of the record in the buffer
+ *   and a context at the start of the record. Calls with the same worker
+ *   number never overlap, records are seen in no particular order. In
+ *   ordered mode the callback may store a result for emit. A non-zero
+ *   result stops the parsing.
+ * emit - NULL for unordered mode. Otherwise called with ud, the offset and
+ *   the result of every record in the order of the input, one call at a
+ *   time. A non-zero result stops the parsing; results not emitted by then
+ *   are dropped.
+ * ud - passed to the callbacks as is
+ *
+ * returns 0 when all the records have been handed over, the non-zero
+ * result of a callback, or -1 on error with errno set
+ */
+int staj_parallel_ndjson(const char* buffer, size_t length, int threads,
+                         int (*map)(void*, int, size_t, staj_context*, void**),
+                         int (*emit)(void*, size_t, void*), void* ud) {
+  parallel_job job;
+  size_t i;
+  if (init_job(&job, buffer, (length + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE,
+               threads, map, emit, ud) != 0) {
+    return -1;
+  }
+  job.parse = &parse_lines;
+
+  /* a chunk starts after the first newline past its nominal start */
+  job.bounds[0] = 0;
+  for (i=1; i<job.nchunks; i++) {
+    size_t b = i * PARALLEL_CHUNK_SIZE;
+    const char* nl;
+    if (b < job.bounds[i - 1]) {
+      b = job.bounds[i - 1];
+    }
+    nl = (const char*) memchr(buffer + b, '\n', length - b);
+    job.bounds[i] = nl != NULL ? (size_t) (nl - buffer) + 1 : length;
+  }
+  job.bounds[job.nchunks] = length;
+
+  run_pool(&job, &run_worker);
+  return finish_job(&job);
+}
+
+/*
+ * Character classes of the top-level array scans
+ */
+#define CC_OTHER 0
+#define CC_BACKSLASH 1
+#define CC_QUOTE 2
+#define CC_OPEN 3
+#define CC_CLOSE 4
+#define CC_COMMA 5
+
+static const unsigned char char_classes[256] = {
+  ['\\'] = CC_BACKSLASH, ['"'] = CC_QUOTE,
+  ['['] = CC_OPEN, ['{'] = CC_OPEN, [']'] = CC_CLOSE, ['}'] = CC_CLOSE,
+  [','] = CC_COMMA
+};
+
+static inline
+int is_ws(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/*
+ * First pass over a chunk of the array: the parity of its quotes and the
+ * change of the nesting depth, both for a chunk starting outside a string
+ * (deltas[0]) and inside one (deltas[1]). Backslashes escape the next
+ * character either way, so both cases see the same quotes and only swap
+ * the brackets they count.
+ */
+static
+void* scan_chunk_states(void* arg) {
+  parallel_worker* w = (parallel_worker*) arg;
+  parallel_job* job = w->job;
+  for (;;) {
+    size_t chunk = __atomic_fetch_add(&job->next_chunk, 1, __ATOMIC_RELAXED);
+    const char* p;
+    const char* e;
+    long delta[2] = { 0, 0 };
+    int in_string = 0;
+    if (chunk >= job->nchunks) {
+      break;
+    }
+    p = job->buffer + job->bounds[chunk];
+    e = job->buffer + job->bounds[chunk + 1];
+    for (; p < e; p++) {
+      switch (char_classes[(unsigned char) *p]) {
+      case CC_BACKSLASH:
+        p++;
+        break;
+      case CC_QUOTE:
+        in_string ^= 1;
+        break;
+      case CC_OPEN:
+        delta[in_string]++;
+        break;
+      case CC_CLOSE:
+        delta[in_string]--;
+        break;
+      }
+    }
+    job->in_string[chunk] = in_string;
+    job->deltas[2 * chunk] = delta[0];
+    job->deltas[2 * chunk + 1] = delta[1];
+  }
+  return NULL;
+}
+
+/*
+ * The tokenizer only takes objects and arrays for documents, a scalar
+ * element is read from between the brackets of an array of its own
+ */
+typedef struct {
+  const char* parts[3];
+  int lens[3];
+  int next;
+} element_source;
+
+static
+int element_next_buffer(void* source, int* len, const char** buf) {
+  element_source* s = (element_source*) source;
+  if (s->next < 3) {
+    *buf = s->parts[s->next];
+    *len = s->lens[s->next];
+    s->next++;
+  } else {
+    *len = 0;
+  }
+  return 0;
+}
+
+static
+int element_release_buffer(void* source, int len, const char* buf) {
+  return 0;
+}
+
+/*
+ * Hand an element of the array over to the callback, with its first
+ * token read, and read what the callback left of it so that the element
+ * is checked to the end
+ */
+static
+int parse_element(parallel_job* job, int worker, staj_context* ctx, const char* p,
+                  const char* e, parallel_slot* slot) {
+  staj_context scalar_ctx;
+  element_source source;
+  void* result = NULL;
+  int r;
+  while (p < e && is_ws(*p)) {
+    p++;
+  }
+  if (p == e) {
+    stop_job(job, -1, STAJ_EPARSE);
+    return -1;
+  }
+  if (e - p > INT_MAX) {
+    stop_job(job, -1, STAJ_EINVAL);
+    return -1;
+  }
+  if (*p == '{' || *p == '[') {
+    if (staj_reset_buffer(ctx, p, (int) (e - p)) != 0) {
+      stop_job(job, -1, ctx->_errno);
+      return -1;
+    }
+  } else {
+    source.parts[0] = "[";
+    source.lens[0] = 1;
+    source.parts[1] = p;
+    source.lens[1] = (int) (e - p);
+    source.parts[2] = "]";
+    source.lens[2] = 1;
+    source.next = 0;
+    /* windowed, so that the buffer slots of the context are enough */
+    staj_init_stream(&scalar_ctx, &element_next_buffer, &element_release_buffer, &source, 2, NULL);
+    ctx = &scalar_ctx;
+  }
+  if ((ctx == &scalar_ctx && staj_next(ctx) != 0) || staj_next(ctx) != 0) {
+    stop_job(job, -1, ctx->_errno);
+    r = -1;
+    goto parse_element_exit;
+  }
+  r = job->map(job->ud, worker, p - job->buffer, ctx, &result);
+  if (r != 0) {
+    stop_job(job, r, 0);
+    r = -1;
+    goto parse_element_exit;
+  }
+  while (staj_has_next(ctx)) {
+    if (staj_next(ctx) != 0) {
+      stop_job(job, -1, ctx->_errno);
+      r = -1;
+      goto parse_element_exit;
+    }
+  }
+  if (slot != NULL && slot_add(slot, p - job->buffer, result) != 0) {
+    stop_job(job, -1, STAJ_ENOMEM);
+    r = -1;
+  }
+parse_element_exit:
+  if (ctx == &scalar_ctx) {
+    staj_deinit_context(ctx);
+  }
+  return r;
+}
+
+/*
+ * Second pass over a chunk of the array, from the state found for its
+ * start: parse the elements that start in the chunk. The last of them is
+ * followed into the next chunks up to its end.
+ */
+static
+int parse_elements(parallel_job* job, int worker, staj_context* ctx, size_t chunk,
+                   parallel_slot* slot) {
+  const char* p = job->buffer + job->bounds[chunk];
+  const char* e = job->buffer + job->bounds[chunk + 1];
+  const char* end = job->buffer + job->end;
+  const char* element = chunk == 0 ? p : NULL;
+  long depth = job->depth[chunk];
+  int in_string = job->in_string[chunk];
+  for (; p < end; p++) {
+    if (element == NULL && p >= e) {
+      return 0;
+    }
+    switch (char_classes[(unsigned char) *p]) {
+    case CC_BACKSLASH:
+      p++;
+      break;
+    case CC_QUOTE:
+      in_string ^= 1;
+      break;
+    case CC_OPEN:
+      depth += !in_string;
+      break;
+    case CC_CLOSE:
+      if (!in_string && depth-- == 0) {
+        stop_job(job, -1, STAJ_EPARSE);
+        return -1;
+      }
+      break;
+    case CC_COMMA:
+      if (!in_string && depth == 0) {
+        if (element != NULL && parse_element(job, worker, ctx, element, p, slot) != 0) {
+          return -1;
+        }
+        /* an element after a comma in the next chunk is its own */
+        element = p < e ? p + 1 : NULL;
+        if (__atomic_load_n(&job->stop, __ATOMIC_RELAXED) != 0) {
+          return 0;
+        }
+      }
+      break;
+    }
+  }
+  if (element != NULL) {
+    return parse_element(job, worker, ctx, element, end, slot);
+  }
+  return 0;
+}
+
+/*
+ * staj_parallel_array
+ *
+ * Parse the elements of a top-level array in parallel. The array is cut
+ * into chunks; a first parallel pass finds the quote parity and the change
+ * of the nesting depth of every chunk, a prefix over those gives the state
+ * at the start of every chunk, and a second parallel pass finds the
+ * elements that start in every chunk and parses them.
+ *
+ * The callbacks are those of staj_parallel_ndjson, with elements for
+ * records, except that the current token of the context passed to map is
+ * the first token of the element (as with staj_paths_run). The callback
+ * reads the element, an element it reads in part is read to its end:
+ * the whole array is checked.
+ *
+ * returns 0 when all the elements have been handed over, the non-zero
+ * result of a callback, or -1 on error with errno set (STAJ_EPARSE if the
+ * input is not an array of valid elements)
+ */
+int staj_parallel_array(const char* buffer, size_t length, int threads,
+                        int (*map)(void*, int, size_t, staj_context*, void**),
+                        int (*emit)(void*, size_t, void*), void* ud) {
+  parallel_job job;
+  size_t b = 0;
+  size_t e = length;
+  size_t i;
+  int in_string = 0;
+  long depth = 0;
+  while (b < e && is_ws(buffer[b])) {
+    b++;
+  }
+  while (e > b && is_ws(buffer[e - 1])) {
+    e--;
+  }
+  if (e - b < 2 || buffer[b] != '[' || buffer[e - 1] != ']') {
+    errno = STAJ_EPARSE;
+    return -1;
+  }
+  /* the elements are between the brackets */
+  b++;
+  e--;
+  while (b < e && is_ws(buffer[b])) {
+    b++;
+  }
+  if (init_job(&job, buffer, (e - b + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE,
+               threads, map, emit, ud) != 0) {
+    return -1;
+  }
+  job.parse = &parse_elements;
+  job.end = e;
+  job.in_string = (char*) malloc(job.nchunks + 1);
+  job.depth = (long*) malloc((job.nchunks + 1) * sizeof(long));
+  job.deltas = (long*) malloc((2 * job.nchunks + 1) * sizeof(long));
+  if (job.in_string == NULL || job.depth == NULL || job.deltas == NULL) {
+    job.stop = -1;
+    job._errno = STAJ_ENOMEM;
+    return finish_job(&job);
+  }
+
+  /* no chunk starts right after a backslash, so none starts with an escaped character */
+  job.bounds[0] = b;
+  for (i=1; i<job.nchunks; i++) {
+    size_t c = b + i * PARALLEL_CHUNK_SIZE;
+    if (c < job.bounds[i - 1]) {
+      c = job.bounds[i - 1];
+    }
+    while (c < e && buffer[c - 1] == '\\') {
+      c++;
+    }
+    job.bounds[i] = c;
+  }
+  job.bounds[job.nchunks] = e;
+
+  run_pool(&job, &scan_chunk_states);
+  for (i=0; i<job.nchunks; i++) {
+    long delta = job.deltas[2 * i + in_string];
+    int parity = job.in_string[i];
+    job.in_string[i] = in_string;
+    job.depth[i] = depth;
+    in_string ^= parity;
+    depth += delta;
+  }
+  if (in_string || depth != 0) {
+    job.stop = -1;
+    job._errno = STAJ_EPARSE;
+    return finish_job(&job);
+  }
+
+  run_pool(&job, &run_worker);
+  return finish_job(&job);
+}
+
+/*
+ * staj_parallel_file
+ *
+ * Map a file into memory and parse it with staj_parallel_ndjson, or with
+ * staj_parallel_array if STAJ_PARALLEL_ARRAY is in flags
+ *
+ * In case of error returns -1, errno is set by the failing system call
+ */
+int staj_parallel_file(const char* path, int flags, int threads,
+                       int (*map)(void*, int, size_t, staj_context*, void**),
+                       int (*emit)(void*, size_t, void*), void* ud) {
+  struct stat st;
+  void* data = NULL;
+  int r;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return -1;
+  }
+  if (st.st_size > 0) {
+    data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      return -1;
+    }
+#ifdef MADV_WILLNEED
+    madvise(data, (size_t) st.st_size, MADV_WILLNEED);
+#endif
+  }
+  close(fd);
+  if (flags & STAJ_PARALLEL_ARRAY) {
+    r = staj_parallel_array((const char*) data, (size_t) st.st_size, threads, map, emit, ud);
+  } else {
+    r = staj_parallel_ndjson((const char*) data, (size_t) st.st_size, threads, map, emit, ud);
+  }
+  if (data != NULL) {
+    int e = errno;
+    munmap(data, (size_t) st.st_size);
+    errno = e;
+  }
+  return r;
+}
@@ -0,0 +1,839 @@
+/*
+
+   Copyright 2013 (c) Alexander Lukichev
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+   ===
+
+   Key sets and path subscriptions: property names and path expressions
+   compiled up front and matched against the token stream
+
+*/
+#include "staj.h"
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+/*
+ * Keys with escapes are decoded on the stack if the longest key of the
+ * set fits, otherwise in a temporary allocation
+ */
+#define STAJ_KEY_BUFFER 1024
+
+/*
+ * A key set is a perfect hash table built by hash and displace: the
+ * high bits of the hash pick a bucket of a few keys, and the
+ * displacement of the bucket is chosen so that no two keys share a
+ * slot. A lookup is one hash, two loads and one comparison.
+ */
+struct staj_keyset {
+  int nkeys;
+  /* the longest key */
+  int maxlen;
+  unsigned int mask;
+  unsigned int bmask;
+  uint64_t seed;
+  /* key index + 1 per slot, 0 for an empty slot */
+  int* slots;
+  /* displacement per bucket */
+  unsigned int* disp;
+  char** keys;
+  int* lens;
+};
+
+/*
+ * Keys per bucket, and the largest table tried as a multiple of the
+ * number of keys
+ */
+#define KEYSET_BUCKET 4
+#define KEYSET_MAX_LOAD 8
+
+static inline
+uint64_t mix64(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDULL;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static inline
+uint64_t hash_key(uint64_t seed, const char* p, int len) {
+  uint64_t h = seed * 0x9E3779B97F4A7C15ULL ^ (uint64_t) len;
+  uint64_t w;
+  while (len > 8) {
+    memcpy(&w, p, 8);
+    h = mix64(h ^ w);
+    p += 8;
+    len -= 8;
+  }
+  w = 0;
+  memcpy(&w, p, len);
+  return mix64(h ^ w);
+}
+
+static inline
+unsigned int keyset_slot(const staj_keyset* ks, uint64_t h) {
+  return ((unsigned int) h ^ ks->disp[(unsigned int) (h >> 32) & ks->bmask]) & ks->mask;
+}
+
+/*
+ * Place the keys with the seed: the buckets with the most keys first,
+ * each at the first displacement where its keys land in free slots.
+ * Returns 0 or -1 if a bucket does not fit.
+ */
+static
+int keyset_place(staj_keyset* ks, uint64_t seed, uint64_t* hashes, int* order, int* first) {
+  unsigned int nbuckets = ks->bmask + 1;
+  unsigned int size = ks->mask + 1;
+  unsigned int b, d;
+  int count[KEYSET_BUCKET * 4 + 2];
+  int i, j, k, n;
+
+  /* the keys sorted by the size of their bucket, largest first, the
+     keys of a bucket next to each other */
+  memset(first, 0, (nbuckets + 1) * sizeof(int));
+  for (i=0; i<ks->nkeys; i++) {
+    hashes[i] = hash_key(seed, ks->keys[i], ks->lens[i]);
+    first[(unsigned int) (hashes[i] >> 32) & ks->bmask] ++;
+  }
+  memset(count, 0, sizeof(count));
+  for (b=0; b<nbuckets; b++) {
+    if (first[b] >= KEYSET_BUCKET * 4) {
+      return -1;
+    }
+    count[first[b]] ++;
+  }
+  n = 0;
+  for (i=KEYSET_BUCKET * 4 - 1; i>0; i--) {
+    k = count[i];
+    count[i] = n;
+    n += k * i;
+  }
+  for (b=0; b<nbuckets; b++) {
+    k = first[b];
+    first[b] = count[k];
+    count[k] += k;
+  }
+  first[nbuckets] = ks->nkeys;
+  for (i=0; i<ks->nkeys; i++) {
+    order[first[(unsigned int) (hashes[i] >> 32) & ks->bmask] ++] = i;
+  }
+
+  memset(ks->slots, 0, size * sizeof(int));
+  for (i=0; i<ks->nkeys; i=j) {
+    b = (unsigned int) (hashes[order[i]] >> 32) & ks->bmask;
+    for (j=i+1; j<ks->nkeys && ((unsigned int) (hashes[order[j]] >> 32) & ks->bmask) == b; j++) {
+    }
+    for (d=0; d<size; d++) {
+      ks->disp[b] = d;
+      for (k=i; k<j; k++) {
+        unsigned int s = keyset_slot(ks, hashes[order[k]]);
+        if (ks->slots[s] != 0) {
+          break;
+        }
+        ks->slots[s] = order[k] + 1;
+      }
+      if (k == j) {
+        break;
+      }
+      while (k-- > i) {
+        ks->slots[keyset_slot(ks, hashes[order[k]])] = 0;
+      }
+    }
+    if (d == size) {
+      return -1;
+    }
+  }
+  ks->seed = seed;
+  return 0;
+}
+
+static
+int compare_hashes(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*) a;
+  uint64_t y = *(const uint64_t*) b;
+  return x < y ? -1 : x > y;
+}
+
+/*
+ * Whether a key is repeated: equal keys have equal hashes, so only keys
+ * whose hashes are equal are compared. hashes is scratch space.
+ */
+static
+int keyset_repeated(const staj_keyset* ks, uint64_t* hashes) {
+  int i, j, k;
+  for (i=0; i<ks->nkeys; i++) {
+    hashes[i] = hash_key(0, ks->keys[i], ks->lens[i]);
+  }
+  qsort(hashes, ks->nkeys, sizeof(uint64_t), compare_hashes);
+  for (i=1; i<ks->nkeys; i++) {
+    if (hashes[i] != hashes[i - 1]) {
+      continue;
+    }
+    for (j=0; j<ks->nkeys; j++) {
+      if (hash_key(0, ks->keys[j], ks->lens[j]) != hashes[i]) {
+        continue;
+      }
+      for (k=j+1; k<ks->nkeys; k++) {
+        if (ks->lens[j] == ks->lens[k] && memcmp(ks->keys[j], ks->keys[k], ks->lens[j]) == 0) {
+          return 1;
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+ * Find a seed and a table size without collisions. The table has
+ * between 2 and KEYSET_MAX_LOAD slots per key. Returns 0, STAJ_EINVAL
+ * for duplicate keys or STAJ_ENOMEM.
+ */
+static
+int keyset_build(staj_keyset* ks) {
+  unsigned int size = 1;
+  unsigned int nbuckets = 1;
+  uint64_t* hashes;
+  uint64_t seed;
+  int* order;
+  int* first;
+  int r = STAJ_ENOMEM;
+
+  while (nbuckets * KEYSET_BUCKET < (unsigned int) ks->nkeys) {
+    nbuckets <<= 1;
+  }
+  while (size < 2 * (unsigned int) ks->nkeys) {
+    size <<= 1;
+  }
+  ks->bmask = nbuckets - 1;
+  ks->disp = (unsigned int*) calloc(nbuckets, sizeof(unsigned int));
+  hashes = (uint64_t*) malloc((ks->nkeys + 1) * sizeof(uint64_t));
+  order = (int*) malloc((ks->nkeys + 1) * sizeof(int));
+  first = (int*) malloc((nbuckets + 1) * sizeof(int));
+  if (ks->disp == NULL || hashes == NULL || order == NULL || first == NULL) {
+    goto keyset_build_exit;
+  }
+  if (keyset_repeated(ks, hashes)) {
+    r = STAJ_EINVAL;
+    goto keyset_build_exit;
+  }
+  for (; size <= KEYSET_MAX_LOAD * (unsigned int) ks->nkeys || size <= 2; size <<= 1) {
+    int* slots = (int*) realloc(ks->slots, size * sizeof(int));
+    if (slots == NULL) {
+      goto keyset_build_exit;
+    }
+    ks->slots = slots;
+    ks->mask = size - 1;
+    for (seed=1; seed<=64; seed++) {
+      if (keyset_place(ks, seed, hashes, order, first) == 0) {
+        r = 0;
+        goto keyset_build_exit;
+      }
+    }
+  }
+
+keyset_build_exit:
+  free(hashes);
+  free(order);
+  free(first);
+  return r;
+}
+
+static
+int keyset_create(const char** keys, const int* lens, int n, staj_keyset** keyset) {
+  int i;
+  int r;
+  staj_keyset* ks = (staj_keyset*) calloc(1, sizeof(staj_keyset));
+  if (ks == NULL) {
+    return STAJ_ENOMEM;
+  }
+  ks->keys = (char**) calloc(n + 1, sizeof(char*));
+  ks->lens = (int*) calloc(n + 1, sizeof(int));
+  if (ks->keys == NULL || ks->lens == NULL) {
+    staj_keyset_release(ks);
+    return STAJ_ENOMEM;
+  }
+  for (i=0; i<n; i++) {
+    int len = lens != NULL ? lens[i] : (int) strlen(keys[i]);
+    if ((ks->keys[i] = (char*) malloc(len + 1)) == NULL) {
+      staj_keyset_release(ks);
+      return STAJ_ENOMEM;
+    }
+    memcpy(ks->keys[i], keys[i], len);
+    ks->keys[i][len] = 0;
+    ks->lens[i] = len;
+    if (len > ks->maxlen) {
+      ks->maxlen = len;
+    }
+    ks->nkeys ++;
+  }
+  if ((r = keyset_build(ks)) != 0) {
+    staj_keyset_release(ks);
+    return r;
+  }
+  *keyset = ks;
+  return 0;
+}
+
+/*
+ * staj_keyset_compile
+ *
+ * Compile a fixed set of property names for staj_match_key
+ *
+ * keys - null-terminated names, all different
+ * n - number of names
+ * keyset - receives the compiled set
+ *
+ * returns 0 on success, otherwise -1 and sets errno to STAJ_EINVAL if
+ * a name is repeated or to STAJ_ENOMEM
+ */
+int staj_keyset_compile(const char** keys, int n, staj_keyset** keyset) {
+  int r;
+  if (n < 0) {
+    errno = STAJ_EINVAL;
+    return -1;
+  }
+  if ((r = keyset_create(keys, NULL, n, keyset)) != 0) {
+    errno = r;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * staj_keyset_release
+ *
+ * Free a compiled key set
+ */
+int staj_keyset_release(staj_keyset* keyset) {
+  int i;
+  if (keyset->keys != NULL) {
+    for (i=0; i<keyset->nkeys; i++) {
+      free(keyset->keys[i]);
+    }
+  }
+  free(keyset->keys);
+  free(keyset->lens);
+  free(keyset->slots);
+  free(keyset->disp);
+  free(keyset);
+  return 0;
+}
+
+static inline
+int keyset_find(const staj_keyset* ks, const char* p, int len) {
+  int i = ks->slots[keyset_slot(ks, hash_key(ks->seed, p, len))] - 1;
+  if (i >= 0 && ks->lens[i] == len && memcmp(ks->keys[i], p, len) == 0) {
+    return i;
+  }
+  return -1;
+}
+
+/*
+ * Index of the key equal to the current token, -1 if there is none or
+ * -2 if there is no memory to decode it
+ */
+static inline
+int match_key(staj_context* ctx, const staj_keyset* keyset) {
+  char buf[STAJ_KEY_BUFFER];
+  char* dbuf = buf;
+  const char* name;
+  int lazy;
+  int len;
+  int r;
+  int n;
+
+  if (ctx->token != STAJ_PROPERTY_NAME && ctx->token != STAJ_STRING) {
+    return -1;
+  }
+  /* a lazy string value is only its opening quote, it is read from the
+     input */
+  lazy = ctx->token == STAJ_STRING && (ctx->flags & STAJ_LAZY_STRINGS) && ctx->index == NULL;
+  if (!lazy && ctx->start_buffer == ctx->end_buffer) {
+    name = ctx->buffers[ctx->start_buffer] + ctx->start_pos + 1;
+    len = ctx->end_pos - ctx->start_pos - 1;
+    if (memchr(name, 0x5C, len) == NULL) {
+      return keyset_find(keyset, name, len);
+    }
+  }
+  /* a token longer than every key is cut at more than maxlen bytes and
+     matches none */
+  len = keyset->maxlen + 4;
+  if (len > STAJ_KEY_BUFFER) {
+    if ((dbuf = (char*) malloc(len)) == NULL) {
+      return -2;
+    }
+  }
+  if (lazy) {
+    r = 0;
+    n = 0;
+    while (r < len && (n = staj_read_string(ctx, dbuf + r, len - r)) > 0) {
+      r += n;
+    }
+    if (n < 0) {
+      r = -1;
+    }
+  } else {
+    r = staj_tostr(ctx, dbuf, len);
+  }
+  if (r >= 0 && r <= keyset->maxlen) {
+    r = keyset_find(keyset, dbuf, r);
+  } else {
+    r = -1;
+  }
+  if (dbuf != buf) {
+    free(dbuf);
+  }
+  return r;
+}
+
+/*
+ * staj_match_key
+ *
+ * Look the current property name or string token up in a key set. The
+ * token is hashed as it lies in the input; only if it contains escapes
+ * or is split between buffers it is decoded first, and only as far as
+ * the longest key. A string value in STAJ_LAZY_STRINGS mode is read
+ * with staj_read_string, so nothing of it is left to read after the
+ * call.
+ *
+ * ctx - StAJ context
+ * keyset - compiled key set
+ *
+ * returns the index of the matching key, -1 if there is none, or -1
+ * and sets errno to STAJ_ENOMEM if there is no memory to decode the
+ * token (only for sets with keys of about 1k and longer; errno is not
+ * changed otherwise)
+ */
+int staj_match_key(staj_context* ctx, const staj_keyset* keyset) {
+  int r = match_key(ctx, keyset);
+  if (r == -2) {
+    errno = STAJ_ENOMEM;
+    return -1;
+  }
+  return r;
+}
+
+struct staj_path_name {
+  char* name;
+  int len;
+  uint64_t mask;
+};
+
+struct staj_path_index {
+  long int index;
+  uint64_t mask;
+};
+
+/*
+ * What the paths expect at one step. Every set of paths is a bitmask
+ * with bit i standing for path i.
+ */
+struct staj_path_step {
+  uint64_t any_name;
+  uint64_t any_index;
+  struct staj_path_name* names;
+  int nnames;
+  staj_keyset* keys;
+  struct staj_path_index* indexes;
+  int nindexes;
+};
+
+struct staj_paths {
+  int npaths;
+  int depth;
+  uint64_t all;
+  /* ends[d] - paths of exactly d steps */
+  uint64_t ends[STAJ_MAX_PATH_DEPTH + 1];
+  struct staj_path_step steps[STAJ_MAX_PATH_DEPTH];
+};
+
+static inline
+int ctz64(uint64_t m) {
+#if defined(__GNUC__)
+  return __builtin_ctzll(m);
+#else
+  int n = 0;
+  while ((m & 1) == 0) {
+    m >>= 1;
+    n ++;
+  }
+  return n;
+#endif
+}
+
+static
+int add_name(struct staj_path_step* step, const char* name, int len, uint64_t bit) {
+  int i;
+  for (i=0; i<step->nnames; i++) {
+    if (step->names[i].len == len && memcmp(step->names[i].name, name, len) == 0) {
+      step->names[i].mask |= bit;
+      return 0;
+    }
+  }
+  struct staj_path_name* names = (struct staj_path_name*) realloc(step->names,
+      (step->nnames + 1) * sizeof(struct staj_path_name));
+  if (names == NULL) {
+    return -1;
+  }
+  step->names = names;
+  names[i].name = (char*) malloc(len + 1);
+  if (names[i].name == NULL) {
+    return -1;
+  }
+  memcpy(names[i].name, name, len);
+  names[i].name[len] = 0;
+  names[i].len = len;
+  names[i].mask = bit;
+  step->nnames ++;
+  return 0;
+}
+
+static
+int add_index(struct staj_path_step* step, long int index, uint64_t bit) {
+  int i;
+  for (i=0; i<step->nindexes; i++) {
+    if (step->indexes[i].index == index) {
+      step->indexes[i].mask |= bit;
+      return 0;
+    }
+  }
+  struct staj_path_index* indexes = (struct staj_path_index*) realloc(step->indexes,
+      (step->nindexes + 1) * sizeof(struct staj_path_index));
+  if (indexes == NULL) {
+    return -1;
+  }
+  step->indexes = indexes;
+  indexes[i].index = index;
+  indexes[i].mask = bit;
+  step->nindexes ++;
+  return 0;
+}
+
+/*
+ * Parse path expression p as path number i. Returns 0 on success,
+ * STAJ_EINVAL if the expression is malformed or STAJ_ENOMEM.
+ */
+static
+int compile_path(staj_paths* paths, const char* p, int i) {
+  uint64_t bit = (uint64_t) 1 << i;
+  int d = 0;
+  const char* name;
+  int r;
+
+  if (*p++ != '$') {
+    return STAJ_EINVAL;
+  }
+  while (*p != 0) {
+    if (d == STAJ_MAX_PATH_DEPTH) {
+      return STAJ_EINVAL;
+    }
+    struct staj_path_step* step = &paths->steps[d];
+    if (*p == '.') {
+      p ++;
+      if (*p == '*') {
+        step->any_name |= bit;
+        p ++;
+      } else {
+        name = p;
+        while (*p != 0 && *p != '.' && *p != '[') {
+          p ++;
+        }
+        if (p == name) {
+          return STAJ_EINVAL;
+        }
+        if (add_name(step, name, (int) (p - name), bit) != 0) {
+          return STAJ_ENOMEM;
+        }
+      }
+    } else
+    if (*p == '[') {
+      p ++;
+      if (*p == '*') {
+        step->any_index |= bit;
+        p ++;
+      } else
+      if (*p == '\'' || *p == '"') {
+        char q = *p++;
+        name = p;
+        while (*p != 0 && *p != q) {
+          p ++;
+        }
+        if (*p == 0) {
+          return STAJ_EINVAL;
+        }
+        r = add_name(step, name, (int) (p - name), bit);
+        p ++;
+        if (r != 0) {
+          return STAJ_ENOMEM;
+        }
+      } else
+      if (*p >= '0' && *p <= '9') {
+        char* eptr;
+        long int index = strtol(p, &eptr, 10);
+        p = eptr;
+        if (add_index(step, index, bit) != 0) {
+          return STAJ_ENOMEM;
+        }
+      } else {
+        return STAJ_EINVAL;
+      }
+      if (*p++ != ']') {
+        return STAJ_EINVAL;
+      }
+    } else {
+      return STAJ_EINVAL;
+    }
+    d ++;
+  }
+  paths->ends[d] |= bit;
+  if (d > paths->depth) {
+    paths->depth = d;
+  }
+  return 0;
+}
+
+/*
+ * Build the key set of the property names of a step
+ */
+static
+int compile_names(struct staj_path_step* step) {
+  const char* keys[STAJ_MAX_PATHS];
+  int lens[STAJ_MAX_PATHS];
+  int i;
+  if (step->nnames == 0) {
+    return 0;
+  }
+  for (i=0; i<step->nnames; i++) {
+    keys[i] = step->names[i].name;
+    lens[i] = step->names[i].len;
+  }
+  return keyset_create(keys, lens, step->nnames, &step->keys);
+}
+
+/*
+ * staj_paths_compile
+ *
+ * Compile path expressions into a set that can be matched against
+ * documents with staj_paths_run. An expression starts with $ (the
+ * document itself) followed by any number of steps: .name or ['name']
+ * for a property, [n] for an array item, .* and [*] for any property
+ * or any array item respectively.
+ *
+ * exprs - path expressions, at most STAJ_MAX_PATHS
+ * n - number of expressions
+ * paths - receives the compiled set
+ *
+ * returns 0 on success, otherwise -1 and sets errno to STAJ_EINVAL if an
+ * expression is malformed or to STAJ_ENOMEM
+ */
+int staj_paths_compile(const char** exprs, int n, staj_paths** paths) {
+  int i;
+  int r;
+  if (n < 0 || n > STAJ_MAX_PATHS) {
+    errno = STAJ_EINVAL;
+    return -1;
+  }
+  staj_paths* ps = (staj_paths*) calloc(1, sizeof(staj_paths));
+  if (ps == NULL) {
+    errno = STAJ_ENOMEM;
+    return -1;
+  }
+  ps->npaths = n;
+  for (i=0; i<n; i++) {
+    if ((r = compile_path(ps, exprs[i], i)) != 0) {
+      staj_paths_release(ps);
+      errno = r;
+      return -1;
+    }
+    ps->all |= (uint64_t) 1 << i;
+  }
+  for (i=0; i<ps->depth; i++) {
+    if ((r = compile_names(&ps->steps[i])) != 0) {
+      staj_paths_release(ps);
+      errno = r;
+      return -1;
+    }
+  }
+  *paths = ps;
+  return 0;
+}
+
+/*
+ * staj_paths_release
+ *
+ * Free a compiled path set
+ */
+int staj_paths_release(staj_paths* paths) {
+  int d;
+  int i;
+  for (d=0; d<STAJ_MAX_PATH_DEPTH; d++) {
+    for (i=0; i<paths->steps[d].nnames; i++) {
+      free(paths->steps[d].names[i].name);
+    }
+    free(paths->steps[d].names);
+    free(paths->steps[d].indexes);
+    if (paths->steps[d].keys != NULL) {
+      staj_keyset_release(paths->steps[d].keys);
+    }
+  }
+  free(paths);
+  return 0;
+}
+
+/*
+ * Paths of the step that accept the current property name. Returns 0
+ * or -1 if the name cannot be decoded.
+ */
+static inline
+int match_name(const struct staj_path_step* step, staj_context* ctx, uint64_t* m) {
+  int i;
+  if (step->keys == NULL) {
+    *m = step->any_name;
+    return 0;
+  }
+  if ((i = match_key(ctx, step->keys)) == -2) {
+    errno = STAJ_ENOMEM;
+    return -1;
+  }
+  *m = i < 0 ? step->any_name : step->any_name | step->names[i].mask;
+  return 0;
+}
+
+static inline
+uint64_t match_index(const struct staj_path_step* step, long int index) {
+  uint64_t m = step->any_index;
+  int i;
+  for (i=0; i<step->nindexes; i++) {
+    if (step->indexes[i].index == index) {
+      return m | step->indexes[i].mask;
+    }
+  }
+  return m;
+}
+
+/*
+ * staj_paths_run
+ *
+ * Read the next document from the context and call back for every
+ * value that matches one of the paths. Subtrees no path can match are
+ * skipped with staj_skip_value.
+ *
+ * paths - compiled path set. It is not modified, so one set may be run
+ *   on several contexts at the same time
+ * ctx - StAJ context at the start of a document
+ * callback - called with ud, the number of the matching path and the
+ *   context whose current token is the first token of the value. The
+ *   callback may read the token and, if the value is an object or an
+ *   array, consume it up to its closing bracket (e.g. with
+ *   staj_skip_value). A non-zero result stops the run.
+ * ud - passed to the callback as is
+ *
+ * returns 0 when the document has been read (or the input is over),
+ * -1 on error with errno set, or the non-zero result of the callback
+ */
+int staj_paths_run(const staj_paths* paths, staj_context* ctx,
+                   int (*callback)(void*, int, staj_context*), void* ud) {
+  uint64_t alive[STAJ_MAX_PATH_DEPTH + 2];
+  uint64_t pending[STAJ_MAX_PATH_DEPTH + 2];
+  long int index[STAJ_MAX_PATH_DEPTH + 2];
+  char is_array[STAJ_MAX_PATH_DEPTH + 2];
+  int base = ctx->curr_context_stack_ptr;
+  uint64_t m;
+  uint64_t done;
+  int token;
+  int d;
+  int r;
+
+  for (;;) {
+    if (staj_next(ctx) != 0) {
+      return -1;
+    }
+    token = ctx->token;
+    /* the depth of the value comes from the context stack */
+    d = ctx->curr_context_stack_ptr - base;
+    switch (token) {
+    case STAJ_EOF:
+      return 0;
+    case STAJ_END_DOCUMENT: /* left from the previous document */
+      continue;
+    case STAJ_END_OBJECT:
+    case STAJ_END_ARRAY:
+      if (d == 0) {
+        return 0;
+      }
+      continue;
+    case STAJ_PROPERTY_NAME:
+      if (match_name(&paths->steps[d - 1], ctx, &m) != 0) {
+        return -1;
+      }
+      m &= alive[d];
+      if (m == 0) {
+        if (staj_skip_value(ctx) != 0) {
+          return -1;
+        }
+      }
+      pending[d] = m;
+      continue;
+    case STAJ_BEGIN_OBJECT:
+    case STAJ_BEGIN_ARRAY:
+      d --;
+      break;
+    }
+
+    if (d == 0) {
+      m = paths->all;
+    } else
+    if (is_array[d]) {
+      m = alive[d] & match_index(&paths->steps[d - 1], index[d]);
+      index[d] ++;
+    } else {
+      m = pending[d];
+    }
+
+    done = m & paths->ends[d];
+    while (done != 0) {
+      if ((r = callback(ud, ctz64(done), ctx)) != 0) {
+        return r;
+      }
+      done &= done - 1;
+    }
+    if (ctx->token != token) {
+      /* the callback has consumed the value */
+      if (ctx->curr_context_stack_ptr == base) {
+        return 0;
+      }
+      continue;
+    }
+
+    if (token == STAJ_BEGIN_OBJECT || token == STAJ_BEGIN_ARRAY) {
+      m &= ~paths->ends[d];
+      if (m != 0) {
+        alive[d + 1] = m;
+        is_array[d + 1] = token == STAJ_BEGIN_ARRAY;
+        index[d + 1] = 0;
+        continue;
+      }
+      if (staj_skip_value(ctx) != 0) {
+        return -1;
+      }
+    }
+    if (d == 0) {
+      return 0;
+    }
+  }
+}
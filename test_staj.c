@@ -25,6 +25,8 @@
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
+#include <unistd.h>
+#include <limits.h>
 #include "staj.h"
 
 #define assert(t,s,p) if (!(p)) { tests[t] = 0; fprintf(stderr, "%s:%d:test %d failed:%s\n", __FILE__, __LINE__, t, s); } else { tests[t] = 1; }
@@ -44,6 +46,13 @@ char* TEST1 = "{ \"a\" : { \"b\" : [ 1, { \"c\" : [ 2 ] } ] } }";
 char* TEST2 = "{ \"value\": \"something\", \"b\" : [ 212, 3 ] }";
 char* TEST3 = "{ \"string\": \"\\tsome\\u000A\\\\thing\"  }";
 char* TEST4 = "{ \"int\": 123, \"long\" : 123456789123456, \"float\" : 1.23, \"double\" : 1.23e-10, \"bool1\" : true, \"bool2\" : false }";
+char* TEST5 = "\r\n{\n\t\"a\" :\n                                        [\n\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t1 ,\r\n                \"x\"\n                                                                      ]\n}\n                                  ";
+char* TEST6 = "{ \"items\" : [ 1, 22, 333, true, false, null, \"four\", { \"k\" : [ ] } ], \"long\" : \"0123456789abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrstuvwxyz\" }";
+char* TEST7 = "[ 0, -0, 7, -123, 9223372036854775807, -9223372036854775808, 2147483648 ]";
+char* TEST8 = "[ 0.1, -0, 1e23, 2.2250738585072014e-308, 5e-324, 1.7976931348623157e308, 9007199254740993, 123456789012345678901234567890e-10, 1e400 ]";
+char* TEST9 = "{\"a\":1}\n[2]\n{}\n{\"b\":[true,null]}{}  \n";
+char* TEST10 = "{ \"skip\" : { \"a\" : [ 1, { \"b\" : \"}]\\\"[{\" } ], \"c\" : {} }, \"keep\" : [ [ \"x\" ], 7 ], \"last\" : true }";
+char* TEST11 = "{ \"user\" : { \"id\" : 42, \"tags\" : [ \"a\", { \"id\" : 0 } ] }, \"na\\u006De\" : \"n\", \"events\" : [ { \"ts\" : 1, \"kind\" : \"x\" }, { \"kind\" : \"y\", \"ts\" : 2 }, [ ] ], \"meta\" : { \"id\" : 9 } }\n{ \"user\" : { \"id\" : 43 } }\n";
 
 static inline
 void print_parse_error_1(const char* buf, const int pos, const char* file, const int line) {
@@ -330,6 +339,1735 @@ void test4(int test) {
   test4_exit:
     staj_release_context(ctx);
 }
+
+void test5(int test) {
+  staj_token_type tokens[] = {
+    STAJ_BEGIN_OBJECT,
+      STAJ_PROPERTY_NAME,
+      STAJ_BEGIN_ARRAY,
+        STAJ_NUMBER,
+        STAJ_STRING,
+      STAJ_END_ARRAY,
+    STAJ_END_OBJECT
+  };
+  int ntokens = 7;
+  int n = 0;
+  int r;
+  tests[test] = 1;
+  staj_context* ctx;
+  staj_parse_buffer(TEST5, &ctx);
+  while (staj_has_next(ctx)) {
+    r = staj_next(ctx);
+    if (r != 0) {
+      fprintf(stderr, "%s:%d:errno=%d\n", __FILE__, __LINE__, errno);
+      if (r == STAJ_EPARSE) {
+        print_parse_error_2(staj_get_parse_error(ctx), __FILE__, __LINE__);
+        print_parse_error_1(TEST5, ctx->current_pos, __FILE__, __LINE__);
+      }
+    }
+    assert(test, "staj_next != 0", r == 0);
+    if (!tests[test]) goto test5_exit;
+    staj_token_type t = staj_get_token(ctx);
+    assert(test, "too many tokens", n < ntokens);
+    if (!tests[test]) goto test5_exit;
+    assert(test, "unexpected token", tokens[n++] == t);
+    if (!tests[test]) goto test5_exit;
+  }
+  assert(test, "not enough tokens", n == ntokens);
+  if (!tests[test]) goto test5_exit;
+  test5_exit:
+    staj_release_context(ctx);
+}
+
+struct chunked_source {
+  char* buf;
+  int len;
+  int pos;
+  int chunk;
+  int released;
+};
+
+static
+int chunked_next_buffer(void* ctx, int* len, const char** buf) {
+  struct chunked_source* s = (struct chunked_source*) ctx;
+  *buf = s->buf + s->pos;
+  *len = s->len - s->pos < s->chunk ? s->len - s->pos : s->chunk;
+  s->pos += *len;
+  return 0;
+}
+
+static
+int chunked_release_buffer(void* ctx, int len, const char* buf) {
+  struct chunked_source* s = (struct chunked_source*) ctx;
+  s->released += len;
+  return 0;
+}
+
+void test6(int test) {
+  struct chunked_source src = { TEST6, strlen(TEST6), 0, 3, 0 };
+  int ntokens = 0;
+  int r = 0;
+  tests[test] = 1;
+  staj_context* ctx;
+  staj_parse_stream(&chunked_next_buffer, NULL, &src, 4, &ctx);
+  while (staj_has_next(ctx)) {
+    r = staj_next(ctx);
+    if (r != 0) {
+      break;
+    }
+  }
+  assert(test, "fixed buffers must be exhausted", r != 0 && errno == STAJ_ENOMEM);
+  staj_release_context(ctx);
+  if (!tests[test]) return;
+
+  src.pos = 0;
+  staj_parse_stream(&chunked_next_buffer, &chunked_release_buffer, &src, 4, &ctx);
+  while (staj_has_next(ctx)) {
+    r = staj_next(ctx);
+    if (r != 0) {
+      fprintf(stderr, "%s:%d:errno=%d\n", __FILE__, __LINE__, errno);
+    }
+    assert(test, "staj_next != 0", r == 0);
+    if (!tests[test]) goto test6_exit;
+    ntokens ++;
+    if (ntokens == 18) {
+      char buf[100];
+      int l = staj_get_length(ctx);
+      assert(test, "long string length", l == 74);
+      if (!tests[test]) goto test6_exit;
+      staj_get_text(ctx, buf, 100);
+      assert(test, "long string text", strncmp(buf, "\"0123456789abcdefghijklmnopqrstuvwxyz0123456789", 47) == 0);
+      if (!tests[test]) goto test6_exit;
+    }
+  }
+  assert(test, "not enough tokens", ntokens == 19);
+  if (!tests[test]) goto test6_exit;
+  assert(test, "buffers were not recycled", src.released > 0 && src.released < src.len);
+  if (!tests[test]) goto test6_exit;
+  test6_exit:
+    staj_release_context(ctx);
+  if (tests[test]) {
+    assert(test, "not all buffers released", src.released == src.len);
+  }
+}
+
+void test7(int test) {
+  int fds[2];
+  int ntokens = 0;
+  int r;
+  tests[test] = 1;
+  staj_context* ctx;
+  assert(test, "pipe", pipe(fds) == 0);
+  if (!tests[test]) return;
+  assert(test, "write", write(fds[1], TEST6, strlen(TEST6)) == strlen(TEST6));
+  close(fds[1]);
+  if (!tests[test]) goto test7_exit;
+  staj_parse_fd(fds[0], 5, &ctx);
+  while (staj_has_next(ctx)) {
+    r = staj_next(ctx);
+    if (r != 0) {
+      fprintf(stderr, "%s:%d:errno=%d\n", __FILE__, __LINE__, errno);
+    }
+    assert(test, "staj_next != 0", r == 0);
+    if (!tests[test]) break;
+    ntokens ++;
+    if (ntokens == 18) {
+      char buf[100];
+      int l = staj_get_length(ctx);
+      assert(test, "long string length", l == 74);
+      if (!tests[test]) break;
+      staj_get_text(ctx, buf, 100);
+      assert(test, "long string text", strncmp(buf, "\"0123456789abcdefghijklmnopqrstuvwxyz0123456789", 47) == 0);
+      if (!tests[test]) break;
+    }
+  }
+  staj_release_context(ctx);
+  if (!tests[test]) goto test7_exit;
+  assert(test, "not enough tokens", ntokens == 19);
+  test7_exit:
+    close(fds[0]);
+}
+
+void test8(int test) {
+  char path[] = "/tmp/test_staj_XXXXXX";
+  int flags;
+  int r;
+  tests[test] = 1;
+  int fd = mkstemp(path);
+  assert(test, "mkstemp", fd >= 0);
+  if (!tests[test]) return;
+  assert(test, "write", write(fd, TEST6, strlen(TEST6)) == strlen(TEST6));
+  close(fd);
+  if (!tests[test]) goto test8_exit;
+  for (flags = 0; flags <= STAJ_MMAP_RELEASE; flags++) {
+    int ntokens = 0;
+    staj_context* ctx;
+    assert(test, "staj_parse_file != 0", staj_parse_file(path, flags, &ctx) == 0);
+    if (!tests[test]) goto test8_exit;
+    while (staj_has_next(ctx)) {
+      r = staj_next(ctx);
+      if (r != 0) {
+        fprintf(stderr, "%s:%d:errno=%d\n", __FILE__, __LINE__, errno);
+      }
+      assert(test, "staj_next != 0", r == 0);
+      if (!tests[test]) break;
+      ntokens ++;
+    }
+    staj_release_context(ctx);
+    if (!tests[test]) goto test8_exit;
+    assert(test, "not enough tokens", ntokens == 19);
+    if (!tests[test]) goto test8_exit;
+  }
+  test8_exit:
+    unlink(path);
+}
+
+void test9(int test) {
+  /* not null-terminated, followed by garbage and a NUL byte */
+  const char frame[] = { '[', '"', 'a', '"', ',', '1', ']', '\0', 'x', 'y' };
+  staj_token_type tokens[] = {
+    STAJ_BEGIN_ARRAY,
+      STAJ_STRING,
+      STAJ_NUMBER,
+    STAJ_END_ARRAY
+  };
+  int ntokens = 4;
+  int n = 0;
+  int r = 0;
+  tests[test] = 1;
+  staj_context* ctx;
+  staj_parse_buffer_len(frame, 7, &ctx);
+  while (staj_has_next(ctx)) {
+    r = staj_next(ctx);
+    assert(test, "staj_next != 0", r == 0);
+    if (!tests[test]) goto test9_exit;
+    assert(test, "too many tokens", n < ntokens);
+    if (!tests[test]) goto test9_exit;
+    assert(test, "unexpected token", tokens[n++] == staj_get_token(ctx));
+    if (!tests[test]) goto test9_exit;
+  }
+  assert(test, "not enough tokens", n == ntokens);
+  staj_release_context(ctx);
+  if (!tests[test]) return;
+
+  /* NUL byte is data, not the end of the input */
+  staj_parse_buffer_len(frame, 8, &ctx);
+  while (staj_has_next(ctx)) {
+    r = staj_next(ctx);
+    if (r != 0) {
+      break;
+    }
+  }
+  assert(test, "NUL byte after the document is not an error", r != 0 && errno == STAJ_EPARSE &&
+      staj_get_parse_error(ctx) == STAJ_UNEXPECTED_SYMBOL);
+  test9_exit:
+    staj_release_context(ctx);
+}
+
+void test10(int test) {
+  struct chunked_source src = { TEST6, strlen(TEST6), 0, 7, 0 };
+  int ntokens = 0;
+  int r;
+  tests[test] = 1;
+  staj_context* ctx;
+  staj_parse_stream(&chunked_next_buffer, NULL, &src, 100, &ctx);
+  while (staj_has_next(ctx)) {
+    const char* p;
+    int l;
+    char buf[100];
+    staj_interval iov[20];
+    r = staj_next(ctx);
+    assert(test, "staj_next != 0", r == 0);
+    if (!tests[test]) goto test10_exit;
+    ntokens ++;
+    int n = staj_get_intervals(ctx, iov, 20);
+    int len = staj_get_length(ctx);
+    staj_get_text(ctx, buf, 100);
+    assert(test, "staj_get_intervals", n >= 1 && n <= 20);
+    if (!tests[test]) goto test10_exit;
+    if (staj_get_view(ctx, &p, &l) == 0) {
+      assert(test, "contiguous token must have one interval", n == 1);
+      if (!tests[test]) goto test10_exit;
+      assert(test, "view mismatch", l == len && memcmp(p, buf, l) == 0);
+      if (!tests[test]) goto test10_exit;
+    } else {
+      int i;
+      int off = 0;
+      assert(test, "token spans buffers", n > 1 && errno == STAJ_EINVAL);
+      if (!tests[test]) goto test10_exit;
+      for (i=0; i<n; i++) {
+        assert(test, "interval mismatch", memcmp(iov[i].buffer + iov[i].start, buf + off, iov[i].length) == 0);
+        if (!tests[test]) goto test10_exit;
+        off += iov[i].length;
+      }
+      assert(test, "intervals length", off == len);
+      if (!tests[test]) goto test10_exit;
+    }
+  }
+  assert(test, "not enough tokens", ntokens == 19);
+  test10_exit:
+    staj_release_context(ctx);
+}
+
+void test11(int test) {
+  long long int expected[] = { 0, 0, 7, -123, LLONG_MAX, LLONG_MIN, 2147483648LL };
+  int n = 0;
+  int r;
+  tests[test] = 1;
+  struct chunked_source src = { TEST7, strlen(TEST7), 0, 4, 0 };
+  staj_context* ctx;
+  staj_parse_stream(&chunked_next_buffer, NULL, &src, 100, &ctx);
+  while (staj_has_next(ctx)) {
+    r = staj_next(ctx);
+    assert(test, "staj_next != 0", r == 0);
+    if (!tests[test]) goto test11_exit;
+    if (staj_get_token(ctx) != STAJ_NUMBER) {
+      continue;
+    }
+    long long int v;
+    if (n < 7) {
+      assert(test, "staj_toll != 0", staj_toll(ctx, &v) == 0);
+      if (!tests[test]) goto test11_exit;
+      assert(test, "staj_toll value", v == expected[n]);
+      if (!tests[test]) goto test11_exit;
+      if (n == 6) {
+        int i;
+        assert(test, "staj_toi must overflow", staj_toi(ctx, &i) != 0 && errno == STAJ_EINVAL);
+        if (!tests[test]) goto test11_exit;
+        break;
+      }
+    }
+    n ++;
+  }
+  staj_release_context(ctx);
+
+  /* conversion errors are sticky, use a fresh context for each */
+  for (n=0; n<2; n++) {
+    long long int v;
+    staj_parse_buffer(n == 0 ? "[1.5]" : "[9223372036854775808]", &ctx);
+    staj_next(ctx);
+    staj_next(ctx);
+    assert(test, "staj_toll must fail", staj_toll(ctx, &v) != 0 && errno == STAJ_EINVAL);
+    staj_release_context(ctx);
+    if (!tests[test]) return;
+  }
+  return;
+  test11_exit:
+    staj_release_context(ctx);
+}
+
+void test12(int test) {
+  double expected[] = { 0.1, -0.0, 1e23, 2.2250738585072014e-308, 5e-324,
+                        1.7976931348623157e308, 9007199254740993.0,
+                        123456789012345678901234567890e-10, HUGE_VAL };
+  float expected_f[] = { 0.1f, -0.0f, 1e23f, 0.0f, 0.0f, HUGE_VALF,
+                         9007199254740993.0f, 123456789012345678901234567890e-10f, HUGE_VALF };
+  int n = 0;
+  int r;
+  tests[test] = 1;
+  struct chunked_source src = { TEST8, strlen(TEST8), 0, 5, 0 };
+  staj_context* ctx;
+  staj_parse_stream(&chunked_next_buffer, NULL, &src, 100, &ctx);
+  while (staj_has_next(ctx)) {
+    r = staj_next(ctx);
+    assert(test, "staj_next != 0", r == 0);
+    if (!tests[test]) goto test12_exit;
+    if (staj_get_token(ctx) != STAJ_NUMBER) {
+      continue;
+    }
+    double d;
+    float f;
+    assert(test, "staj_tod != 0", staj_tod(ctx, &d) == 0);
+    if (!tests[test]) goto test12_exit;
+    assert(test, "staj_tod is not correctly rounded", memcmp(&d, &expected[n], sizeof(d)) == 0);
+    if (!tests[test]) goto test12_exit;
+    assert(test, "staj_tof != 0", staj_tof(ctx, &f) == 0);
+    if (!tests[test]) goto test12_exit;
+    assert(test, "staj_tof is not correctly rounded", memcmp(&f, &expected_f[n], sizeof(f)) == 0);
+    if (!tests[test]) goto test12_exit;
+    n ++;
+  }
+  assert(test, "not enough numbers", n == 9);
+  test12_exit:
+    staj_release_context(ctx);
+}
+
+struct counting_allocator {
+  int allocs;
+  int frees;
+};
+
+static
+void* counting_alloc(void* ud, size_t size) {
+  ((struct counting_allocator*) ud)->allocs ++;
+  return malloc(size);
+}
+
+static
+void* counting_resize(void* ud, void* ptr, size_t size) {
+  if (ptr == NULL) {
+    ((struct counting_allocator*) ud)->allocs ++;
+  }
+  return realloc(ptr, size);
+}
+
+static
+void counting_release(void* ud, void* ptr) {
+  if (ptr != NULL) {
+    ((struct counting_allocator*) ud)->frees ++;
+  }
+  free(ptr);
+}
+
+void test13(int test) {
+  struct counting_allocator counts = { 0, 0 };
+  staj_allocator allocator = { &counting_alloc, &counting_resize, &counting_release, &counts };
+  staj_context ctx;
+  int ntokens = 0;
+  int r;
+  tests[test] = 1;
+
+  staj_init_buffer(&ctx, TEST4, strlen(TEST4), &allocator);
+  while (staj_has_next(&ctx)) {
+    r = staj_next(&ctx);
+    assert(test, "staj_next != 0", r == 0);
+    if (!tests[test]) break;
+    if (staj_get_token(&ctx) == STAJ_NUMBER) {
+      double d;
+      assert(test, "staj_tod != 0", staj_tod(&ctx, &d) == 0);
+      if (!tests[test]) break;
+    }
+    ntokens ++;
+  }
+  staj_deinit_context(&ctx);
+  if (!tests[test]) return;
+  assert(test, "not enough tokens", ntokens == 14);
+  if (!tests[test]) return;
+  assert(test, "a single buffer must not allocate", counts.allocs == 0);
+  if (!tests[test]) return;
+
+  struct chunked_source src = { TEST6, strlen(TEST6), 0, 3, 0 };
+  ntokens = 0;
+  staj_init_stream(&ctx, &chunked_next_buffer, &chunked_release_buffer, &src, 2, &allocator);
+  while (staj_has_next(&ctx)) {
+    r = staj_next(&ctx);
+    assert(test, "staj_next != 0", r == 0);
+    if (!tests[test]) break;
+    ntokens ++;
+  }
+  staj_deinit_context(&ctx);
+  if (!tests[test]) return;
+  assert(test, "not enough tokens", ntokens == 19);
+  if (!tests[test]) return;
+  assert(test, "window must grow through the allocator", counts.allocs > 0);
+  if (!tests[test]) return;
+  assert(test, "leak", counts.allocs == counts.frees);
+}
+
+void test14(int test) {
+  char* docs[] = { TEST0, "{ \"broken\" : ] }", TEST1, TEST2, "[ 1, 2 ]" };
+  int expected[] = { 6, -1, 15, 9, 4 };
+  staj_context ctx;
+  int i;
+  tests[test] = 1;
+  staj_init_buffer(&ctx, "", 0, NULL);
+  for (i=0; i<5; i++) {
+    int ntokens = 0;
+    int r = 0;
+    staj_reset_buffer(&ctx, docs[i], strlen(docs[i]));
+    while (staj_has_next(&ctx)) {
+      r = staj_next(&ctx);
+      if (r != 0) {
+        break;
+      }
+      ntokens ++;
+    }
+    if (expected[i] < 0) {
+      assert(test, "broken document must fail", r != 0 && errno == STAJ_EPARSE);
+    } else {
+      assert(test, "staj_next != 0", r == 0);
+      if (!tests[test]) break;
+      assert(test, "token count", ntokens == expected[i]);
+    }
+    if (!tests[test]) break;
+  }
+  staj_deinit_context(&ctx);
+}
+
+void test15(int test) {
+  staj_token_type expected[] = {
+    STAJ_BEGIN_OBJECT, STAJ_PROPERTY_NAME, STAJ_NUMBER, STAJ_END_OBJECT, STAJ_END_DOCUMENT,
+    STAJ_BEGIN_ARRAY, STAJ_NUMBER, STAJ_END_ARRAY, STAJ_END_DOCUMENT,
+    STAJ_BEGIN_OBJECT, STAJ_END_OBJECT, STAJ_END_DOCUMENT,
+    STAJ_BEGIN_OBJECT, STAJ_PROPERTY_NAME, STAJ_BEGIN_ARRAY, STAJ_BOOLEAN, STAJ_NULL,
+    STAJ_END_ARRAY, STAJ_END_OBJECT, STAJ_END_DOCUMENT,
+    STAJ_BEGIN_OBJECT, STAJ_END_OBJECT, STAJ_END_DOCUMENT,
+    STAJ_EOF
+  };
+  int n = sizeof(expected) / sizeof(expected[0]);
+  struct chunked_source src = { TEST9, strlen(TEST9), 0, 3, 0 };
+  staj_context* ctx;
+  int i;
+  int pass;
+  tests[test] = 1;
+  for (pass=0; pass<2; pass++) {
+    if (pass == 0) {
+      staj_parse_buffer(TEST9, &ctx);
+    } else {
+      staj_parse_stream(&chunked_next_buffer, &chunked_release_buffer, &src, 4, &ctx);
+    }
+    staj_set_flags(ctx, STAJ_MULTI_DOCUMENT);
+    for (i=0; i<n-1; i++) {
+      assert(test, "staj_has_next", staj_has_next(ctx) == 1);
+      if (!tests[test]) goto test15_exit;
+      assert(test, "staj_next != 0", staj_next(ctx) == 0);
+      if (!tests[test]) goto test15_exit;
+      assert(test, "token type", staj_get_token(ctx) == expected[i]);
+      if (!tests[test]) goto test15_exit;
+    }
+    assert(test, "no more documents", staj_has_next(ctx) == 0);
+    if (!tests[test]) goto test15_exit;
+    assert(test, "EOF", staj_next(ctx) == 0 && staj_get_token(ctx) == STAJ_EOF);
+    if (!tests[test]) goto test15_exit;
+    staj_release_context(ctx);
+  }
+
+  staj_parse_buffer("{}\n{]", &ctx);
+  staj_set_flags(ctx, STAJ_MULTI_DOCUMENT);
+  for (i=0; i<4; i++) {
+    assert(test, "staj_next != 0", staj_next(ctx) == 0);
+    if (!tests[test]) goto test15_exit;
+  }
+  assert(test, "broken second document must fail",
+         staj_next(ctx) != 0 && errno == STAJ_EPARSE);
+
+test15_exit:
+  staj_release_context(ctx);
+}
+
+void test16(int test) {
+  struct chunked_source src = { TEST10, strlen(TEST10), 0, 3, 0 };
+  staj_context* ctx;
+  char buf[32];
+  int pass;
+  tests[test] = 1;
+  for (pass=0; pass<2; pass++) {
+    if (pass == 0) {
+      staj_parse_buffer(TEST10, &ctx);
+    } else {
+      staj_parse_stream(&chunked_next_buffer, &chunked_release_buffer, &src, 4, &ctx);
+    }
+    /* skip a property value from its name */
+    assert(test, "begin object", staj_next(ctx) == 0 && staj_get_token(ctx) == STAJ_BEGIN_OBJECT);
+    if (!tests[test]) goto test16_exit;
+    assert(test, "property name", staj_next(ctx) == 0 && staj_get_token(ctx) == STAJ_PROPERTY_NAME);
+    if (!tests[test]) goto test16_exit;
+    assert(test, "skip object", staj_skip_value(ctx) == 0 && staj_get_token(ctx) == STAJ_END_OBJECT);
+    if (!tests[test]) goto test16_exit;
+    assert(test, "property name", staj_next(ctx) == 0 && staj_get_token(ctx) == STAJ_PROPERTY_NAME);
+    if (!tests[test]) goto test16_exit;
+    assert(test, "staj_tostr", staj_tostr(ctx, buf, sizeof(buf)) >= 0 && strcmp(buf, "keep") == 0);
+    if (!tests[test]) goto test16_exit;
+    /* skip an array from its begin token */
+    assert(test, "begin array", staj_next(ctx) == 0 && staj_get_token(ctx) == STAJ_BEGIN_ARRAY);
+    if (!tests[test]) goto test16_exit;
+    assert(test, "begin array", staj_next(ctx) == 0 && staj_get_token(ctx) == STAJ_BEGIN_ARRAY);
+    if (!tests[test]) goto test16_exit;
+    assert(test, "skip array", staj_skip_value(ctx) == 0 && staj_get_token(ctx) == STAJ_END_ARRAY);
+    if (!tests[test]) goto test16_exit;
+    assert(test, "number", staj_next(ctx) == 0 && staj_get_token(ctx) == STAJ_NUMBER);
+    if (!tests[test]) goto test16_exit;
+    /* a scalar is already consumed */
+    assert(test, "skip scalar", staj_skip_value(ctx) == 0 && staj_get_token(ctx) == STAJ_NUMBER);
+    if (!tests[test]) goto test16_exit;
+    assert(test, "end array", staj_next(ctx) == 0 && staj_get_token(ctx) == STAJ_END_ARRAY);
+    if (!tests[test]) goto test16_exit;
+    assert(test, "property name", staj_next(ctx) == 0 && staj_get_token(ctx) == STAJ_PROPERTY_NAME);
+    if (!tests[test]) goto test16_exit;
+    assert(test, "skip boolean", staj_skip_value(ctx) == 0 && staj_get_token(ctx) == STAJ_BOOLEAN);
+    if (!tests[test]) goto test16_exit;
+    assert(test, "end object", staj_next(ctx) == 0 && staj_get_token(ctx) == STAJ_END_OBJECT);
+    if (!tests[test]) goto test16_exit;
+    assert(test, "EOF", staj_has_next(ctx) == 0);
+    if (!tests[test]) goto test16_exit;
+    staj_release_context(ctx);
+  }
+
+  staj_parse_buffer("[ { \"a\" : [ 1 } ]", &ctx);
+  staj_next(ctx);
+  staj_next(ctx);
+  assert(test, "mismatched bracket must fail",
+         staj_skip_value(ctx) != 0 && errno == STAJ_EPARSE);
+  if (!tests[test]) goto test16_exit;
+  staj_release_context(ctx);
+
+  staj_parse_buffer("[ [ \"]", &ctx);
+  staj_next(ctx);
+  staj_next(ctx);
+  assert(test, "unterminated value must fail",
+         staj_skip_value(ctx) != 0 && errno == STAJ_EPARSE &&
+         staj_get_parse_error(ctx) == STAJ_UNEXPECTED_EOF);
+
+test16_exit:
+  staj_release_context(ctx);
+}
+
+struct path_matches {
+  char text[256];
+  int len;
+};
+
+int path_callback(void* ud, int path, staj_context* ctx) {
+  struct path_matches* pm = (struct path_matches*) ud;
+  pm->len += sprintf(pm->text + pm->len, "%d=", path);
+  if (staj_get_token(ctx) == STAJ_BEGIN_OBJECT) {
+    /* take the whole object */
+    if (staj_skip_value(ctx) != 0) {
+      return -1;
+    }
+    pm->len += sprintf(pm->text + pm->len, "{} ");
+  } else {
+    pm->len += staj_get_text(ctx, pm->text + pm->len, 32);
+    pm->text[pm->len++] = ' ';
+    pm->text[pm->len] = 0;
+  }
+  return 0;
+}
+
+void test17(int test) {
+  const char* exprs[] = { "$.user.id", "$.events[*].ts", "$.events[1].kind", "$['name']", "$.meta", "$.meta.id" };
+  const char* bad[] = { "user.id", "$.", "$[1", "$.a[x]" };
+  struct path_matches pm;
+  staj_paths* paths;
+  staj_context* ctx;
+  int i;
+  tests[test] = 1;
+  for (i=0; i<4; i++) {
+    assert(test, "malformed path must fail",
+           staj_paths_compile(&bad[i], 1, &paths) != 0 && errno == STAJ_EINVAL);
+    if (!tests[test]) return;
+  }
+  assert(test, "staj_paths_compile", staj_paths_compile(exprs, 6, &paths) == 0);
+  if (!tests[test]) return;
+  staj_parse_buffer(TEST11, &ctx);
+  staj_set_flags(ctx, STAJ_MULTI_DOCUMENT);
+
+  pm.len = 0;
+  pm.text[0] = 0;
+  assert(test, "staj_paths_run", staj_paths_run(paths, ctx, &path_callback, &pm) == 0);
+  if (!tests[test]) goto test17_exit;
+  assert(test, "matches", strcmp(pm.text, "0=42 3=\"n\" 1=1 2=\"y\" 1=2 4={} ") == 0);
+  if (!tests[test]) goto test17_exit;
+
+  pm.len = 0;
+  pm.text[0] = 0;
+  assert(test, "staj_paths_run", staj_paths_run(paths, ctx, &path_callback, &pm) == 0);
+  if (!tests[test]) goto test17_exit;
+  assert(test, "matches", strcmp(pm.text, "0=43 ") == 0);
+  if (!tests[test]) goto test17_exit;
+
+  pm.len = 0;
+  pm.text[0] = 0;
+  assert(test, "end of input", staj_paths_run(paths, ctx, &path_callback, &pm) == 0 && pm.len == 0);
+
+test17_exit:
+  staj_release_context(ctx);
+  staj_paths_release(paths);
+}
+
+/*
+ * Many keys of the same length with a common prefix, and escaped
+ * tokens longer than every key
+ */
+static
+void test18_many(int test) {
+  const int nkeys = 5000;
+  char** names = calloc(nkeys + 1, sizeof(char*));
+  char* doc = malloc(nkeys * 24 + 100);
+  staj_keyset* keyset = NULL;
+  staj_context* ctx = NULL;
+  int len = 0;
+  int n = 0;
+  int i;
+  for (i=0; i<nkeys; i++) {
+    names[i] = malloc(16);
+    sprintf(names[i], "field_%05d", i);
+  }
+  names[nkeys] = names[nkeys / 2];
+  assert(test, "repeated key among many", staj_keyset_compile((const char**) names, nkeys + 1, &keyset) != 0 &&
+         errno == STAJ_EINVAL);
+  if (!tests[test]) goto test18_many_exit;
+  assert(test, "many keys", staj_keyset_compile((const char**) names, nkeys, &keyset) == 0);
+  if (!tests[test]) goto test18_many_exit;
+  len += sprintf(doc, "{ \"\\u0066ield_000001\" : 0, \"field_000001\" : 0");
+  for (i=0; i<nkeys; i++) {
+    len += sprintf(doc + len, i % 7 == 0 ? ", \"\\u0066ield_%05d\" : 0" : ", \"field_%05d\" : 0", i);
+  }
+  sprintf(doc + len, " }");
+  staj_parse_buffer(doc, &ctx);
+  staj_next(ctx);
+  staj_next(ctx);
+  assert(test, "longer escaped token", staj_match_key(ctx, keyset) == -1);
+  if (!tests[test]) goto test18_many_exit;
+  staj_next(ctx);
+  staj_next(ctx);
+  assert(test, "longer token", staj_match_key(ctx, keyset) == -1);
+  if (!tests[test]) goto test18_many_exit;
+  while (staj_next(ctx) == 0 && staj_get_token(ctx) != STAJ_END_OBJECT) {
+    if (staj_get_token(ctx) == STAJ_PROPERTY_NAME) {
+      assert(test, "key index", staj_match_key(ctx, keyset) == n++);
+      if (!tests[test]) goto test18_many_exit;
+    }
+  }
+  assert(test, "all keys seen", n == nkeys);
+
+test18_many_exit:
+  if (ctx != NULL) {
+    staj_release_context(ctx);
+  }
+  if (keyset != NULL) {
+    staj_keyset_release(keyset);
+  }
+  for (i=0; i<nkeys; i++) {
+    free(names[i]);
+  }
+  free(names);
+  free(doc);
+}
+
+void test18(int test) {
+  const char* keys[] = { "id", "name", "kind", "ts", "a_rather_long_property_name", "" };
+  const char* dups[] = { "id", "ts", "id" };
+  int expected[] = { 0, 1, 3, 4, 5, -1, 2, 1 };
+  char* doc = "{ \"id\" : 1, \"name\" : 2, \"ts\" : 3, \"a_rather_long_property_name\" : 4, \"\" : 5, "
+              "\"other\" : 6, \"k\\u0069nd\" : 7, \"n\\u0061me\" : 8 }";
+  char* lazy = "[ \"name\", \"k\\u0069nd\", \"\", \"other\", \"a_rather_long_property_name_and_more\", \"ts\" ]";
+  int lazy_expected[] = { 1, 2, 5, -1, -1, 3 };
+  struct chunked_source src = { doc, strlen(doc), 0, 5, 0 };
+  staj_keyset* keyset;
+  staj_context* ctx;
+  int pass;
+  int n;
+  tests[test] = 1;
+  assert(test, "repeated key must fail",
+         staj_keyset_compile(dups, 3, &keyset) != 0 && errno == STAJ_EINVAL);
+  if (!tests[test]) return;
+  assert(test, "staj_keyset_compile", staj_keyset_compile(keys, 6, &keyset) == 0);
+  if (!tests[test]) return;
+  for (pass=0; pass<2; pass++) {
+    if (pass == 0) {
+      staj_parse_buffer(doc, &ctx);
+    } else {
+      staj_parse_stream(&chunked_next_buffer, NULL, &src, 100, &ctx);
+    }
+    n = 0;
+    while (staj_has_next(ctx)) {
+      assert(test, "staj_next != 0", staj_next(ctx) == 0);
+      if (!tests[test]) goto test18_exit;
+      if (staj_get_token(ctx) == STAJ_PROPERTY_NAME) {
+        assert(test, "key index", staj_match_key(ctx, keyset) == expected[n++]);
+        if (!tests[test]) goto test18_exit;
+      } else
+      if (staj_get_token(ctx) == STAJ_NUMBER) {
+        assert(test, "values are not keys", staj_match_key(ctx, keyset) == -1);
+        if (!tests[test]) goto test18_exit;
+      }
+    }
+    assert(test, "all keys seen", n == 8);
+    if (!tests[test]) goto test18_exit;
+    staj_release_context(ctx);
+  }
+  /* lazy string values are read from the input to match them */
+  src.buf = lazy;
+  src.len = strlen(lazy);
+  src.pos = 0;
+  src.chunk = 3;
+  staj_parse_stream(&chunked_next_buffer, &chunked_release_buffer, &src, 4, &ctx);
+  staj_set_flags(ctx, STAJ_LAZY_STRINGS);
+  staj_next(ctx);
+  for (n=0; n<sizeof(lazy_expected) / sizeof(lazy_expected[0]); n++) {
+    assert(test, "lazy key index", staj_next(ctx) == 0 && staj_get_token(ctx) == STAJ_STRING &&
+           staj_match_key(ctx, keyset) == lazy_expected[n]);
+    if (!tests[test]) goto test18_exit;
+  }
+  assert(test, "after the lazy keys", staj_next(ctx) == 0 && staj_get_token(ctx) == STAJ_END_ARRAY);
+  if (!tests[test]) goto test18_exit;
+  staj_release_context(ctx);
+  staj_keyset_release(keyset);
+  test18_many(test);
+  return;
+
+test18_exit:
+  staj_release_context(ctx);
+  staj_keyset_release(keyset);
+}
+
+/*
+ * Walk a context to the end and describe its tokens in out
+ */
+int describe_tokens(staj_context* ctx, char* out, int max) {
+  int n = 0;
+  while (n < max - 64) {
+    int r = staj_next(ctx);
+    if (r != 0) {
+      n += sprintf(out + n, "E%d", staj_get_parse_error(ctx));
+      break;
+    }
+    n += sprintf(out + n, "%d:%d:%d;", staj_get_token(ctx), ctx->start_pos, staj_get_length(ctx));
+    if (staj_get_token(ctx) == STAJ_EOF) {
+      break;
+    }
+  }
+  out[n] = 0;
+  return n;
+}
+
+void test19(int test) {
+  char* docs[] = { TEST0, TEST1, TEST2, TEST3, TEST4, TEST5, TEST6, TEST7, TEST8, TEST10, TEST11,
+                   "[ \"\\\"\", \"a\\n\" ]", "{ \"a\" : [ 1, 2 }", "[ \"unterminated ]", "[ 01 ]", "[ tru ]" };
+  int ndocs = sizeof(docs) / sizeof(docs[0]);
+  /* a value in an array, in an object after a name, a closed container,
+     a property name */
+  const char* prefixes[] = { "[ 1", "[ true", "[ \"s\"", "[ [ ]", "{ \"a\" : 1", "{ \"a\" : \"s\"",
+                             "{ \"a\" : { }", "{ \"a\" : [ ]", "{ \"a\"", "[ { \"a\" : null }" };
+  /* one character of each class and whitespace; then the end of the
+     input */
+  const char* classes = "{[}]\"t1,:x\x01 ";
+  static char a[8192], b[8192];
+  staj_context* c1;
+  staj_context* c2;
+  staj_context ctx;
+  char* big;
+  int len;
+  int i;
+  tests[test] = 1;
+  for (i=0; i<ndocs; i++) {
+    staj_parse_buffer(docs[i], &c1);
+    staj_parse_indexed(docs[i], strlen(docs[i]), &c2);
+    describe_tokens(c1, a, sizeof(a));
+    describe_tokens(c2, b, sizeof(b));
+    staj_release_context(c1);
+    staj_release_context(c2);
+    assert(test, "indexed tokens differ", strcmp(a, b) == 0);
+    if (!tests[test]) return;
+  }
+  /* every class of separator after every kind of token, in both engines */
+  for (i=0; i<sizeof(prefixes) / sizeof(prefixes[0]); i++) {
+    int j;
+    for (j=0; j<=strlen(classes); j++) {
+      char doc[64];
+      if (j < strlen(classes)) {
+        len = sprintf(doc, "%s%c \"b\" : 2 ] }", prefixes[i], classes[j]);
+      } else {
+        len = sprintf(doc, "%s", prefixes[i]);
+      }
+      staj_parse_buffer_len(doc, len, &c1);
+      staj_parse_indexed(doc, len, &c2);
+      describe_tokens(c1, a, sizeof(a));
+      describe_tokens(c2, b, sizeof(b));
+      staj_release_context(c1);
+      staj_release_context(c2);
+      assert(test, "separator rows differ", strcmp(a, b) == 0);
+      if (!tests[test]) return;
+    }
+  }
+
+  /* an escaped quote does not end the string, and the char after an escape is kept */
+  staj_parse_indexed(docs[11], strlen(docs[11]), &c2);
+  staj_next(c2);
+  assert(test, "escaped quote inside a string", staj_next(c2) == 0 && staj_get_token(c2) == STAJ_STRING &&
+         staj_get_length(c2) == 4 && staj_next(c2) == 0 && staj_get_token(c2) == STAJ_STRING &&
+         staj_get_length(c2) == 5);
+  staj_release_context(c2);
+  if (!tests[test]) return;
+
+  /* a document larger than the window stage 1 indexes at once */
+  big = (char*) malloc(1 << 20);
+  len = sprintf(big, "[");
+  for (i=0; i<10000; i++) {
+    len += sprintf(big + len, "%s{ \"n\" : %d, \"s\" : \"%d\\\\\\\" [{\" }", i ? ", " : "", i, i);
+  }
+  len += sprintf(big + len, "]");
+  staj_init_indexed(&ctx, big, len, NULL);
+  staj_next(&ctx);
+  for (i=0; i<10000; i++) {
+    int v;
+    assert(test, "begin object", staj_next(&ctx) == 0 && staj_get_token(&ctx) == STAJ_BEGIN_OBJECT);
+    if (!tests[test]) goto test19_exit;
+    staj_next(&ctx);
+    assert(test, "number", staj_next(&ctx) == 0 && staj_toi(&ctx, &v) == 0 && v == i);
+    if (!tests[test]) goto test19_exit;
+    staj_next(&ctx);
+    assert(test, "string", staj_next(&ctx) == 0 && staj_get_token(&ctx) == STAJ_STRING);
+    if (!tests[test]) goto test19_exit;
+    assert(test, "end object", staj_next(&ctx) == 0 && staj_get_token(&ctx) == STAJ_END_OBJECT);
+    if (!tests[test]) goto test19_exit;
+  }
+  assert(test, "end array", staj_next(&ctx) == 0 && staj_get_token(&ctx) == STAJ_END_ARRAY);
+  if (!tests[test]) goto test19_exit;
+  assert(test, "EOF", staj_has_next(&ctx) == 0);
+  if (!tests[test]) goto test19_exit;
+
+  /* skip it all in one go */
+  staj_reset_buffer(&ctx, big, len);
+  staj_next(&ctx);
+  assert(test, "skip", staj_skip_value(&ctx) == 0 && staj_get_token(&ctx) == STAJ_END_ARRAY &&
+         ctx.start_pos == len - 1);
+  if (!tests[test]) goto test19_exit;
+
+  /* reset keeps the indexed mode */
+  staj_reset_buffer(&ctx, TEST1, strlen(TEST1));
+  assert(test, "indexed after reset", ctx.index != NULL);
+  if (!tests[test]) goto test19_exit;
+  describe_tokens(&ctx, b, sizeof(b));
+  staj_parse_buffer(TEST1, &c1);
+  describe_tokens(c1, a, sizeof(a));
+  staj_release_context(c1);
+  assert(test, "tokens after reset", strcmp(a, b) == 0);
+
+test19_exit:
+  staj_deinit_context(&ctx);
+  free(big);
+}
+
+struct ndjson_totals {
+  long sums[8];
+  long counts[8];
+  long next;
+  size_t last_offset;
+  int abort_at;
+  int bad;
+  /* array elements come with their first token read */
+  int element;
+};
+
+/*
+ * Read the id of a { "id" : n, ... } record
+ */
+int ndjson_map(void* ud, int worker, size_t offset, staj_context* ctx, void** result) {
+  struct ndjson_totals* t = (struct ndjson_totals*) ud;
+  int id;
+  if ((!t->element && staj_next(ctx) != 0) || staj_next(ctx) != 0 || staj_next(ctx) != 0 ||
+      staj_toi(ctx, &id) != 0) {
+    return 2;
+  }
+  if (id == t->abort_at) {
+    return 3;
+  }
+  t->sums[worker] += id;
+  t->counts[worker]++;
+  *result = (void*) (long) id;
+  return 0;
+}
+
+int ndjson_emit(void* ud, size_t offset, void* result) {
+  struct ndjson_totals* t = (struct ndjson_totals*) ud;
+  if ((long) result != t->next || (t->next > 0 && offset <= t->last_offset)) {
+    t->bad++;
+  }
+  t->next++;
+  t->last_offset = offset;
+  return 0;
+}
+
+void test20(int test) {
+  int nrecords = 100000;
+  char* buf = (char*) malloc(8 << 20);
+  char path[] = "/tmp/test_staj_XXXXXX";
+  struct ndjson_totals t;
+  size_t len = 0;
+  long sum = 0;
+  long count = 0;
+  int threads;
+  int fd;
+  int i;
+  tests[test] = 1;
+  for (i=0; i<nrecords; i++) {
+    len += sprintf(buf + len, "{ \"id\" : %d, \"tags\" : [ \"a\\n\", %d ] }\n%s", i, i * 2, i % 10 ? "" : " \r\n");
+  }
+  for (threads=1; threads<=4; threads+=3) {
+    memset(&t, 0, sizeof(t));
+    t.abort_at = -1;
+    assert(test, "unordered", staj_parallel_ndjson(buf, len, threads, &ndjson_map, NULL, &t) == 0);
+    if (!tests[test]) goto test20_exit;
+    for (i=0, sum=0, count=0; i<8; i++) {
+      sum += t.sums[i];
+      count += t.counts[i];
+    }
+    assert(test, "all the records", count == nrecords && sum == (long) nrecords * (nrecords - 1) / 2);
+    if (!tests[test]) goto test20_exit;
+
+    memset(&t, 0, sizeof(t));
+    t.abort_at = -1;
+    assert(test, "ordered", staj_parallel_ndjson(buf, len, threads, &ndjson_map, &ndjson_emit, &t) == 0);
+    if (!tests[test]) goto test20_exit;
+    assert(test, "in order", t.bad == 0 && t.next == nrecords);
+    if (!tests[test]) goto test20_exit;
+
+    memset(&t, 0, sizeof(t));
+    t.abort_at = 54321;
+    assert(test, "stopped", staj_parallel_ndjson(buf, len, threads, &ndjson_map, &ndjson_emit, &t) == 3);
+    if (!tests[test]) goto test20_exit;
+    assert(test, "emitted up to the stop", t.bad == 0 && t.next <= 54321);
+    if (!tests[test]) goto test20_exit;
+  }
+
+  /* no newline at the end, from a file */
+  fd = mkstemp(path);
+  assert(test, "mkstemp", fd >= 0);
+  if (!tests[test]) goto test20_exit;
+  assert(test, "write", write(fd, buf, len - 1) == len - 1);
+  close(fd);
+  if (!tests[test]) goto test20_unlink;
+  memset(&t, 0, sizeof(t));
+  t.abort_at = -1;
+  assert(test, "file", staj_parallel_file(path, 0, 4, &ndjson_map, &ndjson_emit, &t) == 0 && t.bad == 0 &&
+         t.next == nrecords);
+  if (!tests[test]) goto test20_unlink;
+  assert(test, "broken record", staj_parallel_ndjson("{ \"id\" : 1 }\n{ \"id\" ]\n", 23, 2, &ndjson_map, NULL, &t) == 2);
+  if (!tests[test]) goto test20_unlink;
+  errno = 0;
+  assert(test, "two records on a line", staj_parallel_ndjson("{ \"id\" : 1 }{ \"id\" : 2 }\n", 25, 2, &ndjson_map, NULL, &t) == -1 &&
+         errno == STAJ_EPARSE);
+  if (!tests[test]) goto test20_unlink;
+  errno = 0;
+  assert(test, "trailing garbage", staj_parallel_ndjson("{ \"id\" : 1 } x\n{ \"id\" : 2 }\n", 28, 2, &ndjson_map, NULL, &t) == -1 &&
+         errno == STAJ_EPARSE);
+  if (!tests[test]) goto test20_unlink;
+  errno = 0;
+  assert(test, "unclosed record", staj_parallel_ndjson("{ \"id\" : 1, \"a\" : [\n", 20, 2, &ndjson_map, NULL, &t) == -1 &&
+         errno == STAJ_EPARSE);
+
+test20_unlink:
+  unlink(path);
+test20_exit:
+  free(buf);
+}
+
+int count_map(void* ud, int worker, size_t offset, staj_context* ctx, void** result) {
+  __atomic_fetch_add((int*) ud, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+void test21(int test) {
+  const char* good[] = { "[]", " [ ] ", "[ 1 ]", "[ \"a,]\\\"\", { \"b\" : [ 1, \"]\" ] }, null ]\n" };
+  int ngood[] = { 0, 0, 1, 3 };
+  const char* bad[] = { "", "{}", "[ 1, , 2 ]", "[ 1, ]", "[ 1 2 ]", "[ 1 ], [ 2 ]", "[ \"a ]", "[ [ 1 ]", "[ 1 ] ]" };
+  int nrecords = 50000;
+  char slashes[200];
+  char* buf = (char*) malloc(16 << 20);
+  struct ndjson_totals t;
+  size_t len;
+  int threads;
+  int count;
+  int i;
+  tests[test] = 1;
+  for (i=0; i<sizeof(good) / sizeof(good[0]); i++) {
+    count = 0;
+    assert(test, "good array", staj_parallel_array(good[i], strlen(good[i]), 2, &count_map, NULL, &count) == 0 &&
+           count == ngood[i]);
+    if (!tests[test]) goto test21_exit;
+  }
+  for (i=0; i<sizeof(bad) / sizeof(bad[0]); i++) {
+    count = 0;
+    errno = 0;
+    assert(test, "bad array", staj_parallel_array(bad[i], strlen(bad[i]), 2, &count_map, NULL, &count) == -1 &&
+           errno == STAJ_EPARSE);
+    if (!tests[test]) goto test21_exit;
+  }
+
+  memset(slashes, '\\', sizeof(slashes));
+
+  /* brackets, commas, quotes and backslash runs in strings, so that chunks start anywhere in them */
+  len = sprintf(buf, "[\n");
+  for (i=0; i<nrecords; i++) {
+    len += sprintf(buf + len, "%s{ \"id\" : %d, \"s\" : \"%.*s\\\"],[{,\", \"t\" : [ { }, [ ] ] }", i ? ",\n" : "  ",
+                   i, 2 * (i % 97), slashes);
+  }
+  len += sprintf(buf + len, "\n]\n");
+  for (threads=1; threads<=4; threads+=3) {
+    long sum = 0;
+    memset(&t, 0, sizeof(t));
+    t.abort_at = -1;
+    t.element = 1;
+    assert(test, "unordered", staj_parallel_array(buf, len, threads, &ndjson_map, NULL, &t) == 0);
+    if (!tests[test]) goto test21_exit;
+    for (i=0, count=0; i<8; i++) {
+      sum += t.sums[i];
+      count += t.counts[i];
+    }
+    assert(test, "all the elements", count == nrecords && sum == (long) nrecords * (nrecords - 1) / 2);
+    if (!tests[test]) goto test21_exit;
+
+    memset(&t, 0, sizeof(t));
+    t.abort_at = -1;
+    t.element = 1;
+    assert(test, "ordered", staj_parallel_array(buf, len, threads, &ndjson_map, &ndjson_emit, &t) == 0 &&
+           t.bad == 0 && t.next == nrecords);
+    if (!tests[test]) goto test21_exit;
+
+    memset(&t, 0, sizeof(t));
+    t.abort_at = 33333;
+    t.element = 1;
+    assert(test, "stopped", staj_parallel_array(buf, len, threads, &ndjson_map, &ndjson_emit, &t) == 3);
+    if (!tests[test]) goto test21_exit;
+  }
+
+  /* an error past what the callback reads */
+  memcpy(strstr(buf, "{ \"id\" : 44444,") + 40, "x", 1);
+  memset(&t, 0, sizeof(t));
+  t.abort_at = -1;
+  t.element = 1;
+  errno = 0;
+  assert(test, "invalid element", staj_parallel_array(buf, len, 4, &ndjson_map, NULL, &t) == -1 &&
+         errno == STAJ_EPARSE);
+
+test21_exit:
+  free(buf);
+}
+
+void test22(int test) {
+  /* the same error from both engines, wherever the input breaks off */
+  const char* docs[] = { "[ 1", "[ 1 ", "{ \"a\" : 1", "{ \"a\" ", "[ \"a\"", "[ true", "[ 1.5e3",
+                         "[ 1 2 ]", "{ \"a\" 1 }", "{ \"a\" : 1 : 2 }", "[ 1 } ", "{ 1 : 2 }", "[ : ]", "[ 01 ]" };
+  int errors[] = { STAJ_UNEXPECTED_EOF, STAJ_UNEXPECTED_EOF, STAJ_UNEXPECTED_EOF, STAJ_UNEXPECTED_EOF,
+                   STAJ_UNEXPECTED_EOF, STAJ_UNEXPECTED_EOF, STAJ_UNEXPECTED_EOF,
+                   STAJ_UNEXPECTED_SYMBOL, STAJ_UNEXPECTED_SYMBOL, STAJ_UNEXPECTED_SYMBOL, STAJ_UNEXPECTED_SYMBOL,
+                   STAJ_UNEXPECTED_SYMBOL, STAJ_UNEXPECTED_SYMBOL, STAJ_INVALID_NUMBER_FORMAT };
+  staj_context* ctx = NULL;
+  int indexed;
+  int i;
+  int r;
+  tests[test] = 1;
+  for (i=0; i<sizeof(docs) / sizeof(docs[0]); i++) {
+    for (indexed=0; indexed<2; indexed++) {
+      if (indexed) {
+        staj_parse_indexed(docs[i], strlen(docs[i]), &ctx);
+      } else {
+        staj_parse_buffer(docs[i], &ctx);
+      }
+      while ((r = staj_next(ctx)) == 0 && staj_get_token(ctx) != STAJ_EOF);
+      assert(test, "parse error", r == -1 && errno == STAJ_EPARSE && staj_get_parse_error(ctx) == errors[i]);
+      staj_release_context(ctx);
+      if (!tests[test]) {
+        fprintf(stderr, "%s (%s)\n", docs[i], indexed ? "indexed" : "plain");
+        return;
+      }
+    }
+  }
+}
+
+void test23(int test) {
+  const char* good[] = { TEST0, TEST1, TEST2, TEST3, TEST4, TEST5, TEST6, TEST7, TEST8, TEST10,
+                         "[]", " { } ", "[ \"\\\"]\", [ { \"a\" : [ ] } ] ]" };
+  const char* bad[] = { "", "  ", "1", "[ 1", "[ 1, ]", "[ 1 2 ]", "{ \"a\" 1 }", "{ 1 : 2 }",
+                        "[ 01 ]", "[ tru ]", "[ \"a ]", "[ \"\\x\" ]", "[ \"\xff\" ]", "[ ] ]", "[ ] x", "[ 1 } ",
+                        TEST9, TEST11 };
+  /* where the error is found */
+  const char* at[] = { "[ 1, ]", "{ \"a\" : [ 1 ] , }", "[ \"a\" : 1 ]", "[ 1 ] [", "[ 1, -x ]" };
+  int pos[] = { 5, 16, 6, 6, 5 };
+  staj_context* ctx;
+  char* big;
+  int len;
+  int r;
+  int i;
+  int error_pos;
+  tests[test] = 1;
+  for (i=0; i<sizeof(good) / sizeof(good[0]); i++) {
+    assert(test, "valid document", staj_validate(good[i], strlen(good[i]), NULL) == 0);
+    if (!tests[test]) return;
+  }
+  for (i=0; i<sizeof(bad) / sizeof(bad[0]); i++) {
+    errno = 0;
+    error_pos = -1;
+    assert(test, "invalid document", staj_validate(bad[i], strlen(bad[i]), &error_pos) == -1 &&
+           errno == STAJ_EPARSE && error_pos >= 0 && error_pos <= strlen(bad[i]));
+    if (!tests[test]) return;
+    /* where staj_next stops too */
+    staj_parse_buffer_len(bad[i], strlen(bad[i]), &ctx);
+    while ((r = staj_next(ctx)) == 0 && staj_get_token(ctx) != STAJ_EOF);
+    staj_release_context(ctx);
+    assert(test, "staj_next agrees", r == -1);
+    if (!tests[test]) return;
+  }
+  for (i=0; i<sizeof(at) / sizeof(at[0]); i++) {
+    assert(test, "error position", staj_validate(at[i], strlen(at[i]), &error_pos) == -1 &&
+           error_pos == pos[i]);
+    if (!tests[test]) return;
+  }
+
+  /* larger than the window stage 1 indexes at once, and an error at the end of it */
+  big = (char*) malloc(1 << 20);
+  len = sprintf(big, "[");
+  for (i=0; i<20000; i++) {
+    len += sprintf(big + len, "%s{ \"n\" : %d, \"s\" : \"\\\\\\\" [{\" }", i ? ", " : "", i);
+  }
+  len += sprintf(big + len, "]");
+  assert(test, "large document", staj_validate(big, len, NULL) == 0);
+  if (tests[test]) {
+    big[len - 1] = '}';
+    assert(test, "large document, wrong bracket", staj_validate(big, len, &error_pos) == -1 &&
+           error_pos == len - 1);
+  }
+  free(big);
+}
+
+/*
+ * The parse error of the document at buf, or -1 if it is valid: mode 0
+ * reads it from one buffer, 1 in 3-byte chunks, 2 in indexed mode
+ */
+static
+int parse_error_in(char* buf, int len, int mode) {
+  struct chunked_source src = { buf, len, 0, 3, 0 };
+  staj_context* ctx;
+  int r;
+  if (mode == 0) {
+    staj_parse_buffer_len(buf, len, &ctx);
+  } else
+  if (mode == 1) {
+    staj_parse_stream(&chunked_next_buffer, &chunked_release_buffer, &src, 4, &ctx);
+  } else {
+    staj_parse_indexed(buf, len, &ctx);
+  }
+  while ((r = staj_next(ctx)) == 0 && staj_get_token(ctx) != STAJ_EOF);
+  r = r == 0 ? -1 : staj_get_parse_error(ctx);
+  staj_release_context(ctx);
+  return r;
+}
+
+void test24(int test) {
+  const char* good[] = { "\xF0\x9F\x98\x80", "\xF0\x90\x80\x80", "\xF1\x80\x80\x80", "\xF3\xBF\xBF\xBF",
+                         "\xF4\x8F\xBF\xBF", "\xE0\xA0\x80", "\xED\x9F\xBF", "\xEE\x80\x80", "\xEF\xBF\xBF",
+                         "\xC2\x80", "\xDF\xBF", "\x7F" };
+  const char* bad[] = { "\xC0\x80", "\xC1\xBF", "\xE0\x9F\xBF", "\xF0\x8F\xBF\xBF", /* overlong */
+                        "\xED\xA0\x80", "\xED\xBF\xBF", /* surrogates */
+                        "\xF4\x90\x80\x80", "\xF5\x80\x80\x80", "\xFF", /* above U+10FFFF */
+                        "\x80", "\xC2", "\xE1\x80", "\xF1\x80\x80", "\xE1\x80z", "\x01" };
+  const char* text = "\xD0\x9F\xD1\x80\xD0\xB8\xD0\xB2\xD0\xB5\xD1\x82, \xE6\x97\xA5\xE6\x9C\xAC\xE8\xAA\x9E \xF0\x9F\x98\x80 ";
+  char buf[1024];
+  int len;
+  int mode;
+  int i;
+  int j;
+  tests[test] = 1;
+  for (i=0; i<sizeof(good) / sizeof(good[0]); i++) {
+    len = sprintf(buf, "[ \"a%sb\", \"%s\" ]", good[i], good[i]);
+    for (mode=0; mode<3; mode++) {
+      assert(test, "valid UTF-8", parse_error_in(buf, len, mode) == -1);
+      if (!tests[test]) return;
+    }
+    assert(test, "valid UTF-8", staj_validate(buf, len, NULL) == 0);
+    if (!tests[test]) return;
+  }
+  /* every position in long strings, so that the vectorized check sees them too */
+  for (i=0; i<sizeof(bad) / sizeof(bad[0]); i++) {
+    for (j=0; j<70; j+=3) {
+      len = sprintf(buf, "[ \"%.*s%s%s\" ]", j, "0123456789012345678901234567890123456789012345678901234567890123456789",
+                    bad[i], text);
+      for (mode=0; mode<3; mode++) {
+        assert(test, "invalid UTF-8", parse_error_in(buf, len, mode) == STAJ_INVALID_UTF8_SEQUENCE);
+        if (!tests[test]) return;
+      }
+      assert(test, "invalid UTF-8", staj_validate(buf, len, NULL) == -1);
+      if (!tests[test]) return;
+    }
+  }
+  len = sprintf(buf, "[ \"");
+  for (i=0; i<10; i++) {
+    len += sprintf(buf + len, "%s", text);
+  }
+  len += sprintf(buf + len, "\" ]");
+  for (mode=0; mode<3; mode++) {
+    assert(test, "multilingual text", parse_error_in(buf, len, mode) == -1);
+    if (!tests[test]) return;
+  }
+}
+
+void test25(int test) {
+  char doc[] = "[ \"a\\u00e9\\u20AC\\ud83d\\ude00\\n\\\"x\\\\\\/\", "
+               "\"0123456789abcdefghijklmnopqrstuvwxyz0123456789\\tabcdefghijklmnopqrstuvwxyz\" ]";
+  char* halves[] = { "[ \"a\\ud83d\", \"b\" ]", "[ \"\\ude00\", \"b\" ]", "[ \"\\ud83dx\", \"b\" ]",
+                     "[ \"\\ud83d\\u0041\", \"b\" ]", "[ \"\\ud83d\\n\", \"b\" ]",
+                     "[ \"\\ud83d\\ud83d\\ude00\", \"b\" ]" };
+  const char* decoded[] = { "a\xED\xA0\xBD", "\xED\xB8\x80", "\xED\xA0\xBDx", "\xED\xA0\xBD" "A",
+                            "\xED\xA0\xBD\n", "\xED\xA0\xBD\xF0\x9F\x98\x80" };
+  const char* expected = "a\xC3\xA9\xE2\x82\xAC\xF0\x9F\x98\x80\n\"x\\/";
+  const char* longer = "0123456789abcdefghijklmnopqrstuvwxyz0123456789\tabcdefghijklmnopqrstuvwxyz";
+  char utf8[] = "[ \"x\xC3\xA9y\xE2\x82\xACz\" ]";
+  /* the length of the result for max 1 to 8 */
+  int cuts[] = { 1, 1, 3, 4, 4, 4, 7, 8 };
+  struct chunked_source src = { doc, strlen(doc), 0, 3, 0 };
+  staj_context* ctx;
+  char buf[100];
+  int mode;
+  int i;
+  tests[test] = 1;
+  for (mode=0; mode<2; mode++) {
+    src.pos = 0;
+    if (mode == 0) {
+      staj_parse_buffer(doc, &ctx);
+    } else {
+      /* escapes cut between the buffers */
+      staj_parse_stream(&chunked_next_buffer, &chunked_release_buffer, &src, 100, &ctx);
+    }
+    staj_next(ctx);
+    staj_next(ctx);
+    assert(test, "escapes and a surrogate pair", staj_tostr(ctx, buf, sizeof(buf)) == strlen(expected) &&
+           strcmp(buf, expected) == 0);
+    if (!tests[test]) goto test25_exit;
+    /* no partial character when the result does not fit */
+    memset(buf, 'Z', sizeof(buf));
+    assert(test, "cut result", staj_tostr(ctx, buf, 8) == 6 && memcmp(buf, expected, 6) == 0 && buf[6] == 0 &&
+           buf[8] == 'Z');
+    if (!tests[test]) goto test25_exit;
+    staj_next(ctx);
+    assert(test, "longer string", staj_tostr(ctx, buf, sizeof(buf)) == strlen(longer) && strcmp(buf, longer) == 0);
+    if (!tests[test]) goto test25_exit;
+    staj_release_context(ctx);
+  }
+  /* a lone half of a pair is the 3 bytes of the code unit, as before,
+     and the document goes on */
+  for (i=0; i<2 * sizeof(halves) / sizeof(halves[0]); i++) {
+    struct chunked_source half = { halves[i / 2], strlen(halves[i / 2]), 0, 1, 0 };
+    if (i % 2 == 0) {
+      staj_parse_buffer(halves[i / 2], &ctx);
+    } else {
+      staj_parse_stream(&chunked_next_buffer, &chunked_release_buffer, &half, 100, &ctx);
+    }
+    staj_next(ctx);
+    staj_next(ctx);
+    assert(test, "half of a surrogate pair", staj_tostr(ctx, buf, sizeof(buf)) == strlen(decoded[i / 2]) &&
+           strcmp(buf, decoded[i / 2]) == 0);
+    if (!tests[test]) goto test25_exit;
+    assert(test, "value after the half", staj_next(ctx) == 0 && staj_get_token(ctx) == STAJ_STRING &&
+           staj_tostr(ctx, buf, sizeof(buf)) == 1 && strcmp(buf, "b") == 0);
+    if (!tests[test]) goto test25_exit;
+    staj_release_context(ctx);
+  }
+  /* a 2- and a 3-byte character in the input across the end of the
+     result, also cut between the buffers */
+  for (mode=0; mode<2; mode++) {
+    struct chunked_source raw = { utf8, strlen(utf8), 0, 3, 0 };
+    if (mode == 0) {
+      staj_parse_buffer(utf8, &ctx);
+    } else {
+      staj_parse_stream(&chunked_next_buffer, &chunked_release_buffer, &raw, 100, &ctx);
+    }
+    staj_next(ctx);
+    staj_next(ctx);
+    for (i=1; i<=8; i++) {
+      memset(buf, 'Z', sizeof(buf));
+      assert(test, "cut before a character", staj_tostr(ctx, buf, i) == cuts[i - 1] &&
+             memcmp(buf, utf8 + 3, cuts[i - 1]) == 0 && (cuts[i - 1] == i || buf[cuts[i - 1]] == 0));
+      if (!tests[test]) goto test25_exit;
+    }
+    staj_release_context(ctx);
+  }
+  return;
+
+test25_exit:
+  staj_release_context(ctx);
+}
+
+/*
+ * Read the current string token with staj_read_string in pieces of at
+ * most piece bytes
+ */
+static
+int read_string_pieces(staj_context* ctx, char* buf, int max, int piece) {
+  int len = 0;
+  int r = 0;
+  while (len + piece <= max && (r = staj_read_string(ctx, buf + len, piece)) > 0) {
+    len += r;
+  }
+  return r < 0 ? -1 : len;
+}
+
+void test26(int test) {
+  const char* errors[] = { "[ \"ab\x01\" ]", "[ \"ab\\x\" ]", "[ \"ab\xC3(\" ]", "[ \"ab" };
+  struct chunked_source src = { NULL, 0, 0, 16, 0 };
+  staj_context* ctx = NULL;
+  char* doc = malloc(20000);
+  char* expected = malloc(10000);
+  char* buf = malloc(10000);
+  int len = 0;
+  int n = 0;
+  int mode;
+  int i;
+  tests[test] = 1;
+  len += sprintf(doc, "{ \"big\": \"");
+  for (i=0; i<800; i++) {
+    len += sprintf(doc + len, i % 10 == 0 ? "abc\\n\xC3\xA9\\u20ACdef" : "abcdefghij");
+    n += sprintf(expected + n, i % 10 == 0 ? "abc\n\xC3\xA9\xE2\x82\xAC" "def" : "abcdefghij");
+  }
+  len += sprintf(doc + len, "\", \"n\": [ 1, \"skipped \\\" \\u00e9 rest\" ], \"k\": \"\\ud83d\\ude00\" }");
+  src.buf = doc;
+  src.len = len;
+  for (mode=0; mode<2; mode++) {
+    src.pos = 0;
+    if (mode == 0) {
+      /* four slots of 16 bytes for a value of 10k */
+      staj_parse_stream(&chunked_next_buffer, &chunked_release_buffer, &src, 4, &ctx);
+      staj_set_flags(ctx, STAJ_LAZY_STRINGS);
+    } else {
+      staj_parse_buffer(doc, &ctx);
+    }
+    staj_next(ctx);
+    staj_next(ctx);
+    assert(test, "property name", staj_read_string(ctx, buf, 1) == 1 && staj_read_string(ctx, buf + 1, 10) == 2 &&
+           staj_read_string(ctx, buf + 3, 10) == 0 && memcmp(buf, "big", 3) == 0);
+    if (!tests[test]) goto test26_exit;
+    assert(test, "value", staj_next(ctx) == 0 && staj_get_token(ctx) == STAJ_STRING);
+    if (!tests[test]) goto test26_exit;
+    assert(test, "value in pieces", read_string_pieces(ctx, buf, 10000, 7) == n && memcmp(buf, expected, n) == 0);
+    if (!tests[test]) goto test26_exit;
+    assert(test, "nothing after the end", staj_read_string(ctx, buf, 10) == 0);
+    if (!tests[test]) goto test26_exit;
+    staj_next(ctx);
+    staj_next(ctx);
+    staj_next(ctx);
+    staj_next(ctx);
+    /* a value left after the first piece */
+    assert(test, "first piece", staj_read_string(ctx, buf, 3) == 3 && memcmp(buf, "ski", 3) == 0);
+    if (!tests[test]) goto test26_exit;
+    assert(test, "rest skipped", staj_next(ctx) == 0 && staj_get_token(ctx) == STAJ_END_ARRAY &&
+           staj_next(ctx) == 0 && staj_get_token(ctx) == STAJ_PROPERTY_NAME);
+    if (!tests[test]) goto test26_exit;
+    staj_next(ctx);
+    /* the 4 bytes of the surrogate pair over two pieces */
+    assert(test, "cut character", staj_read_string(ctx, buf, 3) == 3 && staj_read_string(ctx, buf + 3, 3) == 1 &&
+           staj_read_string(ctx, buf, 3) == 0 && memcmp(buf, "\xF0\x9F\x98\x80", 4) == 0);
+    if (!tests[test]) goto test26_exit;
+    assert(test, "end", staj_next(ctx) == 0 && staj_get_token(ctx) == STAJ_END_OBJECT &&
+           staj_next(ctx) == 0 && staj_get_token(ctx) == STAJ_EOF);
+    if (!tests[test]) goto test26_exit;
+    errno = 0;
+    assert(test, "not a string", staj_read_string(ctx, buf, 10) == -1 && errno == STAJ_EINVAL);
+    if (!tests[test]) goto test26_exit;
+    staj_release_context(ctx);
+    ctx = NULL;
+  }
+  for (i=0; i<sizeof(errors) / sizeof(errors[0]); i++) {
+    staj_parse_buffer(errors[i], &ctx);
+    staj_set_flags(ctx, STAJ_LAZY_STRINGS);
+    staj_next(ctx);
+    staj_next(ctx);
+    errno = 0;
+    assert(test, "malformed lazy string", read_string_pieces(ctx, buf, 10000, 10) == -1 && errno == STAJ_EPARSE &&
+           staj_next(ctx) == -1);
+    if (!tests[test]) goto test26_exit;
+    staj_release_context(ctx);
+    ctx = NULL;
+  }
+  /* a lone half of a pair, the character after it in the next buffer */
+  src.buf = "[ \"\\ud83d\", \"\\ud83d\\ud83d\\ude00\", \"b\" ]";
+  src.len = strlen(src.buf);
+  src.pos = 0;
+  src.chunk = 1;
+  staj_parse_stream(&chunked_next_buffer, &chunked_release_buffer, &src, 16, &ctx);
+  staj_set_flags(ctx, STAJ_LAZY_STRINGS);
+  staj_next(ctx);
+  staj_next(ctx);
+  assert(test, "half of a surrogate pair", read_string_pieces(ctx, buf, 10000, 2) == 3 &&
+         memcmp(buf, "\xED\xA0\xBD", 3) == 0);
+  if (!tests[test]) goto test26_exit;
+  staj_next(ctx);
+  assert(test, "half and a pair", read_string_pieces(ctx, buf, 10000, 10) == 7 &&
+         memcmp(buf, "\xED\xA0\xBD\xF0\x9F\x98\x80", 7) == 0);
+  if (!tests[test]) goto test26_exit;
+  assert(test, "value after the half", staj_next(ctx) == 0 && read_string_pieces(ctx, buf, 10000, 10) == 1 &&
+         buf[0] == 'b');
+
+test26_exit:
+  if (ctx != NULL) {
+    staj_release_context(ctx);
+  }
+  free(doc);
+  free(expected);
+  free(buf);
+}
+
+/*
+ * Feed the next chunk of src to a push context, the end of the input
+ * after the last one
+ */
+static
+int feed_chunk(staj_context* ctx, struct chunked_source* src) {
+  int n = src->len - src->pos < src->chunk ? src->len - src->pos : src->chunk;
+  src->pos += n;
+  return staj_feed(ctx, n > 0 ? src->buf + src->pos - n : NULL, n);
+}
+
+/*
+ * The tokens of the input with their text, feeding src whenever the
+ * input runs out
+ */
+static
+int push_trace(staj_context* ctx, struct chunked_source* src, char* out, int max) {
+  int len = 0;
+  int again = 0;
+  for (;;) {
+    if (staj_next(ctx) != 0) {
+      if (src == NULL || errno != STAJ_EAGAIN || src->pos > src->len || again++ > src->len) {
+        return -1;
+      }
+      if (feed_chunk(ctx, src) != 0) {
+        return -1;
+      }
+      continue;
+    }
+    len += sprintf(out + len, "%d:", staj_get_token(ctx));
+    if (staj_get_token(ctx) == STAJ_EOF) {
+      return len;
+    }
+    len += staj_get_text(ctx, out + len, max - len);
+    len += sprintf(out + len, ";");
+  }
+}
+
+/*
+ * A non-blocking source that has no input every other time it is asked
+ */
+static
+int flaky_next_buffer(void* ctx, int* len, const char** buf) {
+  static int calls = 0;
+  if (calls++ % 2 == 0) {
+    return STAJ_EAGAIN;
+  }
+  return chunked_next_buffer(ctx, len, buf);
+}
+
+/*
+ * A source that runs out of memory after its first buffer
+ */
+static
+int oom_next_buffer(void* ctx, int* len, const char** buf) {
+  struct chunked_source* src = (struct chunked_source*) ctx;
+  if (src->pos > 0) {
+    return STAJ_ENOMEM;
+  }
+  return chunked_next_buffer(ctx, len, buf);
+}
+
+void test27(int test) {
+  char doc[] = "{ \"a\": [ 1, -2.5e3, true, null, \"str\\u00e9ing\", [], {} ], \"b\": { \"c\": false },\n"
+               "  \"d\": [ [ \"x\\\"]\" ], { \"e\": 123456789 } ], \"f\": \"last\" }";
+  struct chunked_source src = { doc, strlen(doc), 0, 1, 0 };
+  staj_context* ctx = NULL;
+  char expected[1000];
+  char buf[1000];
+  int n;
+  int chunk;
+  int r;
+  tests[test] = 1;
+  staj_parse_buffer(doc, &ctx);
+  n = push_trace(ctx, NULL, expected, sizeof(expected));
+  staj_release_context(ctx);
+  ctx = NULL;
+  assert(test, "buffer", n > 0);
+  if (!tests[test]) goto test27_exit;
+
+  for (chunk=1; chunk<=7; chunk++) {
+    /* windowed: each buffer goes back once it is consumed */
+    src.pos = 0;
+    src.chunk = chunk;
+    src.released = 0;
+    staj_parse_push(&chunked_release_buffer, &src, 4, &ctx);
+    assert(test, "windowed", push_trace(ctx, &src, buf, sizeof(buf)) == n && memcmp(buf, expected, n) == 0);
+    if (!tests[test]) goto test27_exit;
+    staj_release_context(ctx);
+    ctx = NULL;
+    assert(test, "buffers handed back", src.released == src.len);
+    if (!tests[test]) goto test27_exit;
+
+    /* fixed: every buffer takes a slot */
+    src.pos = 0;
+    staj_parse_push(NULL, NULL, src.len / chunk + 2, &ctx);
+    assert(test, "fixed", push_trace(ctx, &src, buf, sizeof(buf)) == n && memcmp(buf, expected, n) == 0);
+    if (!tests[test]) goto test27_exit;
+    staj_release_context(ctx);
+    ctx = NULL;
+  }
+
+  /* a pull source may say that it has no input yet, too */
+  src.pos = 0;
+  src.chunk = 3;
+  staj_parse_stream(&flaky_next_buffer, &chunked_release_buffer, &src, 4, &ctx);
+  do {
+    r = staj_next(ctx);
+  } while (r == 0 ? staj_get_token(ctx) != STAJ_EOF : errno == STAJ_EAGAIN);
+  assert(test, "non-blocking source", r == 0);
+  if (!tests[test]) goto test27_exit;
+  staj_release_context(ctx);
+  ctx = NULL;
+
+  /* the value of a property skipped as the input comes */
+  src.pos = 0;
+  src.chunk = 2;
+  staj_parse_push(&chunked_release_buffer, &src, 4, &ctx);
+  feed_chunk(ctx, &src);
+  while ((r = staj_next(ctx)) != 0 || staj_get_token(ctx) != STAJ_PROPERTY_NAME ||
+         staj_get_text(ctx, buf, sizeof(buf)) != 3 || strcmp(buf, "\"d\"") != 0) {
+    if (r != 0) {
+      feed_chunk(ctx, &src);
+    }
+  }
+  while ((r = staj_skip_value(ctx)) != 0 && errno == STAJ_EAGAIN) {
+    feed_chunk(ctx, &src);
+  }
+  assert(test, "skipped", r == 0 && staj_get_token(ctx) == STAJ_END_ARRAY);
+  if (!tests[test]) goto test27_exit;
+  while ((r = staj_next(ctx)) != 0 && errno == STAJ_EAGAIN) {
+    feed_chunk(ctx, &src);
+  }
+  assert(test, "after the skipped value", r == 0 && staj_get_text(ctx, buf, sizeof(buf)) == 3 &&
+         strcmp(buf, "\"f\"") == 0);
+  if (!tests[test]) goto test27_exit;
+  staj_release_context(ctx);
+  ctx = NULL;
+
+  /* a lazy string read as it arrives */
+  src.pos = 0;
+  src.chunk = 3;
+  staj_parse_push(&chunked_release_buffer, &src, 4, &ctx);
+  staj_set_flags(ctx, STAJ_LAZY_STRINGS);
+  while ((r = staj_next(ctx)) != 0 || staj_get_token(ctx) != STAJ_STRING) {
+    feed_chunk(ctx, &src);
+  }
+  n = 0;
+  while ((r = staj_read_string(ctx, buf + n, 2)) != 0) {
+    if (r < 0) {
+      assert(test, "lazy string again", errno == STAJ_EAGAIN && feed_chunk(ctx, &src) == 0);
+      if (!tests[test]) goto test27_exit;
+    } else {
+      n += r;
+    }
+  }
+  assert(test, "lazy string", n == 8 && memcmp(buf, "str\xC3\xA9ing", 8) == 0);
+  if (!tests[test]) goto test27_exit;
+  while ((r = staj_next(ctx)) != 0 && errno == STAJ_EAGAIN) {
+    feed_chunk(ctx, &src);
+  }
+  assert(test, "after the lazy string", r == 0 && staj_get_token(ctx) == STAJ_BEGIN_ARRAY);
+  if (!tests[test]) goto test27_exit;
+
+  /* one buffer at a time */
+  assert(test, "buffer waiting", staj_feed(ctx, "1", 1) == 0 && staj_feed(ctx, "2", 1) == -1 &&
+         errno == STAJ_EINVAL);
+  if (!tests[test]) goto test27_exit;
+  staj_release_context(ctx);
+  ctx = NULL;
+
+  /* the end of the input is fed, too */
+  staj_parse_push(NULL, NULL, 4, &ctx);
+  staj_feed(ctx, "[ 1 ]", 5);
+  assert(test, "end of input", staj_next(ctx) == 0 && staj_next(ctx) == 0 && staj_next(ctx) == -1 &&
+         errno == STAJ_EAGAIN && staj_feed(ctx, NULL, 0) == 0 && staj_next(ctx) == 0 &&
+         staj_get_token(ctx) == STAJ_END_ARRAY && staj_next(ctx) == 0 && staj_get_token(ctx) == STAJ_EOF);
+  if (!tests[test]) goto test27_exit;
+  staj_release_context(ctx);
+  ctx = NULL;
+
+  staj_parse_buffer(doc, &ctx);
+  assert(test, "not a push context", staj_feed(ctx, "1", 1) == -1 && errno == STAJ_EINVAL);
+  if (!tests[test]) goto test27_exit;
+  staj_release_context(ctx);
+  ctx = NULL;
+
+  /* out of memory is not a read error */
+  src.pos = 0;
+  src.chunk = 3;
+  staj_parse_stream(&oom_next_buffer, &chunked_release_buffer, &src, 4, &ctx);
+  assert(test, "source out of memory", staj_next(ctx) == 0 &&
+         staj_next(ctx) == -1 && errno == STAJ_ENOMEM);
+
+test27_exit:
+  if (ctx != NULL) {
+    staj_release_context(ctx);
+  }
+}
+
+void test28(int test) {
+  char path[] = "/tmp/test_staj_XXXXXX";
+  char* doc = (char*) malloc(30000);
+  char* expected = (char*) malloc(100000);
+  char* trace = (char*) malloc(100000);
+  staj_context* ctx = NULL;
+  int fds[2] = { -1, -1 };
+  int len = 0;
+  int n;
+  int flags;
+  int fd;
+  int i;
+  tests[test] = 1;
+  len += sprintf(doc, "[");
+  for (i=0; i<300; i++) {
+    len += sprintf(doc + len, "%s{ \"id\": %d, \"name\": \"item %d\", \"tags\": [ true, null, -%d.5e1 ] }",
+                   i > 0 ? ", " : "", i, i * 7, i);
+  }
+  len += sprintf(doc + len, "]");
+  staj_parse_buffer_len(doc, len, &ctx);
+  n = push_trace(ctx, NULL, expected, 100000);
+  staj_release_context(ctx);
+  ctx = NULL;
+
+  fd = mkstemp(path);
+  assert(test, "mkstemp", fd >= 0);
+  if (!tests[test]) goto test28_exit;
+  assert(test, "write", write(fd, doc, len) == len);
+  if (!tests[test]) goto test28_unlink;
+  for (flags = 0; flags <= STAJ_ASYNC_THREAD; flags++) {
+    /* chunks that cut the tokens, more reads ahead than slots */
+    lseek(fd, 0, SEEK_SET);
+    assert(test, "staj_parse_fd_async", staj_parse_fd_async(fd, 100, 6, flags, &ctx) == 0);
+    if (!tests[test]) goto test28_unlink;
+    assert(test, "file", push_trace(ctx, NULL, trace, 100000) == n && memcmp(trace, expected, n) == 0);
+    if (!tests[test]) goto test28_unlink;
+    staj_release_context(ctx);
+    ctx = NULL;
+
+    /* released before the end */
+    lseek(fd, 0, SEEK_SET);
+    staj_parse_fd_async(fd, 64, 0, flags, &ctx);
+    for (i=0; i<6; i++) {
+      staj_next(ctx);
+    }
+    assert(test, "in the middle", staj_get_token(ctx) == STAJ_STRING);
+    if (!tests[test]) goto test28_unlink;
+    staj_release_context(ctx);
+    ctx = NULL;
+  }
+
+  /* a pipe goes to the reader thread, also when no more input comes */
+  assert(test, "pipe", pipe(fds) == 0);
+  if (!tests[test]) goto test28_unlink;
+  assert(test, "write", write(fds[1], doc, 1000) == 1000);
+  if (!tests[test]) goto test28_unlink;
+  staj_parse_fd_async(fds[0], 0, 0, 0, &ctx);
+  for (i=0; i<6; i++) {
+    staj_next(ctx);
+  }
+  assert(test, "pipe", staj_get_token(ctx) == STAJ_STRING);
+  if (!tests[test]) goto test28_unlink;
+  staj_release_context(ctx);
+  ctx = NULL;
+
+test28_unlink:
+  if (ctx != NULL) {
+    staj_release_context(ctx);
+  }
+  if (fds[0] >= 0) {
+    close(fds[0]);
+    close(fds[1]);
+  }
+  close(fd);
+  unlink(path);
+test28_exit:
+  free(doc);
+  free(expected);
+  free(trace);
+}
+
 int main() {
   int test = 0;
   test0(test++);
@@ -337,6 +2075,30 @@ int main() {
   test2(test++);
   test3(test++);
   test4(test++);
+  test5(test++);
+  test6(test++);
+  test7(test++);
+  test8(test++);
+  test9(test++);
+  test10(test++);
+  test11(test++);
+  test12(test++);
+  test13(test++);
+  test14(test++);
+  test15(test++);
+  test16(test++);
+  test17(test++);
+  test18(test++);
+  test19(test++);
+  test20(test++);
+  test21(test++);
+  test22(test++);
+  test23(test++);
+  test24(test++);
+  test25(test++);
+  test26(test++);
+  test27(test++);
+  test28(test++);
 
   int good = 1;
   int i;